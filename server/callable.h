@@ -0,0 +1,163 @@
+#ifndef __WILL_CALLABLE_H__
+#define __WILL_CALLABLE_H__
+
+#include <cstddef>
+#include <functional>
+#include <new>
+#include <type_traits>
+#include <typeinfo>
+#include <utility>
+
+namespace will {
+
+// 签名为void()的可调用对象的类型擦除封装，用来替代调度任务里的std::function
+// 可调用对象不超过INLINE_SIZE字节时直接存放在对象内部，不需要堆分配，超过时才退化为堆分配
+// 只能移动不能拷贝，任务在队列之间移动时不会复制捕获的参数
+class Callable {
+public:
+    // 内联存储的大小，足够存放std::bind(成员函数指针, shared_ptr, shared_ptr)
+    static const size_t INLINE_SIZE = 48;
+
+    Callable() {}
+
+    Callable(std::nullptr_t) {}
+
+    template <class F, class = typename std::enable_if<
+                           !std::is_same<typename std::decay<F>::type, Callable>::value>::type>
+    Callable(F &&f) {
+        init(std::forward<F>(f));
+    }
+
+    Callable(Callable &&other) {
+        moveFrom(other);
+    }
+
+    Callable &operator=(Callable &&other) {
+        if (this != &other) {
+            reset();
+            moveFrom(other);
+        }
+        return *this;
+    }
+
+    Callable &operator=(std::nullptr_t) {
+        reset();
+        return *this;
+    }
+
+    Callable(const Callable &) = delete;
+
+    Callable &operator=(const Callable &) = delete;
+
+    ~Callable() {
+        reset();
+    }
+
+    void operator()() {
+        m_ops->invoke(&m_storage);
+    }
+
+    explicit operator bool() const { return m_ops != nullptr; }
+
+    // 可调用对象是否存放在内部缓冲区
+    bool isInline() const { return m_ops && m_ops->inlined; }
+
+    // 可调用对象的类型，为空时返回typeid(void)，和std::function::target_type()一致
+    const std::type_info &targetType() const { return m_ops ? *m_ops->type : typeid(void); }
+
+    void reset() {
+        if (m_ops) {
+            m_ops->destroy(&m_storage);
+            m_ops = nullptr;
+        }
+    }
+
+private:
+    // 每种可调用对象类型对应一张静态函数表
+    struct Ops {
+        void (*invoke)(void *storage);
+        // 从src移动构造到dst，并析构src
+        void (*move)(void *dst, void *src);
+        void (*destroy)(void *storage);
+        bool inlined;
+        const std::type_info *type;
+    };
+
+    template <class T>
+    struct InlineOps {
+        static void Invoke(void *storage) { (*static_cast<T *>(storage))(); }
+        static void Move(void *dst, void *src) {
+            new (dst) T(std::move(*static_cast<T *>(src)));
+            static_cast<T *>(src)->~T();
+        }
+        static void Destroy(void *storage) { static_cast<T *>(storage)->~T(); }
+        static const Ops *Get() {
+            static const Ops ops = {&Invoke, &Move, &Destroy, true, &typeid(T)};
+            return &ops;
+        }
+    };
+
+    template <class T>
+    struct HeapOps {
+        static void Invoke(void *storage) { (**static_cast<T **>(storage))(); }
+        static void Move(void *dst, void *src) { *static_cast<T **>(dst) = *static_cast<T **>(src); }
+        static void Destroy(void *storage) { delete *static_cast<T **>(storage); }
+        static const Ops *Get() {
+            static const Ops ops = {&Invoke, &Move, &Destroy, false, &typeid(T)};
+            return &ops;
+        }
+    };
+
+    template <class T>
+    struct CanInline {
+        static const bool value = sizeof(T) <= INLINE_SIZE
+                                  && alignof(T) <= alignof(std::max_align_t)
+                                  && std::is_nothrow_move_constructible<T>::value;
+    };
+
+    // 空的std::function和空函数指针视为空任务
+    template <class T>
+    static bool IsNull(const T &) { return false; }
+    template <class T>
+    static bool IsNull(T *const &f) { return f == nullptr; }
+    static bool IsNull(const std::function<void()> &f) { return !f; }
+
+    template <class F>
+    void init(F &&f) {
+        typedef typename std::decay<F>::type T;
+        if (IsNull(f)) {
+            return;
+        }
+        construct<T>(std::forward<F>(f), std::integral_constant<bool, CanInline<T>::value>());
+    }
+
+    template <class T, class F>
+    void construct(F &&f, std::true_type) {
+        new (&m_storage) T(std::forward<F>(f));
+        m_ops = InlineOps<T>::Get();
+    }
+
+    template <class T, class F>
+    void construct(F &&f, std::false_type) {
+        *reinterpret_cast<T **>(&m_storage) = new T(std::forward<F>(f));
+        m_ops = HeapOps<T>::Get();
+    }
+
+    void moveFrom(Callable &other) {
+        if (other.m_ops) {
+            other.m_ops->move(&m_storage, &other.m_storage);
+            m_ops       = other.m_ops;
+            other.m_ops = nullptr;
+        }
+    }
+
+private:
+    // 可调用对象的函数表，为nullptr表示空
+    const Ops *m_ops = nullptr;
+    // 内联存储，堆分配时存放对象指针
+    typename std::aligned_storage<INLINE_SIZE, alignof(std::max_align_t)>::type m_storage;
+};
+
+} // namespace will
+
+#endif
@@ -0,0 +1,122 @@
+#include <algorithm>
+#include "channel.h"
+#include "util.h"
+
+namespace will {
+
+ChannelBase::ChannelBase(size_t capacity)
+    : m_capacity(capacity) {
+    WILL_ASSERT2(capacity > 0, "channel capacity must be at least 1");
+}
+
+void ChannelBase::close() {
+    std::vector<FiberWaitQueue::WaiterPtr> waiters;
+    SelectorList selectors;
+    Spinlock::Lock lock(m_lock);
+    if (m_closed) {
+        return;
+    }
+    m_closed = true;
+    m_senders.popAll(waiters);
+    m_receivers.popAll(waiters);
+    collectSelectors(selectors);
+    lock.unlock();
+    for (auto &i : waiters) {
+        FiberWaitQueue::Wake(i);
+    }
+    NotifySelectors(selectors);
+}
+
+bool ChannelBase::isClosed() {
+    Spinlock::Lock lock(m_lock);
+    return m_closed;
+}
+
+void ChannelBase::attach(const std::shared_ptr<FiberSemaphore> &selector) {
+    Spinlock::Lock lock(m_lock);
+    m_selectors.push_back(selector);
+}
+
+void ChannelBase::detach(const std::shared_ptr<FiberSemaphore> &selector) {
+    Spinlock::Lock lock(m_lock);
+    auto it = std::find(m_selectors.begin(), m_selectors.end(), selector);
+    if (it != m_selectors.end()) {
+        m_selectors.erase(it);
+    }
+}
+
+void ChannelBase::collectSelectors(SelectorList &selectors) {
+    if (!m_selectors.empty()) {
+        selectors = m_selectors;
+    }
+}
+
+void ChannelBase::NotifySelectors(const SelectorList &selectors) {
+    for (auto &i : selectors) {
+        i->notify();
+    }
+}
+
+bool ChannelBase::GetRemaining(uint64_t deadline, uint64_t &remaining) {
+    if (deadline == FIBER_WAIT_FOREVER) {
+        remaining = FIBER_WAIT_FOREVER;
+        return true;
+    }
+    uint64_t now = GetCurrentMS();
+    if (now >= deadline) {
+        return false;
+    }
+    remaining = deadline - now;
+    return true;
+}
+
+uint64_t ChannelBase::GetDeadline(uint64_t timeout_ms) {
+    if (timeout_ms == FIBER_WAIT_FOREVER) {
+        return FIBER_WAIT_FOREVER;
+    }
+    return GetCurrentMS() + timeout_ms;
+}
+
+ChannelSelect::ChannelSelect()
+    : m_ready(std::make_shared<FiberSemaphore>()) {
+}
+
+int ChannelSelect::tryOnce() {
+    for (size_t i = 0; i < m_cases.size(); ++i) {
+        size_t idx = (m_next + i) % m_cases.size();
+        if (m_cases[idx].enabled && m_cases[idx].op() != ChannelBase::OP_WOULD_BLOCK) {
+            m_next = idx + 1;
+            return idx;
+        }
+    }
+    return -1;
+}
+
+int ChannelSelect::wait(uint64_t timeout_ms) {
+    int idx = tryOnce();
+    if (idx >= 0 || timeout_ms == 0 || m_cases.empty()) {
+        return idx;
+    }
+    uint64_t deadline = ChannelBase::GetDeadline(timeout_ms);
+    // 先挂到所有通道上再重新尝试，挂上之后的状态变化都会通知m_ready，不会丢失
+    for (auto &i : m_cases) {
+        if (i.enabled) {
+            i.channel->attach(m_ready);
+        }
+    }
+    uint64_t remaining = 0;
+    while ((idx = tryOnce()) < 0 && ChannelBase::GetRemaining(deadline, remaining)) {
+        m_ready->wait(remaining);
+    }
+    for (auto &i : m_cases) {
+        if (i.enabled) {
+            i.channel->detach(m_ready);
+        }
+    }
+    // 清掉等待期间多余的通知，下次wait从干净的状态开始
+    while (m_ready->tryWait()) {
+    }
+    return idx;
+}
+
+} // namespace will
@@ -0,0 +1,284 @@
+#ifndef __WILL_CHANNEL_H__
+#define __WILL_CHANNEL_H__
+
+#include <stdint.h>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <vector>
+#include "fiber_sync.h"
+#include "macro.h"
+
+namespace will {
+
+// 协程之间传递数据的有界通道，和Go的channel类似
+// 通道满时发送方挂起，通道空时接收方挂起，挂起的是协程而不是线程，不需要轮询sleep
+// 关闭后不能再发送，接收方可以继续取完剩下的数据，取完后接收返回false
+// 超时由当前IOManager的定时器实现，只能在调度器调度的协程里阻塞等待，try系列接口可以在任何地方调用
+class ChannelBase : Noncopyable {
+friend class ChannelSelect;
+public:
+    // 非阻塞操作的结果
+    enum OpResult {
+        // 操作成功
+        OP_OK,
+        // 通道满(发送)或空(接收)，需要等待
+        OP_WOULD_BLOCK,
+        // 通道已经关闭(发送)，或者关闭且已经取完(接收)
+        OP_CLOSED
+    };
+
+    ChannelBase(size_t capacity);
+
+    virtual ~ChannelBase() {}
+
+    // 关闭通道，唤醒所有等待的发送方和接收方
+    void close();
+
+    bool isClosed();
+
+    size_t getCapacity() const { return m_capacity; }
+
+    // ChannelSelect等待时把自己的信号量挂到每个通道上，通道状态变化时通知
+    // 用shared_ptr持有，通知方释放锁之后才notify，这时select可能已经返回，信号量不能随它一起释放
+    void attach(const std::shared_ptr<FiberSemaphore> &selector);
+
+    void detach(const std::shared_ptr<FiberSemaphore> &selector);
+
+protected:
+    typedef std::vector<std::shared_ptr<FiberSemaphore>> SelectorList;
+
+    // 持有m_lock时调用，复制一份挂在通道上的ChannelSelect，释放锁之后由调用方通知
+    void collectSelectors(SelectorList &selectors);
+
+    // 不持有m_lock时调用，和唤醒等待的发送方、接收方一样放在锁外
+    static void NotifySelectors(const SelectorList &selectors);
+
+    // 按截止时间计算剩余的等待时间，已经超时返回false
+    static bool GetRemaining(uint64_t deadline, uint64_t &remaining);
+
+    // 按超时时间计算截止时间，FIBER_WAIT_FOREVER保持不变
+    static uint64_t GetDeadline(uint64_t timeout_ms);
+
+protected:
+    Spinlock m_lock;
+    size_t m_capacity;
+    bool m_closed = false;
+    // 等待通道有空位的发送方
+    FiberWaitQueue m_senders{m_lock};
+    // 等待通道有数据的接收方
+    FiberWaitQueue m_receivers{m_lock};
+    SelectorList m_selectors;
+};
+
+template <class T>
+class Channel : public ChannelBase {
+public:
+    typedef std::shared_ptr<Channel> ptr;
+
+    // capacity 通道容量，至少为1
+    Channel(size_t capacity = 1)
+        : ChannelBase(capacity) {
+    }
+
+    // 发送v，通道满时挂起等待，关闭或超时返回false
+    bool send(const T &v, uint64_t timeout_ms = FIBER_WAIT_FOREVER) {
+        T tmp(v);
+        return sendImpl(tmp, timeout_ms);
+    }
+
+    // 只有发送成功时才会移走v
+    bool send(T &&v, uint64_t timeout_ms = FIBER_WAIT_FOREVER) {
+        return sendImpl(v, timeout_ms);
+    }
+
+    bool trySend(const T &v) { return send(v, 0); }
+
+    // 接收一个数据到v，通道空时挂起等待，关闭且取完或超时返回false，用isClosed区分
+    bool recv(T &v, uint64_t timeout_ms = FIBER_WAIT_FOREVER) {
+        uint64_t deadline = GetDeadline(timeout_ms);
+        Spinlock::Lock lock(m_lock);
+        while (true) {
+            FiberWaitQueue::WaiterPtr sender;
+            SelectorList selectors;
+            OpResult rt = tryRecvLocked(v, sender, selectors);
+            if (rt != OP_WOULD_BLOCK) {
+                lock.unlock();
+                if (sender) {
+                    FiberWaitQueue::Wake(sender);
+                }
+                NotifySelectors(selectors);
+                return rt == OP_OK;
+            }
+            uint64_t remaining = 0;
+            if (!GetRemaining(deadline, remaining)) {
+                return false;
+            }
+            FiberWaitQueue::WaiterPtr waiter = m_receivers.prepare();
+            lock.unlock();
+            // 被唤醒后数据可能已经被其他接收方取走，重新检查
+            m_receivers.park(waiter, remaining);
+            lock.lock();
+        }
+    }
+
+    bool tryRecv(T &v) { return recv(v, 0); }
+
+    // 非阻塞发送，成功时移走v，供ChannelSelect使用
+    OpResult trySendOp(T &v) {
+        FiberWaitQueue::WaiterPtr receiver;
+        SelectorList selectors;
+        Spinlock::Lock lock(m_lock);
+        OpResult rt = trySendLocked(v, receiver, selectors);
+        lock.unlock();
+        if (receiver) {
+            FiberWaitQueue::Wake(receiver);
+        }
+        NotifySelectors(selectors);
+        return rt;
+    }
+
+    // 非阻塞接收，供ChannelSelect使用
+    OpResult tryRecvOp(T &v) {
+        FiberWaitQueue::WaiterPtr sender;
+        SelectorList selectors;
+        Spinlock::Lock lock(m_lock);
+        OpResult rt = tryRecvLocked(v, sender, selectors);
+        lock.unlock();
+        if (sender) {
+            FiberWaitQueue::Wake(sender);
+        }
+        NotifySelectors(selectors);
+        return rt;
+    }
+
+    size_t size() {
+        Spinlock::Lock lock(m_lock);
+        return m_items.size();
+    }
+
+private:
+    bool sendImpl(T &v, uint64_t timeout_ms) {
+        uint64_t deadline = GetDeadline(timeout_ms);
+        Spinlock::Lock lock(m_lock);
+        while (true) {
+            FiberWaitQueue::WaiterPtr receiver;
+            SelectorList selectors;
+            OpResult rt = trySendLocked(v, receiver, selectors);
+            if (rt != OP_WOULD_BLOCK) {
+                lock.unlock();
+                if (receiver) {
+                    FiberWaitQueue::Wake(receiver);
+                }
+                NotifySelectors(selectors);
+                return rt == OP_OK;
+            }
+            uint64_t remaining = 0;
+            if (!GetRemaining(deadline, remaining)) {
+                return false;
+            }
+            FiberWaitQueue::WaiterPtr waiter = m_senders.prepare();
+            lock.unlock();
+            m_senders.park(waiter, remaining);
+            lock.lock();
+        }
+    }
+
+    // 持有m_lock时调用，成功时取出一个等待的接收方和挂着的ChannelSelect，释放锁之后由调用方唤醒
+    OpResult trySendLocked(T &v, FiberWaitQueue::WaiterPtr &receiver, SelectorList &selectors) {
+        if (m_closed) {
+            return OP_CLOSED;
+        }
+        if (m_items.size() >= m_capacity) {
+            return OP_WOULD_BLOCK;
+        }
+        m_items.push_back(std::move(v));
+        receiver = m_receivers.popOne();
+        collectSelectors(selectors);
+        return OP_OK;
+    }
+
+    // 持有m_lock时调用，成功时取出一个等待的发送方和挂着的ChannelSelect，释放锁之后由调用方唤醒
+    OpResult tryRecvLocked(T &v, FiberWaitQueue::WaiterPtr &sender, SelectorList &selectors) {
+        if (m_items.empty()) {
+            return m_closed ? OP_CLOSED : OP_WOULD_BLOCK;
+        }
+        v = std::move(m_items.front());
+        m_items.pop_front();
+        sender = m_senders.popOne();
+        collectSelectors(selectors);
+        return OP_OK;
+    }
+
+private:
+    std::deque<T> m_items;
+};
+
+// 同时等待多个通道的发送或接收，哪个先就绪就完成哪个，和Go的select类似
+// 每次wait最多完成一个分支，分支从上次完成的下一个开始尝试，避免总是偏向前面的通道
+// ChannelSelect sel;
+// sel.recv(ch1, v1);
+// sel.send(ch2, v2);
+// int idx = sel.wait(100);
+class ChannelSelect : Noncopyable {
+public:
+    // 添加一个接收分支，返回分支下标
+    // ok 不为nullptr时，收到数据为true，通道关闭且取完为false，关闭的通道也算完成
+    template <class T>
+    size_t recv(Channel<T> &ch, T &out, bool *ok = nullptr) {
+        m_cases.push_back(Case{&ch, true, [&ch, &out, ok]() {
+            ChannelBase::OpResult rt = ch.tryRecvOp(out);
+            if (ok && rt != ChannelBase::OP_WOULD_BLOCK) {
+                *ok = rt == ChannelBase::OP_OK;
+            }
+            return rt;
+        }});
+        return m_cases.size() - 1;
+    }
+
+    // 添加一个发送分支，v会被复制一份，发送成功时才移走这份副本
+    // ok 不为nullptr时，发送成功为true，通道已经关闭为false，关闭的通道也算完成
+    template <class T>
+    size_t send(Channel<T> &ch, const T &v, bool *ok = nullptr) {
+        std::shared_ptr<T> value(new T(v));
+        m_cases.push_back(Case{&ch, true, [&ch, value, ok]() {
+            ChannelBase::OpResult rt = ch.trySendOp(*value);
+            if (ok && rt != ChannelBase::OP_WOULD_BLOCK) {
+                *ok = rt == ChannelBase::OP_OK;
+            }
+            return rt;
+        }});
+        return m_cases.size() - 1;
+    }
+
+    // 停用一个分支，之后的wait不再尝试它，相当于Go里把关闭的通道设为nil
+    // 关闭的通道接收分支一直就绪，不停用的话每次wait都可能返回它
+    void disable(size_t idx) { m_cases[idx].enabled = false; }
+
+    // 等待任意一个分支完成，返回完成的分支下标，超时返回-1
+    // timeout_ms 为0时只尝试一次，相当于Go select的default分支
+    int wait(uint64_t timeout_ms = FIBER_WAIT_FOREVER);
+
+    ChannelSelect();
+
+private:
+    // 尝试一遍所有分支，返回完成的分支下标，都没有就绪返回-1
+    int tryOnce();
+
+private:
+    struct Case {
+        ChannelBase *channel;
+        bool enabled;
+        std::function<ChannelBase::OpResult()> op;
+    };
+
+    std::vector<Case> m_cases;
+    // 下次开始尝试的分支
+    size_t m_next = 0;
+    // 挂到通道上的信号量，通道状态变化时被通知，通道持有引用，不指向select所在的协程栈
+    std::shared_ptr<FiberSemaphore> m_ready;
+};
+
+} // namespace will
+
+#endif
@@ -0,0 +1,128 @@
+#include <stdint.h>
+#include <string.h>
+#include "context.h"
+
+// 切换时保存的是被调用者保存的寄存器，调用者保存的寄存器在调用will_swap_context之前已经由编译器保存
+// 入口跳板把MakeContext放在寄存器里的入口函数取出来调用，入口函数不会返回
+
+#if defined(__x86_64__)
+
+// 栈上的保存区从低地址到高地址依次为：mxcsr和x87控制字、r12、r13、r14、r15、rbx、rbp、返回地址
+__asm__(
+    ".text\n"
+    ".globl will_swap_context\n"
+    ".type will_swap_context,@function\n"
+    ".align 16\n"
+    "will_swap_context:\n"
+    "    pushq %rbp\n"
+    "    pushq %rbx\n"
+    "    pushq %r15\n"
+    "    pushq %r14\n"
+    "    pushq %r13\n"
+    "    pushq %r12\n"
+    "    subq $8, %rsp\n"
+    "    stmxcsr (%rsp)\n"
+    "    fnstcw 4(%rsp)\n"
+    "    movq %rsp, (%rdi)\n"
+    "    movq %rsi, %rsp\n"
+    "    ldmxcsr (%rsp)\n"
+    "    fldcw 4(%rsp)\n"
+    "    addq $8, %rsp\n"
+    "    popq %r12\n"
+    "    popq %r13\n"
+    "    popq %r14\n"
+    "    popq %r15\n"
+    "    popq %rbx\n"
+    "    popq %rbp\n"
+    "    ret\n"
+    ".size will_swap_context,.-will_swap_context\n"
+    "\n"
+    ".globl will_context_entry\n"
+    ".type will_context_entry,@function\n"
+    ".align 16\n"
+    "will_context_entry:\n"
+    "    callq *%rbx\n"
+    "    ud2\n"
+    ".size will_context_entry,.-will_context_entry\n"
+    ".section .note.GNU-stack,\"\",@progbits\n"
+    ".text\n");
+
+#elif defined(__aarch64__)
+
+// 栈上的保存区从低地址到高地址依次为：d8~d15、x19~x28、x29、x30，x30是返回地址
+__asm__(
+    ".text\n"
+    ".globl will_swap_context\n"
+    ".type will_swap_context,%function\n"
+    ".align 4\n"
+    "will_swap_context:\n"
+    "    sub sp, sp, #0xa0\n"
+    "    stp d8, d9, [sp, #0x00]\n"
+    "    stp d10, d11, [sp, #0x10]\n"
+    "    stp d12, d13, [sp, #0x20]\n"
+    "    stp d14, d15, [sp, #0x30]\n"
+    "    stp x19, x20, [sp, #0x40]\n"
+    "    stp x21, x22, [sp, #0x50]\n"
+    "    stp x23, x24, [sp, #0x60]\n"
+    "    stp x25, x26, [sp, #0x70]\n"
+    "    stp x27, x28, [sp, #0x80]\n"
+    "    stp x29, x30, [sp, #0x90]\n"
+    "    mov x9, sp\n"
+    "    str x9, [x0]\n"
+    "    mov sp, x1\n"
+    "    ldp d8, d9, [sp, #0x00]\n"
+    "    ldp d10, d11, [sp, #0x10]\n"
+    "    ldp d12, d13, [sp, #0x20]\n"
+    "    ldp d14, d15, [sp, #0x30]\n"
+    "    ldp x19, x20, [sp, #0x40]\n"
+    "    ldp x21, x22, [sp, #0x50]\n"
+    "    ldp x23, x24, [sp, #0x60]\n"
+    "    ldp x25, x26, [sp, #0x70]\n"
+    "    ldp x27, x28, [sp, #0x80]\n"
+    "    ldp x29, x30, [sp, #0x90]\n"
+    "    add sp, sp, #0xa0\n"
+    "    ret\n"
+    ".size will_swap_context,.-will_swap_context\n"
+    "\n"
+    ".globl will_context_entry\n"
+    ".type will_context_entry,%function\n"
+    ".align 4\n"
+    "will_context_entry:\n"
+    "    blr x19\n"
+    "    brk #0\n"
+    ".size will_context_entry,.-will_context_entry\n"
+    ".section .note.GNU-stack,\"\",%progbits\n"
+    ".text\n");
+
+#endif
+
+#if WILL_CONTEXT_ASM_SUPPORTED
+
+extern "C" void will_context_entry();
+
+namespace will {
+
+Context MakeContext(void *stack, size_t size, void (*fn)()) {
+    // 栈顶按16字节对齐，入口跳板调用fn时满足ABI的栈对齐要求
+    uintptr_t top = ((uintptr_t)stack + size) & ~(uintptr_t)15;
+#if defined(__x86_64__)
+    // 跳板执行时栈指针为top - 16，call之前16字节对齐
+    uint64_t *sp = (uint64_t *)(top - 16) - 8;
+    memset(sp, 0, 8 * sizeof(uint64_t));
+    // mxcsr和x87控制字使用默认值
+    ((uint32_t *)sp)[0] = 0x1f80;
+    ((uint32_t *)sp)[1] = 0x037f;
+    sp[5] = (uint64_t)fn;                  // rbx
+    sp[7] = (uint64_t)&will_context_entry; // 返回地址
+#else
+    uint64_t *sp = (uint64_t *)(top - 0xa0);
+    memset(sp, 0, 0xa0);
+    sp[8]  = (uint64_t)fn;                  // x19
+    sp[19] = (uint64_t)&will_context_entry; // x30
+#endif
+    return sp;
+}
+
+} // namespace will
+
+#endif
@@ -0,0 +1,40 @@
+#ifndef __WILL_CONTEXT_H__
+#define __WILL_CONTEXT_H__
+
+#include <stddef.h>
+
+// 编译时定义WILL_FIBER_ASM后，在支持的平台上使用手写汇编切换协程上下文，其他情况退回ucontext
+// swapcontext每次切换都要调用rt_sigprocmask保存和恢复信号掩码，汇编实现只保存被调用者保存的寄存器和栈指针，不进入内核
+#if defined(__x86_64__) || defined(__aarch64__)
+#define WILL_CONTEXT_ASM_SUPPORTED 1
+#else
+#define WILL_CONTEXT_ASM_SUPPORTED 0
+#endif
+
+#if defined(WILL_FIBER_ASM) && WILL_CONTEXT_ASM_SUPPORTED
+#define WILL_CONTEXT_ASM 1
+#else
+#define WILL_CONTEXT_ASM 0
+#endif
+
+#if WILL_CONTEXT_ASM_SUPPORTED
+
+namespace will {
+
+// 汇编实现的协程上下文，就是切出时的栈指针，寄存器都保存在协程自己的栈上
+typedef void *Context;
+
+extern "C" {
+// 把当前寄存器保存到当前栈上，栈指针写入*from，再切换到to继续执行
+// 第一次切换到MakeContext创建的上下文时从入口函数开始执行
+void will_swap_context(Context *from, Context to);
+}
+
+// 在[stack, stack + size)上创建一个从fn开始执行的上下文，fn不能返回
+Context MakeContext(void *stack, size_t size, void (*fn)());
+
+} // namespace will
+
+#endif
+
+#endif
@@ -0,0 +1,341 @@
+#ifndef __WILL_CORO_H__
+#define __WILL_CORO_H__
+
+// 基于C++20无栈协程的异步接口，和Fiber共用IOManager的epoll循环、定时器和调度队列
+// 协程帧只保存跨越co_await的局部变量，通常只有几百字节，Fiber至少要一个独立的栈
+// 适合同时挂起大量连接的场景，比如高扇出的代理
+// 库本身按C++11编译，这个头文件只在以C++20(或打开协程支持)编译时才有内容，使用它的源文件需要-std=c++20
+// Task和Fiber可以混用：Task在调度器的协程里被恢复，恢复后照常可以调用hook过的阻塞接口，只是会挂起承载它的Fiber
+
+#if defined(__cpp_impl_coroutine) && __cpp_impl_coroutine >= 201902L
+
+#include <errno.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <coroutine>
+#include <exception>
+#include <memory>
+#include <optional>
+#include <utility>
+#include "hook.h"
+#include "iomanager.h"
+#include "log.h"
+#include "macro.h"
+
+namespace will {
+
+template <class T>
+class Task;
+
+// Task的promise公共部分，结束时通过对称转移恢复等待它的协程，不经过调度器
+class TaskPromiseBase {
+public:
+    struct FinalAwaiter {
+        bool await_ready() noexcept { return false; }
+
+        template <class Promise>
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> h) noexcept {
+            std::coroutine_handle<> cont = h.promise().m_continuation;
+            return cont ? cont : std::noop_coroutine();
+        }
+
+        void await_resume() noexcept {}
+    };
+
+    // Task是惰性的，被co_await时才开始执行
+    std::suspend_always initial_suspend() noexcept { return {}; }
+
+    FinalAwaiter final_suspend() noexcept { return {}; }
+
+    void unhandled_exception() { m_exception = std::current_exception(); }
+
+    void setContinuation(std::coroutine_handle<> h) { m_continuation = h; }
+
+protected:
+    std::coroutine_handle<> m_continuation;
+    std::exception_ptr m_exception;
+};
+
+template <class T>
+class TaskPromise : public TaskPromiseBase {
+public:
+    Task<T> get_return_object();
+
+    template <class U>
+    void return_value(U &&v) { m_value.emplace(std::forward<U>(v)); }
+
+    T result() {
+        if (m_exception) {
+            std::rethrow_exception(m_exception);
+        }
+        return std::move(*m_value);
+    }
+
+private:
+    std::optional<T> m_value;
+};
+
+template <>
+class TaskPromise<void> : public TaskPromiseBase {
+public:
+    Task<void> get_return_object();
+
+    void return_void() {}
+
+    void result() {
+        if (m_exception) {
+            std::rethrow_exception(m_exception);
+        }
+    }
+};
+
+// 异步操作的结果，co_await得到返回值，协程体里抛出的异常在co_await处重新抛出
+// 只能co_await一次，独占协程帧，析构时销毁协程帧
+template <class T = void>
+class Task : Noncopyable {
+public:
+    typedef TaskPromise<T> promise_type;
+    typedef std::coroutine_handle<promise_type> handle_type;
+
+    Task(Task &&other) noexcept
+        : m_handle(std::exchange(other.m_handle, nullptr)) {
+    }
+
+    ~Task() {
+        if (m_handle) {
+            m_handle.destroy();
+        }
+    }
+
+    struct Awaiter {
+        bool await_ready() noexcept { return !handle || handle.done(); }
+
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<> cont) noexcept {
+            handle.promise().setContinuation(cont);
+            return handle;
+        }
+
+        T await_resume() { return handle.promise().result(); }
+
+        handle_type handle;
+    };
+
+    Awaiter operator co_await() && noexcept { return Awaiter{m_handle}; }
+
+    Awaiter operator co_await() & noexcept { return Awaiter{m_handle}; }
+
+private:
+    friend class TaskPromise<T>;
+
+    explicit Task(handle_type h)
+        : m_handle(h) {
+    }
+
+private:
+    handle_type m_handle;
+};
+
+template <class T>
+inline Task<T> TaskPromise<T>::get_return_object() {
+    return Task<T>(Task<T>::handle_type::from_promise(*this));
+}
+
+inline Task<void> TaskPromise<void>::get_return_object() {
+    return Task<void>(Task<void>::handle_type::from_promise(*this));
+}
+
+// 切换到scheduler上继续执行，已经在scheduler上时不切换
+// co_await ScheduleOn(iom);
+class ScheduleOn {
+public:
+    ScheduleOn(Scheduler *scheduler, Scheduler::Priority priority = Scheduler::NORMAL)
+        : m_scheduler(scheduler), m_priority(priority) {
+    }
+
+    bool await_ready() const noexcept { return m_scheduler == Scheduler::GetThis(); }
+
+    void await_suspend(std::coroutine_handle<> h) {
+        m_scheduler->schedule([h]() { h.resume(); }, -1, m_priority);
+    }
+
+    void await_resume() noexcept {}
+
+private:
+    Scheduler *m_scheduler;
+    Scheduler::Priority m_priority;
+};
+
+// 挂起ms毫秒，由当前IOManager的定时器恢复，只能在IOManager的线程上使用
+// co_await SleepFor(100);
+class SleepFor {
+public:
+    explicit SleepFor(uint64_t ms)
+        : m_ms(ms) {
+    }
+
+    bool await_ready() const noexcept { return false; }
+
+    void await_suspend(std::coroutine_handle<> h) {
+        IOManager *iom = IOManager::GetThis();
+        WILL_ASSERT2(iom, "SleepFor needs an IOManager");
+        iom->addTimer(m_ms, [h]() { h.resume(); });
+    }
+
+    void await_resume() noexcept {}
+
+private:
+    uint64_t m_ms;
+};
+
+// 等待fd上的读或写事件，和hook里的do_io一样由IOManager的epoll循环唤醒，超时通过取消事件唤醒
+// co_await的结果为0表示事件就绪，否则为错误码，超时为ETIMEDOUT
+// 只能在IOManager的线程上使用，同一个fd的同一个事件同时只能有一个等待者
+class WaitFd {
+public:
+    WaitFd(int fd, IOManager::Event event, uint64_t timeout_ms = ~0ull)
+        : m_fd(fd), m_event(event), m_timeout(timeout_ms) {
+    }
+
+    bool await_ready() const noexcept { return false; }
+
+    bool await_suspend(std::coroutine_handle<> h) {
+        IOManager *iom = IOManager::GetThis();
+        WILL_ASSERT2(iom, "WaitFd needs an IOManager");
+        // 定时器要在addEvent之前加好，addEvent之后协程随时可能在其他线程上被恢复
+        if (m_timeout != ~0ull) {
+            m_info.reset(new Info);
+            std::weak_ptr<Info> winfo(m_info);
+            int fd = m_fd;
+            IOManager::Event event = m_event;
+            m_timer = iom->addConditionTimer(m_timeout, [winfo, fd, iom, event]() {
+                auto t = winfo.lock();
+                if (!t || t->cancelled) {
+                    return;
+                }
+                t->cancelled = ETIMEDOUT;
+                iom->cancelEvent(fd, event);
+            }, winfo);
+        }
+        if (WILL_UNLIKELY(iom->addEvent(m_fd, m_event, [h]() { h.resume(); }))) {
+            if (m_timer) {
+                m_timer->cancel();
+            }
+            m_error = errno ? errno : EBADF;
+            return false;
+        }
+        return true;
+    }
+
+    int await_resume() {
+        if (m_timer) {
+            m_timer->cancel();
+        }
+        return m_error ? m_error : (m_info ? m_info->cancelled : 0);
+    }
+
+private:
+    struct Info {
+        int cancelled = 0;
+    };
+
+    int m_fd;
+    IOManager::Event m_event;
+    uint64_t m_timeout;
+    int m_error = 0;
+    // 只有设置了超时才分配，超时回调通过weak_ptr判断等待是否还在进行
+    std::shared_ptr<Info> m_info;
+    Timer::ptr m_timer;
+};
+
+// 下面的异步IO要求fd是非阻塞的，直接调用原始的系统调用，不经过hook
+// 数据没有就绪时挂起当前Task等待事件，不会挂起承载它的Fiber，超时返回-1，errno为ETIMEDOUT
+
+inline Task<ssize_t> AsyncRead(int fd, void *buf, size_t len, uint64_t timeout_ms = ~0ull) {
+    while (true) {
+        ssize_t n = read_f(fd, buf, len);
+        if (n >= 0 || errno != EAGAIN) {
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            co_return n;
+        }
+        int err = co_await WaitFd(fd, IOManager::READ, timeout_ms);
+        if (err) {
+            errno = err;
+            co_return -1;
+        }
+    }
+}
+
+inline Task<ssize_t> AsyncWrite(int fd, const void *buf, size_t len, uint64_t timeout_ms = ~0ull) {
+    while (true) {
+        ssize_t n = write_f(fd, buf, len);
+        if (n >= 0 || errno != EAGAIN) {
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            co_return n;
+        }
+        int err = co_await WaitFd(fd, IOManager::WRITE, timeout_ms);
+        if (err) {
+            errno = err;
+            co_return -1;
+        }
+    }
+}
+
+// 接受一个连接，返回的fd已经设为非阻塞
+inline Task<int> AsyncAccept(int fd, uint64_t timeout_ms = ~0ull) {
+    while (true) {
+        int rt = accept4(fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (rt >= 0 || errno != EAGAIN) {
+            if (rt < 0 && errno == EINTR) {
+                continue;
+            }
+            co_return rt;
+        }
+        int err = co_await WaitFd(fd, IOManager::READ, timeout_ms);
+        if (err) {
+            errno = err;
+            co_return -1;
+        }
+    }
+}
+
+// Spawn启动的顶层协程，结束时自己销毁协程帧
+struct DetachedTask {
+    struct promise_type {
+        DetachedTask get_return_object() noexcept { return {}; }
+
+        std::suspend_never initial_suspend() noexcept { return {}; }
+
+        std::suspend_never final_suspend() noexcept { return {}; }
+
+        void return_void() noexcept {}
+
+        void unhandled_exception() noexcept { std::terminate(); }
+    };
+};
+
+inline DetachedTask SpawnImpl(Scheduler *scheduler, Task<void> task) {
+    co_await ScheduleOn(scheduler);
+    try {
+        co_await std::move(task);
+    } catch (std::exception &ex) {
+        WILL_LOG_ERROR(WILL_LOG_NAME("system")) << "Task except: " << ex.what();
+    } catch (...) {
+        WILL_LOG_ERROR(WILL_LOG_NAME("system")) << "Task except";
+    }
+}
+
+// 在scheduler上启动一个Task，不等待它结束，Task里没有捕获的异常只记录日志
+// 已经在scheduler上时直接在当前线程开始执行，直到第一次挂起才返回
+inline void Spawn(Scheduler *scheduler, Task<void> task) {
+    SpawnImpl(scheduler, std::move(task));
+}
+
+} // namespace will
+
+#endif
+
+#endif
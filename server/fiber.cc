@@ -1,8 +1,15 @@
+#include <algorithm>
 #include <atomic>
+#include <sched.h>
+#include <ucontext.h>
+#include "context.h"
 #include "fiber.h"
+#include "fiber_sync.h"
 #include "log.h"
 #include "macro.h"
 #include "scheduler.h"
+#include "stack_allocator.h"
+#include "stack_profiler.h"
 
 namespace will {
 
@@ -13,6 +20,9 @@ static std::atomic<uint64_t> s_fiber_id{0};
 // 全局静态变量，用于统计当前的协程数
 static std::atomic<uint64_t> s_fiber_count{0};
 
+// 已经分配的协程局部变量槽位数
+static std::atomic<uint32_t> s_local_slots{0};
+
 // 线程局部变量，当前线程正在运行的协程
 static thread_local Fiber *t_fiber = nullptr;
 // 线程局部变量，当前线程的主协程，切换到这个协程，就相当于切换到了主协程中运行，智能指针形式
@@ -20,13 +30,47 @@ static thread_local Fiber::ptr t_thread_fiber = nullptr;
 
 static uint32_t g_fiber_stack_size = 128 * 1024;
 
-class MallocStackAllocator {
-public:
-    static void *Alloc(size_t size) { return malloc(size); }
-    static void Dealloc(void *vp, size_t size) { return free(vp); }
+// 共享栈的大小，共享栈协程的栈用量不能超过这个大小
+static const size_t s_shared_stack_size = 1024 * 1024;
+
+// 每个线程一个共享栈，第一次运行共享栈协程时分配，线程退出时释放
+// 析构时线程的栈缓存可能已经先析构了，StackAllocator::Dealloc会直接还给全局空闲链表
+struct SharedStack {
+    void *stack = nullptr;
+    // 绑定在这个线程上还没有结束的共享栈协程数
+    size_t fibers = 0;
+
+    ~SharedStack() {
+        StackAllocator::Dealloc(stack, s_shared_stack_size);
+    }
+
+    char *get() {
+        if (!stack) {
+            stack = StackAllocator::Alloc(s_shared_stack_size);
+            WILL_ASSERT2(stack, "alloc shared stack fail");
+        }
+        return (char *)stack;
+    }
 };
 
-using StackAllocator = MallocStackAllocator;
+static thread_local SharedStack t_shared_stack;
+
+#if !WILL_CONTEXT_ASM
+static ucontext_t *GetUContext(void *&ctx) {
+    if (!ctx) {
+        ctx = new ucontext_t;
+    }
+    return (ucontext_t *)ctx;
+}
+#endif
+
+size_t Fiber::GetSharedStackFibers() {
+    return t_shared_stack.fibers;
+}
+
+uint32_t Fiber::GetDefaultStackSize() {
+    return g_fiber_stack_size;
+}
 
 uint64_t Fiber::GetFiberId() {
     if (t_fiber) {
@@ -39,9 +83,12 @@ Fiber::Fiber() {
     SetThis(this);
     m_state = RUNNING;
 
-    if (getcontext(&m_ctx)) {
+    // 汇编实现下主协程的上下文在第一次切出时保存，不需要初始化
+#if !WILL_CONTEXT_ASM
+    if (getcontext(GetUContext(m_ctx))) {
         WILL_ASSERT2(false, "getcontext");
     }
+#endif
 
     ++s_fiber_count;
     m_id = s_fiber_id++; // 协程id从0开始，用完加1
@@ -67,42 +114,49 @@ Fiber::ptr Fiber::GetThis() {
 }
 
 
-// 带参数的构造函数用于创建其他协程，需要分配栈
-Fiber::Fiber(std::function<void()> cb, size_t stacksize, bool run_in_scheduler)
+// 带参数的构造函数用于创建其他协程，只确定栈大小，栈在第一次resume时分配
+Fiber::Fiber(std::function<void()> cb, size_t stacksize, bool run_in_scheduler, bool shared_stack)
     : m_id(s_fiber_id++)
     , m_cb(cb)
-    , m_runInScheduler(run_in_scheduler) {
+    , m_runInScheduler(run_in_scheduler)
+    , m_sharedStack(shared_stack && WILL_CONTEXT_ASM)
+    , m_stackKey(m_cb.target_type().name()) {
     ++s_fiber_count;
-    m_stacksize = stacksize ? stacksize : g_fiber_stack_size;
-    m_stack     = StackAllocator::Alloc(m_stacksize);
-
-    if (getcontext(&m_ctx)) {
-        WILL_ASSERT2(false, "getcontext");
+    if (m_sharedStack) {
+        // 共享栈协程在第一次resume时才知道运行在哪个线程的共享栈上，到时再创建上下文
+        m_stacksize = s_shared_stack_size;
+    } else {
+        if (!stacksize) {
+            // 自适应模式下按同一入口的历史用量选择栈大小
+            stacksize = StackProfiler::GetStackSize(m_stackKey);
+        }
+        // 栈在第一次resume时才分配，排队还没开始运行的协程不占栈内存
+        m_stacksize = stacksize ? stacksize : g_fiber_stack_size;
     }
 
-    m_ctx.uc_link          = nullptr;
-    m_ctx.uc_stack.ss_sp   = m_stack;
-    m_ctx.uc_stack.ss_size = m_stacksize;
-
-    makecontext(&m_ctx, &Fiber::MainFunc, 0);
-
     WILL_LOG_DEBUG(g_logger) << "Fiber::Fiber() id = " << m_id;
 }
 
 
-// 线程的主协程析构时需要特殊处理，因为主协程没有分配栈和cb
+// 线程的主协程析构时需要特殊处理，因为主协程没有栈和cb
 Fiber::~Fiber() {
     WILL_LOG_DEBUG(g_logger) << "Fiber::~Fiber() id = " << m_id;
     --s_fiber_count;
-    if (m_stack) {
-        // 有栈，说明是子协程，需要确保子协程一定是结束状态
-        WILL_ASSERT(m_state == TERM);
+#if !WILL_CONTEXT_ASM
+    delete (ucontext_t *)m_ctx;
+#endif
+    clearLocals();
+    delete[] m_locals;
+    if (m_stacksize) {
+        // 栈大小不为0，说明是子协程，需要确保子协程一定是结束状态，结束时栈已经释放
+        WILL_ASSERT(getState() == TERM);
         StackAllocator::Dealloc(m_stack, m_stacksize);
+        free(m_savedStack);
         WILL_LOG_DEBUG(g_logger) << "dealloc stack, id = " << m_id;
     } else {
         // 没有栈，说明是线程的主协程
         WILL_ASSERT(!m_cb);              // 主协程没有cb
-        WILL_ASSERT(m_state == RUNNING); // 主协程一定是执行状态
+        WILL_ASSERT(getState() == RUNNING); // 主协程一定是执行状态
 
         Fiber *cur = t_fiber; // 当前协程就是自己
         if (cur == this) {
@@ -114,55 +168,273 @@ Fiber::~Fiber() {
 
 // 这里为了简化状态管理，强制只有TERM状态的协程才可以重置，但其实刚创建好但没执行过的协程也应该允许重置的
 void Fiber::reset(std::function<void()> cb) {
-    WILL_ASSERT(m_stack);
+    WILL_ASSERT(m_stacksize);
     WILL_ASSERT(m_state == TERM);
+    m_deferredWake = nullptr;
+    clearLocals();
     m_cb = cb;
-    if (getcontext(&m_ctx)) {
+    m_stackKey = m_cb.target_type().name();
+    if (m_sharedStack) {
+        // 还没有开始运行，可以重新绑定到任意线程
+        m_boundThread = -1;
+    }
+    m_state = READY;
+}
+
+void Fiber::initContext() {
+#if WILL_CONTEXT_ASM
+    m_ctx = MakeContext(m_stack, m_stacksize, &Fiber::MainFunc);
+#else
+    ucontext_t *ctx = GetUContext(m_ctx);
+    if (getcontext(ctx)) {
         WILL_ASSERT2(false, "getcontext");
     }
 
-    m_ctx.uc_link          = nullptr;
-    m_ctx.uc_stack.ss_sp   = m_stack;
-    m_ctx.uc_stack.ss_size = m_stacksize;
+    ctx->uc_link          = nullptr;
+    ctx->uc_stack.ss_sp   = m_stack;
+    ctx->uc_stack.ss_size = m_stacksize;
 
-    makecontext(&m_ctx, &Fiber::MainFunc, 0);
-    m_state = READY;
+    makecontext(ctx, &Fiber::MainFunc, 0);
+#endif
+}
+
+void Fiber::SwapContext(Fiber *from, Fiber *to) {
+#if WILL_CONTEXT_ASM
+    will_swap_context(&from->m_ctx, to->m_ctx);
+#else
+    if (swapcontext(GetUContext(from->m_ctx), GetUContext(to->m_ctx))) {
+        WILL_ASSERT2(false, "swapcontext");
+    }
+#endif
+}
+
+void Fiber::restoreStack() {
+#if WILL_CONTEXT_ASM
+    char *stack = t_shared_stack.get();
+    if (m_boundThread == -1) {
+        m_boundThread = will::GetThreadId();
+        m_ctx         = MakeContext(stack, s_shared_stack_size, &Fiber::MainFunc);
+        ++t_shared_stack.fibers;
+        return;
+    }
+    WILL_ASSERT2(m_boundThread == will::GetThreadId(), "shared stack fiber resumed on another thread, id=" << m_id);
+    memcpy(stack + s_shared_stack_size - m_savedSize, m_savedStack, m_savedSize);
+#endif
+}
+
+void Fiber::saveStack() {
+#if WILL_CONTEXT_ASM
+    char *top  = t_shared_stack.get() + s_shared_stack_size;
+    m_savedSize = top - (char *)m_ctx;
+    if (m_savedSize > m_savedCapacity) {
+        free(m_savedStack);
+        m_savedStack    = (char *)malloc(m_savedSize);
+        m_savedCapacity = m_savedSize;
+        WILL_ASSERT2(m_savedStack, "alloc saved stack fail, size=" << m_savedSize);
+    }
+    memcpy(m_savedStack, m_ctx, m_savedSize);
+#endif
+}
+
+void Fiber::allocStack() {
+    m_stack = StackAllocator::Alloc(m_stacksize);
+    WILL_ASSERT2(m_stack, "alloc fiber stack fail, size=" << m_stacksize);
+    if (StackProfiler::IsEnabled()) {
+        StackProfiler::Paint(m_stack, m_stacksize);
+        m_stackPainted = true;
+    }
+    initContext();
+}
+
+void Fiber::releaseStack() {
+    if (m_stackPainted) {
+        StackProfiler::Record(m_stackKey, StackProfiler::Scan(m_stack, m_stacksize), m_stacksize);
+        m_stackPainted = false;
+    }
+    StackAllocator::Dealloc(m_stack, m_stacksize);
+    m_stack = nullptr;
+}
+
+void Fiber::RecordStackUsage(const std::string &key) {
+    Fiber *cur = t_fiber;
+    if (!cur || !cur->m_stackPainted || !StackProfiler::IsEnabled()) {
+        return;
+    }
+    StackProfiler::Record(key, StackProfiler::Scan(cur->m_stack, cur->m_stacksize), cur->m_stacksize);
+}
+
+uint32_t Fiber::AllocLocalSlot() {
+    return s_local_slots++;
+}
+
+Fiber::LocalValue &Fiber::GetLocal(uint32_t slot) {
+    Fiber *cur = t_fiber ? t_fiber : GetThis().get();
+    if (WILL_UNLIKELY(slot >= cur->m_localCount)) {
+        // 一次扩到已分配的槽位数，之后新分配的槽位才需要再扩容
+        uint32_t count = std::max(slot + 1, s_local_slots.load(std::memory_order_relaxed));
+        LocalValue *locals = new LocalValue[count];
+        std::copy(cur->m_locals, cur->m_locals + cur->m_localCount, locals);
+        delete[] cur->m_locals;
+        cur->m_locals     = locals;
+        cur->m_localCount = count;
+    }
+    return cur->m_locals[slot];
+}
+
+Fiber::LocalValue *Fiber::FindLocal(uint32_t slot) {
+    Fiber *cur = t_fiber;
+    if (!cur || slot >= cur->m_localCount) {
+        return nullptr;
+    }
+    return &cur->m_locals[slot];
+}
+
+void Fiber::DestroyLocal(LocalValue &value) {
+    // 先清空槽位再析构，析构函数里访问同一个槽位会重新构造
+    LocalValue old = value;
+    value.data    = nullptr;
+    value.destroy = nullptr;
+    old.destroy(old.data);
+}
+
+void Fiber::clearLocals() {
+    // 析构函数可能访问其他槽位导致扩容，每次都重新取m_locals
+    for (uint32_t i = 0; i < m_localCount; ++i) {
+        if (m_locals[i].destroy) {
+            LocalValue &value = m_locals[i];
+            Fiber *old = t_fiber;
+            // 析构和reset可能不在本协程里执行，析构期间访问的FiberLocal要指向本协程
+            SetThis(this);
+            DestroyLocal(value);
+            SetThis(old);
+        }
+    }
+}
+
+bool Fiber::join(uint64_t timeout_ms) {
+    WILL_ASSERT2(t_fiber != this, "fiber can not join itself, id=" << m_id);
+    WaitGroup::ptr joiners;
+    {
+        // 和notifyJoiners互斥，状态在notifyJoiners之前已经改为TERM，这里没看到TERM就一定会被notifyJoiners唤醒
+        Spinlock::Lock lock(m_joinLock);
+        if (getState() == TERM) {
+            return true;
+        }
+        if (!m_joiners) {
+            m_joiners.reset(new WaitGroup);
+            m_joiners->add(1);
+        }
+        joiners = m_joiners;
+    }
+    return joiners->wait(timeout_ms);
+}
+
+void Fiber::notifyJoiners() {
+    WaitGroup::ptr joiners;
+    {
+        Spinlock::Lock lock(m_joinLock);
+        joiners.swap(m_joiners);
+    }
+    if (joiners) {
+        joiners->done();
+    }
+}
+
+void Fiber::setState(State state) {
+    int s = m_state.load(std::memory_order_relaxed);
+    while (!m_state.compare_exchange_weak(s, (s & ~STATE_MASK) | state, std::memory_order_acq_rel)) {
+    }
+}
+
+Fiber::WakeResult Fiber::deferWake(void *wake) {
+    int s = m_state.load(std::memory_order_acquire);
+    while (true) {
+        int state = s & STATE_MASK;
+        if (state != RUNNING && state != SUSPENDING) {
+            return WAKE_NOW;
+        }
+        if (s & WAKE_PENDING) {
+            return WAKE_MERGED;
+        }
+        // 先用CAS占住登记位再写入唤醒，同时登记的其他唤醒方会看到标记直接合并，不会覆盖m_deferredWake
+        if (m_state.compare_exchange_weak(s, s | WAKE_PENDING | WAKE_PUBLISHING, std::memory_order_acq_rel)) {
+            m_deferredWake = wake;
+            m_state.fetch_and(~WAKE_PUBLISHING, std::memory_order_release);
+            return WAKE_DEFERRED;
+        }
+    }
+}
+
+void Fiber::finishSwitch() {
+    int s = m_state.load(std::memory_order_acquire);
+    while (!(s & WAKE_PENDING)) {
+        if ((s & STATE_MASK) != SUSPENDING
+            || m_state.compare_exchange_weak(s, READY, std::memory_order_acq_rel)) {
+            return;
+        }
+    }
+    // 标记置位后不会再有新的登记，等登记方写完唤醒，只有几条指令的窗口，除非登记方刚好被切走
+    while (s & WAKE_PUBLISHING) {
+        sched_yield();
+        s = m_state.load(std::memory_order_acquire);
+    }
+    // 先取走唤醒再改为READY，之后协程就可能被其他线程resume
+    void *wake     = m_deferredWake;
+    m_deferredWake = nullptr;
+    m_state.store((s & STATE_MASK) == SUSPENDING ? READY : (s & STATE_MASK), std::memory_order_release);
+    Scheduler::ScheduleDeferredWake(wake);
 }
 
 void Fiber::resume() {
-    WILL_ASSERT(m_state != TERM && m_state != RUNNING);
+    WILL_ASSERT(m_state == READY);
+    if (m_sharedStack) {
+        restoreStack();
+    } else if (!m_stack) {
+        allocStack();
+    }
     SetThis(this);
-    m_state = RUNNING;
+    m_state.store(RUNNING, std::memory_order_relaxed);
 
     // 如果协程参与调度器调度，那么应该和调度器的主协程进行swap，而不是线程主协程
     if (m_runInScheduler) {
-        if (swapcontext(&(Scheduler::GetMainFiber()->m_ctx), &m_ctx)) {
-            WILL_ASSERT2(false, "swapcontext");
-        }
+        SwapContext(Scheduler::GetMainFiber(), this);
     } else {
-        if (swapcontext(&(t_thread_fiber->m_ctx), &m_ctx)) {
-            WILL_ASSERT2(false, "swapcontext");
+        SwapContext(t_thread_fiber.get(), this);
+    }
+    bool term = getState() == TERM;
+    // 共享栈马上会被其他协程覆盖，先把栈内容存起来，结束的协程不需要保存
+    if (m_sharedStack) {
+        if (!term) {
+            saveStack();
+        } else {
+            --t_shared_stack.fibers;
         }
+    } else if (term) {
+        // 结束的协程马上把栈还给分配器，协程对象可能还要被持有很久，或者留在协程池里等待复用
+        releaseStack();
+    }
+    if (term) {
+        notifyJoiners();
     }
+    // 回到这里时协程的上下文已经保存完，这时才允许其他线程resume它
+    finishSwitch();
 }
 
 void Fiber::yield() {
     // 协程运行完之后会自动yield一次，用于回到主协程，此时状态已为结束状态
-    WILL_ASSERT(m_state == RUNNING || m_state == TERM);
+    State state = getState();
+    WILL_ASSERT(state == RUNNING || state == TERM);
     SetThis(t_thread_fiber.get());
-    if (m_state != TERM) {
-        m_state = READY;
+    // 不能直接改为READY，切换保存完上下文之前其他线程resume这个协程会在同一个栈上运行
+    if (state != TERM) {
+        setState(SUSPENDING);
     }
 
     // 如果协程参与调度器调度，那么应该和调度器的主协程进行swap，而不是线程主协程
     if (m_runInScheduler) {
-        if (swapcontext(&m_ctx, &(Scheduler::GetMainFiber()->m_ctx))) {
-            WILL_ASSERT2(false, "swapcontext");
-        }
+        SwapContext(this, Scheduler::GetMainFiber());
     } else {
-        if (swapcontext(&m_ctx, &(t_thread_fiber->m_ctx))) {
-            WILL_ASSERT2(false, "swapcontext");
-        }
+        SwapContext(this, t_thread_fiber.get());
     }
 }
 
@@ -172,8 +444,10 @@ void Fiber::MainFunc() {
     WILL_ASSERT(cur);
 
     cur->m_cb();
-    cur->m_cb    = nullptr;
-    cur->m_state = TERM;
+    cur->m_cb = nullptr;
+    // 在协程自己的栈上析构局部变量，析构函数里仍然可以访问当前协程
+    cur->clearLocals();
+    cur->setState(TERM);
     
     //返回时如果不手动释放shared_ptr cur的话，则在子协程中cur都有一次引用，
     //cur计数永远不会低于1，所以不会自动释放
@@ -1,39 +1,61 @@
 #ifndef __WILL_FIBER_H__
 #define __WILL_FIBER_H__
 
+#include <atomic>
 #include <functional>
 #include <memory>
-#include <ucontext.h>
+#include <string>
 #include "thread.h"
 
 namespace will {
+
+class WaitGroup;
+
 //fiber类继承std::enable_shared_from_this<Fiber>
 //那么在将this作为智能指针返回时返回的是用一个
 class Fiber : public std::enable_shared_from_this<Fiber> {
 public:
     typedef std::shared_ptr<Fiber> ptr;
 
-    // 定义三态转换关系，也就是协程要么正在运行(RUNNING)，
+    // 定义状态转换关系，也就是协程要么正在运行(RUNNING)，要么正在切出(SUSPENDING)，
     // 要么准备运行(READY)，要么运行结束(TERM)。不区分协程的初始状态，初始即READY。不区分协程是异常结束还是正常结束，
     // 只要结束就是TERM状态。也不区别HOLD状态，协程只要未结束也非运行态，那就是READY状态。
+    // yield时先进入SUSPENDING，等上下文保存完、resume的调用方拿回执行权后才变为READY，
+    // 只有READY的协程才能被其他线程resume
     enum State {
-        // 就绪态，刚创建或者yield之后的状态
+        // 就绪态，刚创建或者yield完成之后的状态
         READY,
         // 运行态，resume之后的状态
         RUNNING,
+        // 正在切出，已经调用yield但上下文还没有保存完
+        SUSPENDING,
         // 结束态，协程的回调函数执行完之后为TERM状态
         TERM
     };
 
+    // 唤醒协程时登记的结果，见deferWake()
+    enum WakeResult {
+        // 协程已经切出，调用方直接调度
+        WAKE_NOW,
+        // 协程还在运行或正在切出，唤醒已登记，切出完成后由resume的调用方调度
+        WAKE_DEFERRED,
+        // 切出完成前已经登记过一次唤醒，这次唤醒被合并，调用方丢弃即可
+        WAKE_MERGED
+    };
+
 private:
     Fiber();
 public:
     // run_in_scheduler 本协程是否参与调度器调度，默认为true
-    Fiber(std::function<void()> cb, size_t stacksize = 0, bool run_in_scheduler = true);
+    // shared_stack 是否运行在线程的共享栈上，切出时把用到的部分拷贝到按需分配的缓冲区，切回时再拷回共享栈，
+    // 适合大部分时间挂起、栈用量很小的协程，只有汇编上下文切换实现支持，否则仍使用独立栈
+    // 共享栈协程第一次resume后就绑定在这个线程上，之后只能在这个线程上resume，调度器会把它的任务投递到这个线程
+    // 切出期间栈上的地址会被别的协程占用，不能把栈上的对象交给切出后还会访问它的代码，hook的IO在io_uring后端下也改走epoll
+    Fiber(std::function<void()> cb, size_t stacksize = 0, bool run_in_scheduler = true, bool shared_stack = false);
 
     ~Fiber();
 
-    // 重置协程状态和入口函数，复用栈空间，不重新创建栈
+    // 重置协程状态和入口函数，复用协程对象，栈在下次resume时重新分配
     void reset(std::function<void()> cb);
 
     // 将当前协程切到到执行状态
@@ -46,7 +68,33 @@ public:
 
     uint64_t getId() const { return m_id; }
 
-    State getState() const { return m_state; }
+    State getState() const { return (State)(m_state.load(std::memory_order_acquire) & STATE_MASK); }
+
+    uint32_t getStackSize() const { return m_stacksize; }
+
+    bool isRunInScheduler() const { return m_runInScheduler; }
+
+    bool isSharedStack() const { return m_sharedStack; }
+
+    // 共享栈协程绑定的线程id，还没有运行过或不是共享栈协程时为-1
+    int getBoundThread() const { return m_boundThread.load(std::memory_order_acquire); }
+
+    // 共享栈协程切出时保存栈内容的缓冲区大小
+    size_t getSavedStackCapacity() const { return m_savedCapacity; }
+
+    // 栈用量统计使用的入口名，默认是入口函数的类型名
+    const char *getStackKey() const { return m_stackKey; }
+
+    // 替换栈用量统计使用的入口名，调度器用任务回调的类型名代替包装函数的类型名，key必须一直有效
+    void setStackKey(const char *key) { m_stackKey = key; }
+
+    // 挂起当前协程直到这个协程结束，已经结束时立即返回，超时返回false
+    // 不在调度器调度的协程里调用时阻塞线程，协程不能join自己
+    bool join(uint64_t timeout_ms = ~0ull);
+
+    // 协程正在运行或正在切出时，登记一次唤醒，保证唤醒在切出完成后恰好执行一次，而不是让调度线程反复跳过
+    // wake 调度器的任务节点，切出完成后交给Scheduler重新调度
+    WakeResult deferWake(void *wake);
 public:
     // 设置当前正在运行的协程，即设置线程局部变量t_fiber的值
     static void SetThis(Fiber *f);
@@ -60,25 +108,113 @@ public:
 
     static uint64_t TotalFibers();
 
+    // 不指定栈大小时使用的默认栈大小
+    static uint32_t GetDefaultStackSize();
+
+    // 绑定在当前线程上还没有结束的共享栈协程数，不为0时线程不能退出
+    static size_t GetSharedStackFibers();
+
+    // 协程局部变量的槽位，供FiberLocal使用
+    struct LocalValue {
+        // 值的地址，平凡的小类型直接存放在这里
+        void *data = nullptr;
+        // 析构函数，为nullptr表示槽位还没有值
+        void (*destroy)(void *data) = nullptr;
+    };
+
+    // 分配一个新的协程局部变量槽位
+    static uint32_t AllocLocalSlot();
+
+    // 当前协程的槽位，不存在时扩容，没有协程时使用线程的主协程
+    static LocalValue &GetLocal(uint32_t slot);
+
+    // 当前协程的槽位，不存在时返回nullptr
+    static LocalValue *FindLocal(uint32_t slot);
+
+    // 析构槽位的值并清空槽位
+    static void DestroyLocal(LocalValue &value);
+
+    // 把当前协程到目前为止的栈用量高水位记到key下，用于按请求处理函数等协程内部的调用统计栈用量
+    // 没有开启栈用量统计或当前协程的栈没有涂过时什么也不做
+    static void RecordStackUsage(const std::string &key);
+
     // 协程入口函数
     static void MainFunc();
 
     static uint64_t GetFiberId();
 private:
+    // 在协程栈上创建从MainFunc开始执行的上下文
+    void initContext();
+
+    // 保存from的上下文并切换到to
+    static void SwapContext(Fiber *from, Fiber *to);
+
+    // 切换到共享栈协程之前，把保存的栈内容拷回当前线程的共享栈，第一次运行时绑定线程并创建上下文
+    void restoreStack();
+
+    // 共享栈协程切出后，把共享栈上用到的部分拷贝到缓冲区
+    void saveStack();
+
+    // 第一次resume时分配独立栈并创建上下文，开启了栈用量统计时给栈涂上固定字节
+    void allocStack();
+
+    // 协程结束后统计栈用量，并把栈还给分配器
+    void releaseStack();
+
+    // 协程结束后唤醒join的等待者
+    void notifyJoiners();
+
+    // 析构所有协程局部变量，协程结束、reset和析构时调用
+    void clearLocals();
+
+    // 修改状态，保留唤醒标记
+    void setState(State state);
+
+    // 在resume的调用方执行，协程上下文已经保存完，SUSPENDING变为READY，并调度切出过程中登记的唤醒
+    void finishSwitch();
+
+private:
+    // m_state的低位是State，WAKE_PENDING表示切出完成前已经登记了唤醒
+    // WAKE_PUBLISHING表示登记成功的一方还在写m_deferredWake，清除后才能读取
+    static const int STATE_MASK      = 0xff;
+    static const int WAKE_PENDING    = 0x100;
+    static const int WAKE_PUBLISHING = 0x200;
+
     // 协程id
     uint64_t m_id        = 0;
     // 协程栈大小
     uint32_t m_stacksize = 0;
-    // 协程状态
-    State m_state        = READY;
-    // 协程上下文
-    ucontext_t m_ctx;
-    // 协程栈地址
+    // 协程状态和唤醒标记
+    std::atomic<int> m_state = {READY};
+    // 切出完成前登记的唤醒，WAKE_PENDING置位且WAKE_PUBLISHING清除后有效
+    void *m_deferredWake = nullptr;
+    // 协程上下文，汇编实现下是切出时的栈指针，ucontext实现下指向单独分配的ucontext_t，
+    // 这样Fiber的布局不随编译选项变化，使用方不需要和库使用相同的WILL_FIBER_ASM定义
+    void *m_ctx = nullptr;
+    // 协程栈地址，第一次resume时分配，结束后释放，主协程没有栈时m_stacksize为0
     void *m_stack = nullptr;
     // 协程入口函数
     std::function<void()> m_cb;
     // 本协程是否参与调度器调度
-    bool m_runInScheduler;
+    bool m_runInScheduler = false;
+    // 是否运行在线程的共享栈上
+    bool m_sharedStack = false;
+    // 共享栈协程绑定的线程id
+    std::atomic<int> m_boundThread = {-1};
+    // 共享栈协程切出时保存的栈内容，从共享栈栈顶往下m_savedSize字节
+    char *m_savedStack    = nullptr;
+    size_t m_savedSize     = 0;
+    size_t m_savedCapacity = 0;
+    // 栈用量统计使用的入口名
+    const char *m_stackKey = nullptr;
+    // 栈是否已经涂过
+    bool m_stackPainted = false;
+    // 第一次join时创建，协程结束时done
+    Spinlock m_joinLock;
+    std::shared_ptr<WaitGroup> m_joiners;
+    // 协程局部变量，按槽位下标访问，第一次使用时分配
+    LocalValue *m_locals = nullptr;
+    uint32_t m_localCount = 0;
 };
 
 } // namespace will
@@ -0,0 +1,93 @@
+#ifndef __WILL_FIBER_LOCAL_H__
+#define __WILL_FIBER_LOCAL_H__
+
+#include <new>
+#include <type_traits>
+#include "fiber.h"
+#include "noncopyable.h"
+
+namespace will {
+
+// 协程局部变量，每个协程各有一份，协程在线程之间迁移时跟着协程走，thread_local做不到这一点
+// 每个FiberLocal对象在构造时分配一个全局槽位，协程里按槽位下标直接访问，不需要哈希查找
+// 槽位不回收，FiberLocal应该是全局或静态对象，不要反复创建
+// 值在协程第一次访问时默认构造，协程结束(TERM)或reset时析构，不超过一个指针大小的平凡类型直接存放在槽位里，其他类型堆分配
+// 不在协程里访问时使用线程的主协程的那一份
+template <class T>
+class FiberLocal : Noncopyable {
+public:
+    FiberLocal()
+        : m_slot(Fiber::AllocLocalSlot()) {
+    }
+
+    // 当前协程的值，第一次访问时默认构造
+    T &get() {
+        Fiber::LocalValue &value = Fiber::GetLocal(m_slot);
+        if (!value.destroy) {
+            Init(value, std::integral_constant<bool, IsInline::value>());
+        }
+        return *Get(value, std::integral_constant<bool, IsInline::value>());
+    }
+
+    // 当前协程是否已经有值
+    bool has() const {
+        Fiber::LocalValue *value = Fiber::FindLocal(m_slot);
+        return value && value->destroy;
+    }
+
+    void set(const T &v) {
+        get() = v;
+    }
+
+    // 提前析构当前协程的值，下次访问时重新默认构造
+    void reset() {
+        Fiber::LocalValue *value = Fiber::FindLocal(m_slot);
+        if (value && value->destroy) {
+            Fiber::DestroyLocal(*value);
+        }
+    }
+
+    T &operator*() { return get(); }
+
+    T *operator->() { return &get(); }
+
+    uint32_t getSlot() const { return m_slot; }
+
+private:
+    // 可以直接放进槽位的类型
+    struct IsInline {
+        static const bool value = sizeof(T) <= sizeof(void *)
+                                  && alignof(T) <= alignof(void *)
+                                  && std::is_trivially_copyable<T>::value;
+    };
+
+    static void DestroyInline(void *) {}
+
+    static void DestroyHeap(void *data) { delete static_cast<T *>(data); }
+
+    static void Init(Fiber::LocalValue &value, std::true_type) {
+        new (&value.data) T();
+        value.destroy = &DestroyInline;
+    }
+
+    static void Init(Fiber::LocalValue &value, std::false_type) {
+        value.data    = new T();
+        value.destroy = &DestroyHeap;
+    }
+
+    static T *Get(Fiber::LocalValue &value, std::true_type) {
+        return reinterpret_cast<T *>(&value.data);
+    }
+
+    static T *Get(Fiber::LocalValue &value, std::false_type) {
+        return static_cast<T *>(value.data);
+    }
+
+private:
+    // 槽位下标
+    uint32_t m_slot;
+};
+
+} // namespace will
+
+#endif
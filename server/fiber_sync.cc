@@ -0,0 +1,256 @@
+#include "fiber_sync.h"
+#include "iomanager.h"
+#include "macro.h"
+#include "util.h"
+
+namespace will {
+
+struct FiberWaitQueue::Waiter {
+    enum State {
+        WAITING,
+        // 被唤醒，锁或许可已经交给这个协程
+        NOTIFIED,
+        TIMEDOUT
+    };
+
+    Fiber::ptr fiber;
+    // 唤醒时把协程放回等待前所在的调度器，沿用等待前的优先级
+    Scheduler *scheduler = nullptr;
+    Scheduler::Priority priority = Scheduler::NORMAL;
+    // 不在调度器协程里等待时阻塞在这个信号量上
+    std::unique_ptr<Semaphore> sem;
+    // 唤醒和超时通过CAS决出唯一的胜者，只有胜者会重新调度协程
+    std::atomic<int> state = {WAITING};
+    // 是否还在等待队列里，持有队列的锁时访问
+    bool inQueue = true;
+    std::list<WaiterPtr>::iterator it;
+};
+
+FiberWaitQueue::WaiterPtr FiberWaitQueue::prepare() {
+    WaiterPtr waiter(new Waiter);
+    waiter->scheduler = Scheduler::GetThis();
+    if (waiter->scheduler) {
+        waiter->fiber = Fiber::GetThis();
+    }
+    if (waiter->fiber && waiter->fiber->isRunInScheduler()) {
+        waiter->priority = Scheduler::GetCurrentPriority();
+    } else {
+        waiter->fiber.reset();
+        waiter->sem.reset(new Semaphore);
+    }
+    waiter->it = m_waiters.insert(m_waiters.end(), waiter);
+    return waiter;
+}
+
+bool FiberWaitQueue::park(const WaiterPtr &waiter, uint64_t timeout_ms) {
+    if (waiter->sem) {
+        if (timeout_ms == FIBER_WAIT_FOREVER) {
+            waiter->sem->wait();
+            return waiter->state == Waiter::NOTIFIED;
+        }
+        if (waiter->sem->waitFor(timeout_ms)) {
+            return waiter->state == Waiter::NOTIFIED;
+        }
+        if (cancelWait(waiter)) {
+            return false;
+        }
+        // 超时的同时已经被popOne取出，锁或许可已经交给这个线程，等唤醒方notify之后按唤醒返回
+        waiter->sem->wait();
+        return true;
+    }
+    Timer::ptr timer;
+    if (timeout_ms != FIBER_WAIT_FOREVER && waiter->state == Waiter::WAITING) {
+        IOManager *iom = IOManager::GetThis();
+        WILL_ASSERT2(iom, "fiber wait with timeout needs an IOManager");
+        timer = iom->addTimer(timeout_ms, std::bind(&FiberWaitQueue::onTimeout, this, waiter));
+    }
+    // 释放锁到这里之间被唤醒也没关系，协程切出完成后才会被重新调度
+    waiter->fiber->yield();
+    if (timer) {
+        timer->cancel();
+    }
+    waiter->fiber.reset();
+    return waiter->state == Waiter::NOTIFIED;
+}
+
+FiberWaitQueue::WaiterPtr FiberWaitQueue::popOne() {
+    while (!m_waiters.empty()) {
+        WaiterPtr waiter = std::move(m_waiters.front());
+        m_waiters.pop_front();
+        waiter->inQueue = false;
+        int expected = Waiter::WAITING;
+        // 已经超时的等待者由超时回调负责调度，跳过
+        if (waiter->state.compare_exchange_strong(expected, Waiter::NOTIFIED)) {
+            return waiter;
+        }
+    }
+    return nullptr;
+}
+
+void FiberWaitQueue::popAll(std::vector<WaiterPtr> &waiters) {
+    while (WaiterPtr waiter = popOne()) {
+        waiters.push_back(std::move(waiter));
+    }
+}
+
+void FiberWaitQueue::Wake(const WaiterPtr &waiter) {
+    if (waiter->sem) {
+        waiter->sem->notify();
+    } else {
+        waiter->scheduler->schedule(waiter->fiber, -1, waiter->priority);
+    }
+}
+
+bool FiberWaitQueue::cancelWait(const WaiterPtr &waiter) {
+    int expected = Waiter::WAITING;
+    if (!waiter->state.compare_exchange_strong(expected, Waiter::TIMEDOUT)) {
+        return false;
+    }
+    // 等待者还没有返回，使用方对象一定还活着
+    Spinlock::Lock lock(m_lock);
+    if (waiter->inQueue) {
+        m_waiters.erase(waiter->it);
+        waiter->inQueue = false;
+    }
+    return true;
+}
+
+void FiberWaitQueue::onTimeout(const WaiterPtr &waiter) {
+    if (cancelWait(waiter)) {
+        Wake(waiter);
+    }
+}
+
+bool FiberMutex::lock(uint64_t timeout_ms) {
+    Spinlock::Lock lock(m_lock);
+    if (!m_locked) {
+        m_locked = true;
+        return true;
+    }
+    if (timeout_ms == 0) {
+        return false;
+    }
+    FiberWaitQueue::WaiterPtr waiter = m_waiters.prepare();
+    lock.unlock();
+    // 被唤醒时锁已经由unlock直接交给当前协程
+    return m_waiters.park(waiter, timeout_ms);
+}
+
+bool FiberMutex::tryLock() {
+    return lock(0);
+}
+
+void FiberMutex::unlock() {
+    Spinlock::Lock lock(m_lock);
+    WILL_ASSERT2(m_locked, "unlock a FiberMutex that is not locked");
+    FiberWaitQueue::WaiterPtr waiter = m_waiters.popOne();
+    if (!waiter) {
+        m_locked = false;
+        return;
+    }
+    lock.unlock();
+    FiberWaitQueue::Wake(waiter);
+}
+
+bool FiberCondition::wait(FiberMutex &mutex, uint64_t timeout_ms) {
+    Spinlock::Lock lock(m_lock);
+    FiberWaitQueue::WaiterPtr waiter = m_waiters.prepare();
+    lock.unlock();
+    // 先入队再释放mutex，释放之后的通知不会丢失
+    mutex.unlock();
+    bool rt = m_waiters.park(waiter, timeout_ms);
+    mutex.lock();
+    return rt;
+}
+
+void FiberCondition::notifyOne() {
+    Spinlock::Lock lock(m_lock);
+    FiberWaitQueue::WaiterPtr waiter = m_waiters.popOne();
+    lock.unlock();
+    if (waiter) {
+        FiberWaitQueue::Wake(waiter);
+    }
+}
+
+void FiberCondition::notifyAll() {
+    std::vector<FiberWaitQueue::WaiterPtr> waiters;
+    Spinlock::Lock lock(m_lock);
+    m_waiters.popAll(waiters);
+    lock.unlock();
+    for (auto &i : waiters) {
+        FiberWaitQueue::Wake(i);
+    }
+}
+
+bool FiberSemaphore::wait(uint64_t timeout_ms) {
+    Spinlock::Lock lock(m_lock);
+    if (m_count > 0) {
+        --m_count;
+        return true;
+    }
+    if (timeout_ms == 0) {
+        return false;
+    }
+    FiberWaitQueue::WaiterPtr waiter = m_waiters.prepare();
+    lock.unlock();
+    // 被唤醒时许可已经由notify直接交给当前协程
+    return m_waiters.park(waiter, timeout_ms);
+}
+
+bool FiberSemaphore::tryWait() {
+    return wait(0);
+}
+
+void FiberSemaphore::notify() {
+    Spinlock::Lock lock(m_lock);
+    FiberWaitQueue::WaiterPtr waiter = m_waiters.popOne();
+    if (!waiter) {
+        ++m_count;
+        return;
+    }
+    lock.unlock();
+    FiberWaitQueue::Wake(waiter);
+}
+
+uint32_t FiberSemaphore::getCount() {
+    Spinlock::Lock lock(m_lock);
+    return m_count;
+}
+
+void WaitGroup::add(int64_t n) {
+    std::vector<FiberWaitQueue::WaiterPtr> waiters;
+    Spinlock::Lock lock(m_lock);
+    m_count += n;
+    WILL_ASSERT2(m_count >= 0, "WaitGroup count below zero");
+    if (m_count == 0) {
+        m_waiters.popAll(waiters);
+    }
+    lock.unlock();
+    for (auto &i : waiters) {
+        FiberWaitQueue::Wake(i);
+    }
+}
+
+bool WaitGroup::wait(uint64_t timeout_ms) {
+    uint64_t deadline = timeout_ms == FIBER_WAIT_FOREVER ? FIBER_WAIT_FOREVER : GetCurrentMS() + timeout_ms;
+    Spinlock::Lock lock(m_lock);
+    while (m_count > 0) {
+        uint64_t now = GetCurrentMS();
+        if (deadline != FIBER_WAIT_FOREVER && now >= deadline) {
+            return false;
+        }
+        FiberWaitQueue::WaiterPtr waiter = m_waiters.prepare();
+        lock.unlock();
+        // 被唤醒后计数可能又被add加上去了，重新检查
+        m_waiters.park(waiter, deadline == FIBER_WAIT_FOREVER ? FIBER_WAIT_FOREVER : deadline - now);
+        lock.lock();
+    }
+    return true;
+}
+
+int64_t WaitGroup::getCount() {
+    Spinlock::Lock lock(m_lock);
+    return m_count;
+}
+
+} // namespace will
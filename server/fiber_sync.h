@@ -0,0 +1,150 @@
+#ifndef __WILL_FIBER_SYNC_H__
+#define __WILL_FIBER_SYNC_H__
+
+#include <stdint.h>
+#include <atomic>
+#include <list>
+#include <memory>
+#include <vector>
+#include "fiber.h"
+#include "mutex.h"
+#include "noncopyable.h"
+#include "scheduler.h"
+
+namespace will {
+
+// 协程级的同步原语，等待时只挂起当前协程，由释放方把它重新调度到原来的调度器上，不会阻塞工作线程和线程上排队的其他协程
+// mutex.h里的线程锁在协程里竞争时会阻塞整个工作线程，持锁的协程如果因为IO让出，等锁的协程又在同一个线程上，线程就会死锁
+// 等待者按先来先服务排队，释放时直接把锁或许可交给队首，不会被新来的协程插队饿死
+// 协程里等待的超时由当前IOManager的定时器实现，调度器的协程里只有IOManager才能指定超时
+// 不在调度器调度的协程里(比如main函数所在的线程)等待时退化为阻塞线程，超时由信号量的sem_timedwait实现，释放和通知可以在任何地方调用
+
+// 不限时等待
+static const uint64_t FIBER_WAIT_FOREVER = ~0ull;
+
+// 协程等待队列，使用方持有lock时操作队列
+class FiberWaitQueue : Noncopyable {
+public:
+    struct Waiter;
+    typedef std::shared_ptr<Waiter> WaiterPtr;
+
+    // lock 保护等待队列和使用方状态的锁，超时回调从队列中移除等待者时也要加这个锁
+    FiberWaitQueue(Spinlock &lock)
+        : m_lock(lock) {
+    }
+
+    // 持有锁时调用，把当前协程或线程加入队尾
+    WaiterPtr prepare();
+
+    // 释放锁之后调用，挂起当前协程直到被唤醒或超时，被唤醒返回true，超时返回false
+    // 超时返回时等待者已经不在队列里
+    bool park(const WaiterPtr &waiter, uint64_t timeout_ms);
+
+    // 持有锁时调用，取出队首一个还在等待的协程并标记为已唤醒，没有时返回nullptr
+    // 释放锁之后再用Wake重新调度，调度器加锁和tickle不放在使用方的锁里
+    WaiterPtr popOne();
+
+    // 持有锁时调用，取出所有还在等待的协程
+    void popAll(std::vector<WaiterPtr> &waiters);
+
+    // 把popOne取出的协程重新调度到它等待前所在的调度器，等待的是线程时唤醒线程
+    static void Wake(const WaiterPtr &waiter);
+
+    bool empty() const { return m_waiters.empty(); }
+
+private:
+    // 等待者还没有被唤醒时标记为超时并从队列中移除，返回false表示已经被popOne取出
+    bool cancelWait(const WaiterPtr &waiter);
+
+    // 超时回调，等待者还没有被唤醒时从队列中移除并重新调度
+    void onTimeout(const WaiterPtr &waiter);
+
+private:
+    Spinlock &m_lock;
+    std::list<WaiterPtr> m_waiters;
+};
+
+// 协程互斥锁，不可重入
+class FiberMutex : Noncopyable {
+public:
+    typedef ScopedLockImpl<FiberMutex> Lock;
+
+    void lock() { lock(FIBER_WAIT_FOREVER); }
+
+    // timeout_ms 最长等待时间，超时返回false
+    bool lock(uint64_t timeout_ms);
+
+    bool tryLock();
+
+    void unlock();
+
+private:
+    Spinlock m_lock;
+    bool m_locked = false;
+    FiberWaitQueue m_waiters{m_lock};
+};
+
+// 协程条件变量，配合FiberMutex使用
+class FiberCondition : Noncopyable {
+public:
+    // 释放mutex并挂起当前协程，被唤醒或超时后重新获得mutex
+    // 超时返回false，和std::condition_variable一样可能有虚假唤醒，调用方要在循环里检查条件
+    bool wait(FiberMutex &mutex, uint64_t timeout_ms = FIBER_WAIT_FOREVER);
+
+    void notifyOne();
+
+    void notifyAll();
+
+private:
+    Spinlock m_lock;
+    FiberWaitQueue m_waiters{m_lock};
+};
+
+// 协程信号量
+class FiberSemaphore : Noncopyable {
+public:
+    FiberSemaphore(uint32_t count = 0)
+        : m_count(count) {
+    }
+
+    // 取得一个许可，超时返回false
+    bool wait(uint64_t timeout_ms = FIBER_WAIT_FOREVER);
+
+    bool tryWait();
+
+    // 归还一个许可，有协程在等待时直接交给队首
+    void notify();
+
+    uint32_t getCount();
+
+private:
+    Spinlock m_lock;
+    uint32_t m_count;
+    FiberWaitQueue m_waiters{m_lock};
+};
+
+// 等待一组任务全部完成，和Go的sync.WaitGroup类似
+// 启动任务前add，任务结束时done，wait挂起当前协程直到计数归零，完成方可以在任何调度器或线程上调用done
+class WaitGroup : Noncopyable {
+public:
+    typedef std::shared_ptr<WaitGroup> ptr;
+
+    // 计数加n，n可以为负数，计数归零时唤醒所有等待者
+    void add(int64_t n = 1);
+
+    void done() { add(-1); }
+
+    // 等待计数归零，超时返回false
+    bool wait(uint64_t timeout_ms = FIBER_WAIT_FOREVER);
+
+    int64_t getCount();
+
+private:
+    Spinlock m_lock;
+    int64_t m_count = 0;
+    FiberWaitQueue m_waiters{m_lock};
+};
+
+} // namespace will
+
+#endif
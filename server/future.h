@@ -0,0 +1,200 @@
+#ifndef __WILL_FUTURE_H__
+#define __WILL_FUTURE_H__
+
+#include <exception>
+#include <memory>
+#include <stdexcept>
+#include <vector>
+#include "fiber_sync.h"
+#include "macro.h"
+
+namespace will {
+
+// 异步结果的共享状态，Promise写入，Future读取
+// 等待结果时只挂起当前协程，结果可以在任何调度器或线程上写入，等待者被放回各自的调度器
+class FutureStateBase : Noncopyable {
+public:
+    // 等待结果就绪，超时返回false
+    bool wait(uint64_t timeout_ms) {
+        Spinlock::Lock lock(m_lock);
+        if (m_ready) {
+            return true;
+        }
+        if (timeout_ms == 0) {
+            return false;
+        }
+        FiberWaitQueue::WaiterPtr waiter = m_waiters.prepare();
+        lock.unlock();
+        // 结果只写一次，被唤醒就说明已经就绪
+        return m_waiters.park(waiter, timeout_ms);
+    }
+
+    bool isReady() {
+        Spinlock::Lock lock(m_lock);
+        return m_ready;
+    }
+
+    void setException(std::exception_ptr e) {
+        complete([this, e]() { m_exception = e; });
+    }
+
+    bool hasException() const { return (bool)m_exception; }
+
+    void rethrow() const {
+        if (m_exception) {
+            std::rethrow_exception(m_exception);
+        }
+    }
+
+protected:
+    // 在锁内写入结果并唤醒所有等待者，结果只能写一次
+    template <class F>
+    void complete(F set) {
+        std::vector<FiberWaitQueue::WaiterPtr> waiters;
+        Spinlock::Lock lock(m_lock);
+        WILL_ASSERT2(!m_ready, "promise already satisfied");
+        set();
+        m_ready = true;
+        m_waiters.popAll(waiters);
+        lock.unlock();
+        for (auto &i : waiters) {
+            FiberWaitQueue::Wake(i);
+        }
+    }
+
+protected:
+    Spinlock m_lock;
+    bool m_ready = false;
+    std::exception_ptr m_exception;
+    FiberWaitQueue m_waiters{m_lock};
+};
+
+template <class T>
+class FutureState : public FutureStateBase {
+public:
+    void setValue(T v) {
+        complete([this, &v]() { m_value.reset(new T(std::move(v))); });
+    }
+
+    // 结果就绪后调用
+    T &getValue() { return *m_value; }
+
+private:
+    std::unique_ptr<T> m_value;
+};
+
+template <>
+class FutureState<void> : public FutureStateBase {
+public:
+    void setValue() {
+        complete([]() {});
+    }
+
+    void getValue() {}
+};
+
+template <class T>
+class Promise;
+
+// 异步结果的读取端，可以复制，多个协程可以同时等待同一个结果
+template <class T>
+class Future {
+friend class Promise<T>;
+public:
+    Future() {}
+
+    bool valid() const { return (bool)m_state; }
+
+    // 挂起当前协程直到结果就绪，超时返回false
+    // 不在调度器调度的协程里调用时阻塞线程，超时同样有效
+    bool wait(uint64_t timeout_ms = FIBER_WAIT_FOREVER) const {
+        return m_state->wait(timeout_ms);
+    }
+
+    bool isReady() const { return m_state->isReady(); }
+
+    // 等待并返回结果，Promise设置了异常时抛出这个异常
+    typename std::add_lvalue_reference<T>::type get() const {
+        m_state->wait(FIBER_WAIT_FOREVER);
+        m_state->rethrow();
+        return m_state->getValue();
+    }
+
+private:
+    Future(const std::shared_ptr<FutureState<T> > &state)
+        : m_state(state) {
+    }
+
+private:
+    std::shared_ptr<FutureState<T> > m_state;
+};
+
+// 异步结果的写入端，只能设置一次结果，没有设置结果就析构时Future得到broken promise异常
+template <class T>
+class Promise : Noncopyable {
+public:
+    Promise()
+        : m_state(new FutureState<T>) {
+    }
+
+    ~Promise() {
+        if (m_state && !m_state->isReady()) {
+            m_state->setException(std::make_exception_ptr(std::runtime_error("broken promise")));
+        }
+    }
+
+    Future<T> getFuture() { return Future<T>(m_state); }
+
+    template <class... Args>
+    void setValue(Args &&...args) {
+        m_state->setValue(std::forward<Args>(args)...);
+    }
+
+    void setException(std::exception_ptr e) {
+        m_state->setException(e);
+    }
+
+private:
+    std::shared_ptr<FutureState<T> > m_state;
+};
+
+// 在scheduler上异步执行cb，返回结果的Future，cb抛出的异常在Future::get时重新抛出
+// 聚合多个后端调用时先全部Async出去再逐个get，总耗时取决于最慢的一个而不是所有调用之和
+template <class R, class F>
+Future<R> AsyncImpl(Scheduler *scheduler, F cb, std::false_type) {
+    std::shared_ptr<Promise<R> > promise(new Promise<R>);
+    Future<R> future = promise->getFuture();
+    scheduler->schedule([promise, cb]() mutable {
+        try {
+            promise->setValue(cb());
+        } catch (...) {
+            promise->setException(std::current_exception());
+        }
+    });
+    return future;
+}
+
+template <class R, class F>
+Future<R> AsyncImpl(Scheduler *scheduler, F cb, std::true_type) {
+    std::shared_ptr<Promise<R> > promise(new Promise<R>);
+    Future<R> future = promise->getFuture();
+    scheduler->schedule([promise, cb]() mutable {
+        try {
+            cb();
+            promise->setValue();
+        } catch (...) {
+            promise->setException(std::current_exception());
+        }
+    });
+    return future;
+}
+
+template <class F>
+Future<typename std::result_of<F()>::type> Async(Scheduler *scheduler, F cb) {
+    typedef typename std::result_of<F()>::type R;
+    return AsyncImpl<R>(scheduler, std::move(cb), std::is_void<R>());
+}
+
+} // namespace will
+
+#endif
@@ -0,0 +1,97 @@
+#ifndef __WILL_HISTOGRAM_H__
+#define __WILL_HISTOGRAM_H__
+
+#include <stdint.h>
+#include <atomic>
+#include <ostream>
+
+namespace will {
+
+// 按2的幂划分桶的直方图，用于统计延迟等非负整数
+// 第0个桶统计0，第i个桶统计[2^(i-1), 2^i)，最后一个桶统计所有更大的值
+// 只允许一个线程写入，写入只做relaxed的读和写，不加锁也不需要原子的读改写指令，其他线程可以随时读取近似值
+class Histogram {
+public:
+    static const int BUCKETS = 32;
+
+    // 直方图的快照，可以合并多个线程的直方图
+    struct Snapshot {
+        uint64_t buckets[BUCKETS] = {0};
+        uint64_t count            = 0;
+        uint64_t sum              = 0;
+        uint64_t max              = 0;
+
+        void merge(const Snapshot &other) {
+            for (int i = 0; i < BUCKETS; ++i) {
+                buckets[i] += other.buckets[i];
+            }
+            count += other.count;
+            sum += other.sum;
+            if (other.max > max) {
+                max = other.max;
+            }
+        }
+
+        uint64_t avg() const { return count ? sum / count : 0; }
+
+        // 返回百分位p(0~1)所在桶的上界，是一个不小于真实值的近似值
+        uint64_t percentile(double p) const {
+            uint64_t target = (uint64_t)(count * p);
+            uint64_t seen   = 0;
+            for (int i = 0; i < BUCKETS; ++i) {
+                seen += buckets[i];
+                if (seen > target) {
+                    uint64_t upper = i == 0 ? 0 : (1ull << i) - 1;
+                    return upper < max ? upper : max;
+                }
+            }
+            return max;
+        }
+
+        std::ostream &dump(std::ostream &os) const {
+            os << "[count=" << count << " avg=" << avg() << " p50=" << percentile(0.5)
+               << " p99=" << percentile(0.99) << " max=" << max << "]";
+            return os;
+        }
+    };
+
+    void add(uint64_t value) {
+        int i = 0;
+        if (value) {
+            i = 64 - __builtin_clzll(value);
+            if (i >= BUCKETS) {
+                i = BUCKETS - 1;
+            }
+        }
+        Inc(m_buckets[i], 1);
+        Inc(m_count, 1);
+        Inc(m_sum, value);
+        if (value > m_max.load(std::memory_order_relaxed)) {
+            m_max.store(value, std::memory_order_relaxed);
+        }
+    }
+
+    void snapshot(Snapshot &snap) const {
+        for (int i = 0; i < BUCKETS; ++i) {
+            snap.buckets[i] = m_buckets[i].load(std::memory_order_relaxed);
+        }
+        snap.count = m_count.load(std::memory_order_relaxed);
+        snap.sum   = m_sum.load(std::memory_order_relaxed);
+        snap.max   = m_max.load(std::memory_order_relaxed);
+    }
+
+    // 单写者计数器加n，不需要lock前缀的原子指令
+    static void Inc(std::atomic<uint64_t> &v, uint64_t n) {
+        v.store(v.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+
+private:
+    std::atomic<uint64_t> m_buckets[BUCKETS] = {};
+    std::atomic<uint64_t> m_count            = {0};
+    std::atomic<uint64_t> m_sum              = {0};
+    std::atomic<uint64_t> m_max              = {0};
+};
+
+} // namespace will
+
+#endif
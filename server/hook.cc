@@ -71,6 +71,68 @@ struct timer_info {
     int cancelled = 0;
 };
 
+// hook的socket、accept拿到新fd时调用
+// 同一个fd号的旧fd可能绕过hook关闭(hook关闭的线程里close或直接调用close_f)，FdCtx没有删除，cancelAll也没有执行
+// 旧的FdCtx记录的非阻塞和超时属于旧fd，换成新的；再清掉旧fd在当前IOManager上遗留的常驻注册，
+// 否则新fd的addEvent会跳过epoll_ctl，永远等不到事件
+static void new_fd(int fd) {
+    if(will::FdMgr::GetInstance()->get(fd)) {
+        will::FdMgr::GetInstance()->del(fd);
+    }
+    will::FdMgr::GetInstance()->get(fd, true);
+    will::IOManager* iom = will::IOManager::GetThis();
+    if(iom) {
+        iom->cancelAll(fd);
+    }
+}
+
+// IOManager使用io_uring后端时，把socket上的操作直接作为SQE提交，挂起当前协程直到操作完成
+// 返回false表示不能直接提交，调用方走原来先调用、EAGAIN时等待就绪事件的流程
+static bool uring_io(int fd, will::Poller::IoOp op, void *addr, uint64_t len, void *addr2, int flags,
+                     int timeout_so, ssize_t &result) {
+    if(!will::t_hook_enable) {
+        return false;
+    }
+    will::IOManager* iom = will::IOManager::GetThis();
+    if(!iom || iom->getPollerType() != will::Poller::URING) {
+        return false;
+    }
+    will::FdCtx::ptr ctx = will::FdMgr::GetInstance()->get(fd);
+    if(!ctx || ctx->isClose() || !ctx->isSocket() || ctx->getUserNonblock()) {
+        return false;
+    }
+
+    will::Poller::IoRequest req;
+    req.op        = op;
+    req.fd        = fd;
+    req.addr      = addr;
+    req.len       = len;
+    req.addr2     = addr2;
+    req.flags     = flags;
+    req.timeoutMs = ctx->getTimeout(timeout_so);
+    if(!iom->submitIO(req)) {
+        return false;
+    }
+
+    int res = req.result;
+    if(res == -EAGAIN) {
+        // 内核没有在io_uring里等待这个操作，退回等待就绪事件
+        return false;
+    }
+    if(res >= 0) {
+        result = res;
+        return true;
+    }
+    if(res == -ECANCELED) {
+        // 被LINK_TIMEOUT取消的是超时，否则是fd被关闭
+        errno = req.timedOut ? ETIMEDOUT : EBADF;
+    } else {
+        errno = -res;
+    }
+    result = -1;
+    return true;
+}
+
 template<typename OriginFun, typename... Args>
 static ssize_t do_io(int fd, OriginFun fun, const char* hook_fun_name,
         uint32_t event, int timeout_so, Args&&... args) {
@@ -94,14 +156,17 @@ static ssize_t do_io(int fd, OriginFun fun, const char* hook_fun_name,
 
     uint64_t to = ctx->getTimeout(timeout_so);
     std::shared_ptr<timer_info> tinfo(new timer_info);
+    will::IOManager* iom = will::IOManager::GetThis();
 
 retry:
     ssize_t n = fun(fd, std::forward<Args>(args)...);
     while(n == -1 && errno == EINTR) {
         n = fun(fd, std::forward<Args>(args)...);
     }
+    if(iom) {
+        iom->countIoSyscall();
+    }
     if(n == -1 && errno == EAGAIN) {
-        will::IOManager* iom = will::IOManager::GetThis();
         will::Timer::ptr timer;
         std::weak_ptr<timer_info> winfo(tinfo);
 
@@ -154,8 +219,8 @@ unsigned int sleep(unsigned int seconds) {
     will::Fiber::ptr fiber = will::Fiber::GetThis();
     will::IOManager* iom = will::IOManager::GetThis();
     iom->addTimer(seconds * 1000, std::bind((void(will::Scheduler::*)
-            (will::Fiber::ptr, int thread))&will::IOManager::schedule
-            ,iom, fiber, -1));
+            (will::Fiber::ptr, int thread, will::Scheduler::Priority))&will::IOManager::schedule
+            ,iom, fiber, -1, will::Scheduler::GetCurrentPriority()));
     will::Fiber::GetThis()->yield();
     return 0;
 }
@@ -167,8 +232,8 @@ int usleep(useconds_t usec) {
     will::Fiber::ptr fiber = will::Fiber::GetThis();
     will::IOManager* iom = will::IOManager::GetThis();
     iom->addTimer(usec / 1000, std::bind((void(will::Scheduler::*)
-            (will::Fiber::ptr, int thread))&will::IOManager::schedule
-            ,iom, fiber, -1));
+            (will::Fiber::ptr, int thread, will::Scheduler::Priority))&will::IOManager::schedule
+            ,iom, fiber, -1, will::Scheduler::GetCurrentPriority()));
     will::Fiber::GetThis()->yield();
     return 0;
 }
@@ -182,8 +247,8 @@ int nanosleep(const struct timespec *req, struct timespec *rem) {
     will::Fiber::ptr fiber = will::Fiber::GetThis();
     will::IOManager* iom = will::IOManager::GetThis();
     iom->addTimer(timeout_ms, std::bind((void(will::Scheduler::*)
-            (will::Fiber::ptr, int thread))&will::IOManager::schedule
-            ,iom, fiber, -1));
+            (will::Fiber::ptr, int thread, will::Scheduler::Priority))&will::IOManager::schedule
+            ,iom, fiber, -1, will::Scheduler::GetCurrentPriority()));
     will::Fiber::GetThis()->yield();
     return 0;
 }
@@ -196,7 +261,7 @@ int socket(int domain, int type, int protocol) {
     if(fd == -1) {
         return fd;
     }
-    will::FdMgr::GetInstance()->get(fd, true);
+    new_fd(fd);
     return fd;
 }
 
@@ -218,14 +283,33 @@ int connect_with_timeout(int fd, const struct sockaddr* addr, socklen_t addrlen,
         return connect_f(fd, addr, addrlen);
     }
 
+    will::IOManager* iom = will::IOManager::GetThis();
+    if(iom && iom->getPollerType() == will::Poller::URING) {
+        will::Poller::IoRequest req;
+        req.op        = will::Poller::IO_CONNECT;
+        req.fd        = fd;
+        req.addr      = (void*)addr;
+        req.len       = addrlen;
+        req.timeoutMs = timeout_ms;
+        if(iom->submitIO(req)) {
+            if(req.result == 0) {
+                return 0;
+            }
+            errno = req.result != -ECANCELED ? -req.result : (req.timedOut ? ETIMEDOUT : EBADF);
+            return -1;
+        }
+    }
+
     int n = connect_f(fd, addr, addrlen);
+    if(iom) {
+        iom->countIoSyscall();
+    }
     if(n == 0) {
         return 0;
     } else if(n != -1 || errno != EINPROGRESS) {
         return n;
     }
 
-    will::IOManager* iom = will::IOManager::GetThis();
     will::Timer::ptr timer;
     std::shared_ptr<timer_info> tinfo(new timer_info);
     std::weak_ptr<timer_info> winfo(tinfo);
@@ -276,14 +360,24 @@ int connect(int sockfd, const struct sockaddr *addr, socklen_t addrlen) {
 }
 
 int accept(int s, struct sockaddr *addr, socklen_t *addrlen) {
-    int fd = do_io(s, accept_f, "accept", will::IOManager::READ, SO_RCVTIMEO, addr, addrlen);
+    ssize_t rt = 0;
+    int fd = 0;
+    if(uring_io(s, will::Poller::IO_ACCEPT, addr, 0, addrlen, 0, SO_RCVTIMEO, rt)) {
+        fd = rt;
+    } else {
+        fd = do_io(s, accept_f, "accept", will::IOManager::READ, SO_RCVTIMEO, addr, addrlen);
+    }
     if(fd >= 0) {
-        will::FdMgr::GetInstance()->get(fd, true);
+        new_fd(fd);
     }
     return fd;
 }
 
 ssize_t read(int fd, void *buf, size_t count) {
+    ssize_t rt = 0;
+    if(uring_io(fd, will::Poller::IO_RECV, buf, count, nullptr, 0, SO_RCVTIMEO, rt)) {
+        return rt;
+    }
     return do_io(fd, read_f, "read", will::IOManager::READ, SO_RCVTIMEO, buf, count);
 }
 
@@ -292,6 +386,10 @@ ssize_t readv(int fd, const struct iovec *iov, int iovcnt) {
 }
 
 ssize_t recv(int sockfd, void *buf, size_t len, int flags) {
+    ssize_t rt = 0;
+    if(uring_io(sockfd, will::Poller::IO_RECV, buf, len, nullptr, flags, SO_RCVTIMEO, rt)) {
+        return rt;
+    }
     return do_io(sockfd, recv_f, "recv", will::IOManager::READ, SO_RCVTIMEO, buf, len, flags);
 }
 
@@ -304,6 +402,10 @@ ssize_t recvmsg(int sockfd, struct msghdr *msg, int flags) {
 }
 
 ssize_t write(int fd, const void *buf, size_t count) {
+    ssize_t rt = 0;
+    if(uring_io(fd, will::Poller::IO_SEND, (void*)buf, count, nullptr, 0, SO_SNDTIMEO, rt)) {
+        return rt;
+    }
     return do_io(fd, write_f, "write", will::IOManager::WRITE, SO_SNDTIMEO, buf, count);
 }
 
@@ -312,6 +414,10 @@ ssize_t writev(int fd, const struct iovec *iov, int iovcnt) {
 }
 
 ssize_t send(int s, const void *msg, size_t len, int flags) {
+    ssize_t rt = 0;
+    if(uring_io(s, will::Poller::IO_SEND, (void*)msg, len, nullptr, flags, SO_SNDTIMEO, rt)) {
+        return rt;
+    }
     return do_io(s, send_f, "send", will::IOManager::WRITE, SO_SNDTIMEO, msg, len, flags);
 }
 
@@ -333,6 +439,7 @@ int close(int fd) {
         auto iom = will::IOManager::GetThis();
         if(iom) {
             iom->cancelAll(fd);
+            iom->cancelIO(fd);
         }
         will::FdMgr::GetInstance()->del(fd);
     }
@@ -1,5 +1,7 @@
 #include "servlet.h"
 #include <fnmatch.h>
+#include "../fiber.h"
+#include "../stack_profiler.h"
 
 namespace will {
 namespace http{
@@ -26,6 +28,10 @@ int32_t ServletDispatch::handle(will::http::HttpRequest::ptr request,
     auto slt = getMatchedServlet(request->getPath());
     if(slt) {
         slt->handle(request, response, session);
+        // 连接协程的栈用量高水位同时记到servlet名下，看出哪个servlet需要多大的栈
+        if(StackProfiler::IsEnabled()) {
+            Fiber::RecordStackUsage("servlet:" + slt->getName());
+        }
     }
     return 0;
 }
@@ -1,6 +1,10 @@
 #include <unistd.h>    
+#include <signal.h>
 #include <sys/epoll.h> 
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
 #include <fcntl.h>     
+#include <iterator>
 #include "iomanager.h"
 #include "log.h"
 #include "macro.h"
@@ -9,6 +13,30 @@ namespace will {
 
 static will::Logger::ptr g_logger = WILL_LOG_NAME("system");
 
+// 定向唤醒某个idle线程用的信号，调度线程平时屏蔽该信号，只在epoll_pwait期间解除屏蔽
+// SIGURG默认被忽略且很少被业务使用
+static const int s_wakeup_signal = SIGURG;
+
+static void OnWakeupSignal(int) {
+}
+
+// 安装一个空的信号处理函数，使信号能打断epoll_pwait，如果业务已经安装了处理函数则保留业务的
+static void InstallWakeupSignal() {
+    static bool s_installed = [] {
+        struct sigaction old;
+        sigaction(s_wakeup_signal, nullptr, &old);
+        if (old.sa_handler == SIG_DFL || old.sa_handler == SIG_IGN) {
+            struct sigaction sa;
+            memset(&sa, 0, sizeof(sa));
+            sa.sa_handler = OnWakeupSignal;
+            sigemptyset(&sa.sa_mask);
+            sigaction(s_wakeup_signal, &sa, nullptr);
+        }
+        return true;
+    }();
+    (void)s_installed;
+}
+
 enum EpollCtlOp {
 };
 
@@ -70,50 +98,60 @@ IOManager::FdContext::EventContext &IOManager::FdContext::getEventContext(IOMana
 
 void IOManager::FdContext::resetEventContext(EventContext &ctx) {
     ctx.scheduler = nullptr;
+    ctx.priority  = Scheduler::NORMAL;
     ctx.fiber.reset();
     ctx.cb = nullptr;
 }
 
-void IOManager::FdContext::triggerEvent(IOManager::Event event) {
+IOManager::FdContext::EventContext IOManager::FdContext::takeEvent(IOManager::Event event) {
     // 待触发的事件必须已被注册过
     WILL_ASSERT(events & event);
     // 清除该事件，表示不再关注该事件了
     // 也就是说，注册的IO事件是一次性的，如果想持续关注某个socket fd的读写事件，那么每次触发事件之后都要重新添加
     events = (Event)(events & ~event);
-    // 调度对应的协程
     EventContext &ctx = getEventContext(event);
+    EventContext ret;
+    ret.scheduler = ctx.scheduler;
+    ret.priority  = ctx.priority;
+    ret.fiber.swap(ctx.fiber);
+    ret.cb.swap(ctx.cb);
+    resetEventContext(ctx);
+    return ret;
+}
+
+void IOManager::FdContext::triggerEvent(IOManager::Event event) {
+    // 调度对应的协程
+    EventContext ctx = takeEvent(event);
     //这里的schedule实际上是把cb或是协程封装成task加入任务队列
     if (ctx.cb) {
-        ctx.scheduler->schedule(ctx.cb);
+        ctx.scheduler->schedule(std::move(ctx.cb), -1, ctx.priority);
     } else {
-        ctx.scheduler->schedule(ctx.fiber);
+        ctx.scheduler->schedule(std::move(ctx.fiber), -1, ctx.priority);
     }
-    resetEventContext(ctx);
     return;
 }
 
-IOManager::IOManager(size_t threads, bool use_caller, const std::string &name)
-    : Scheduler(threads, use_caller, name) {
+IOManager::IOManager(size_t threads, bool use_caller, const std::string &name, Mode mode,
+                     const ElasticConfig &elastic, const AffinityConfig &affinity, Poller::Type poller)
+    : Scheduler(threads, use_caller, name, mode, elastic, affinity)
+    , m_fdSegments(new std::atomic<FdContext *>[FD_SEGMENT_COUNT]()) {
     m_epfd = epoll_create(5000);
     WILL_ASSERT(m_epfd > 0);
-    //创建管道，赋予创建好的句柄
-    int rt = pipe(m_tickleFds);
-    WILL_ASSERT(!rt);
+    // eventfd用于tickle，计数一次就能读完，非阻塞方式，配合边缘触发
+    m_tickleFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    WILL_ASSERT(m_tickleFd >= 0);
 
-    // 关注pipe读句柄的可读事件，用于tickle协程
     epoll_event event;
     memset(&event, 0, sizeof(epoll_event));
     event.events  = EPOLLIN | EPOLLET;
-    event.data.fd = m_tickleFds[0];
+    event.data.fd = m_tickleFd;
 
-    // 非阻塞方式，配合边缘触发
-    rt = fcntl(m_tickleFds[0], F_SETFL, O_NONBLOCK);
+    int rt = epoll_ctl(m_epfd, EPOLL_CTL_ADD, m_tickleFd, &event);
     WILL_ASSERT(!rt);
 
-    rt = epoll_ctl(m_epfd, EPOLL_CTL_ADD, m_tickleFds[0], &event);
-    WILL_ASSERT(!rt);
+    InstallWakeupSignal();
 
-    contextResize(32);
+    m_poller = Poller::Create(poller, m_epfd);
 
     start();
 }
@@ -121,39 +159,44 @@ IOManager::IOManager(size_t threads, bool use_caller, const std::string &name)
 IOManager::~IOManager() {
     stop();
     close(m_epfd);
-    close(m_tickleFds[0]);
-    close(m_tickleFds[1]);
+    close(m_tickleFd);
 
-    for (size_t i = 0; i < m_fdContexts.size(); ++i) {
-        if (m_fdContexts[i]) {
-            delete m_fdContexts[i];
-        }
+    for (int i = 0; i < FD_SEGMENT_COUNT; ++i) {
+        delete[] m_fdSegments[i].load(std::memory_order_relaxed);
     }
 }
 
-void IOManager::contextResize(size_t size) {
-    m_fdContexts.resize(size);
-
-    for (size_t i = 0; i < m_fdContexts.size(); ++i) {
-        if (!m_fdContexts[i]) {
-            m_fdContexts[i]     = new FdContext;
-            m_fdContexts[i]->fd = i;
+IOManager::FdContext *IOManager::getFdContext(int fd, bool auto_create) {
+    if (WILL_UNLIKELY(fd < 0 || fd >= FD_SEGMENT_SIZE * FD_SEGMENT_COUNT)) {
+        return nullptr;
+    }
+    std::atomic<FdContext *> &slot = m_fdSegments[fd / FD_SEGMENT_SIZE];
+    FdContext *segment = slot.load(std::memory_order_acquire);
+    if (WILL_UNLIKELY(!segment)) {
+        if (!auto_create) {
+            return nullptr;
+        }
+        // 多个线程同时创建同一段时只有一个能装进表里，其他的删掉自己创建的，改用装进去的那一段
+        FdContext *created = new FdContext[FD_SEGMENT_SIZE];
+        for (int i = 0; i < FD_SEGMENT_SIZE; ++i) {
+            created[i].fd = fd / FD_SEGMENT_SIZE * FD_SEGMENT_SIZE + i;
+        }
+        if (slot.compare_exchange_strong(segment, created, std::memory_order_acq_rel)) {
+            segment = created;
+        } else {
+            delete[] created;
         }
     }
+    return &segment[fd % FD_SEGMENT_SIZE];
 }
 
 int IOManager::addEvent(int fd, Event event, std::function<void()> cb) {
     // 找到fd对应的FdContext，如果不存在，那就分配一个
-    FdContext *fd_ctx = nullptr;
-    RWMutexType::ReadLock lock(m_mutex);
-    if ((int)m_fdContexts.size() > fd) {
-        fd_ctx = m_fdContexts[fd];
-        lock.unlock();
-    } else {
-        lock.unlock();
-        RWMutexType::WriteLock lock2(m_mutex);
-        contextResize(fd * 1.5);
-        fd_ctx = m_fdContexts[fd];
+    FdContext *fd_ctx = getFdContext(fd, true);
+    if (WILL_UNLIKELY(!fd_ctx)) {
+        WILL_LOG_ERROR(g_logger) << "addEvent fd=" << fd << " out of range";
+        errno = EBADF;
+        return -1;
     }
 
     // 同一个fd不允许重复添加相同的事件
@@ -165,23 +208,37 @@ int IOManager::addEvent(int fd, Event event, std::function<void()> cb) {
         WILL_ASSERT(!(fd_ctx->events & event));
     }
 
-    // 将新的事件加入epoll_wait，使用epoll_event的私有指针存储FdContext的位置
-    int op = fd_ctx->events ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
-    epoll_event epevent;
-    epevent.events   = EPOLLET | fd_ctx->events | event;
-    epevent.data.ptr = fd_ctx;
+    // 常驻注册时，上次等待之后已经来过的就绪边沿不会再通知，不用等待，直接调度
+    bool ready_now = false;
+    if (fd_ctx->registered || m_persistentEvents) {
+        ready_now     = fd_ctx->ready & event;
+        fd_ctx->ready = (Event)(fd_ctx->ready & ~event);
+    }
 
-    int rt = epoll_ctl(m_epfd, op, fd, &epevent);
-    if (rt) {
-        WILL_LOG_ERROR(g_logger) << "epoll_ctl(" << m_epfd << ", "
-                                  << (EpollCtlOp)op << ", " << fd << ", " << (EPOLL_EVENTS)epevent.events << "):"
-                                  << rt << " (" << errno << ") (" << strerror(errno) << ") fd_ctx->events="
-                                  << (EPOLL_EVENTS)fd_ctx->events;
-        return -1;
+    // 将新的事件加入epoll_wait，使用epoll_event的私有指针存储FdContext的位置
+    // 常驻注册只在第一次等待时加入epoll，同时关注读写，之后直到cancelAll都不再修改
+    if (!fd_ctx->registered) {
+        int op = fd_ctx->events ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+        epoll_event epevent;
+        epevent.events   = EPOLLET | (m_persistentEvents ? (EPOLLIN | EPOLLOUT) : (fd_ctx->events | event));
+        epevent.data.ptr = fd_ctx;
+
+        countIo(m_epollCtls);
+        int rt = epoll_ctl(m_epfd, op, fd, &epevent);
+        if (rt) {
+            WILL_LOG_ERROR(g_logger) << "epoll_ctl(" << m_epfd << ", "
+                                      << (EpollCtlOp)op << ", " << fd << ", " << (EPOLL_EVENTS)epevent.events << "):"
+                                      << rt << " (" << errno << ") (" << strerror(errno) << ") fd_ctx->events="
+                                      << (EPOLL_EVENTS)fd_ctx->events;
+            return -1;
+        }
+        fd_ctx->registered = m_persistentEvents;
     }
 
     // 待执行IO事件数加1
-    ++m_pendingEventCount;
+    if (!ready_now) {
+        ++m_pendingEventCount;
+    }
 
     // 找到这个fd的event事件对应的EventContext，对其中的scheduler, cb, fiber进行赋值
     fd_ctx->events                     = (Event)(fd_ctx->events | event);
@@ -190,23 +247,26 @@ int IOManager::addEvent(int fd, Event event, std::function<void()> cb) {
 
     // 赋值scheduler和回调函数，如果回调函数为空，则把当前协程当成回调执行体
     event_ctx.scheduler = Scheduler::GetThis();
+    event_ctx.priority  = Scheduler::GetCurrentPriority();
     if (cb) {
         event_ctx.cb.swap(cb);
     } else {
         event_ctx.fiber = Fiber::GetThis();
         WILL_ASSERT2(event_ctx.fiber->getState() == Fiber::RUNNING, "state=" << event_ctx.fiber->getState());
     }
+    if (ready_now) {
+        // 就绪可能是过时的，调用方重试IO时如果还是EAGAIN，会再次注册并真正等待
+        fd_ctx->triggerEvent(event);
+    }
     return 0;
 }
 
 bool IOManager::delEvent(int fd, Event event) {
     // 找到fd对应的FdContext
-    RWMutexType::ReadLock lock(m_mutex);
-    if ((int)m_fdContexts.size() <= fd) {
+    FdContext *fd_ctx = getFdContext(fd, false);
+    if (!fd_ctx) {
         return false;
     }
-    FdContext *fd_ctx = m_fdContexts[fd];
-    lock.unlock();
 
     FdContext::MutexType::Lock lock2(fd_ctx->mutex);
     if (WILL_UNLIKELY(!(fd_ctx->events & event))) {
@@ -214,18 +274,22 @@ bool IOManager::delEvent(int fd, Event event) {
     }
 
     // 清除指定的事件，表示不关心这个事件了，如果清除之后结果为0，则从epoll_wait中删除该文件描述符
+    // 常驻注册的fd不修改epoll，只清除等待者
     Event new_events = (Event)(fd_ctx->events & ~event);
-    int op           = new_events ? EPOLL_CTL_MOD : EPOLL_CTL_DEL;
-    epoll_event epevent;
-    epevent.events   = EPOLLET | new_events;
-    epevent.data.ptr = fd_ctx;
-
-    int rt = epoll_ctl(m_epfd, op, fd, &epevent);
-    if (rt) {
-        WILL_LOG_ERROR(g_logger) << "epoll_ctl(" << m_epfd << ", "
-                                  << (EpollCtlOp)op << ", " << fd << ", " << (EPOLL_EVENTS)epevent.events << "):"
-                                  << rt << " (" << errno << ") (" << strerror(errno) << ")";
-        return false;
+    if (!fd_ctx->registered) {
+        int op           = new_events ? EPOLL_CTL_MOD : EPOLL_CTL_DEL;
+        epoll_event epevent;
+        epevent.events   = EPOLLET | new_events;
+        epevent.data.ptr = fd_ctx;
+
+        countIo(m_epollCtls);
+        int rt = epoll_ctl(m_epfd, op, fd, &epevent);
+        if (rt) {
+            WILL_LOG_ERROR(g_logger) << "epoll_ctl(" << m_epfd << ", "
+                                      << (EpollCtlOp)op << ", " << fd << ", " << (EPOLL_EVENTS)epevent.events << "):"
+                                      << rt << " (" << errno << ") (" << strerror(errno) << ")";
+            return false;
+        }
     }
 
     // 待执行事件数减1
@@ -239,12 +303,10 @@ bool IOManager::delEvent(int fd, Event event) {
 
 bool IOManager::cancelEvent(int fd, Event event) {
     // 找到fd对应的FdContext
-    RWMutexType::ReadLock lock(m_mutex);
-    if ((int)m_fdContexts.size() <= fd) {
+    FdContext *fd_ctx = getFdContext(fd, false);
+    if (!fd_ctx) {
         return false;
     }
-    FdContext *fd_ctx = m_fdContexts[fd];
-    lock.unlock();
 
     FdContext::MutexType::Lock lock2(fd_ctx->mutex);
     if (WILL_UNLIKELY(!(fd_ctx->events & event))) {
@@ -252,18 +314,22 @@ bool IOManager::cancelEvent(int fd, Event event) {
     }
 
     // 删除事件
+    // 常驻注册的fd不修改epoll，只清除等待者
     Event new_events = (Event)(fd_ctx->events & ~event);
-    int op           = new_events ? EPOLL_CTL_MOD : EPOLL_CTL_DEL;
-    epoll_event epevent;
-    epevent.events   = EPOLLET | new_events;
-    epevent.data.ptr = fd_ctx;
-
-    int rt = epoll_ctl(m_epfd, op, fd, &epevent);
-    if (rt) {
-        WILL_LOG_ERROR(g_logger) << "epoll_ctl(" << m_epfd << ", "
-                                  << (EpollCtlOp)op << ", " << fd << ", " << (EPOLL_EVENTS)epevent.events << "):"
-                                  << rt << " (" << errno << ") (" << strerror(errno) << ")";
-        return false;
+    if (!fd_ctx->registered) {
+        int op           = new_events ? EPOLL_CTL_MOD : EPOLL_CTL_DEL;
+        epoll_event epevent;
+        epevent.events   = EPOLLET | new_events;
+        epevent.data.ptr = fd_ctx;
+
+        countIo(m_epollCtls);
+        int rt = epoll_ctl(m_epfd, op, fd, &epevent);
+        if (rt) {
+            WILL_LOG_ERROR(g_logger) << "epoll_ctl(" << m_epfd << ", "
+                                      << (EpollCtlOp)op << ", " << fd << ", " << (EPOLL_EVENTS)epevent.events << "):"
+                                      << rt << " (" << errno << ") (" << strerror(errno) << ")";
+            return false;
+        }
     }
 
     // 删除之前触发一次事件
@@ -275,31 +341,34 @@ bool IOManager::cancelEvent(int fd, Event event) {
 
 bool IOManager::cancelAll(int fd) {
     // 找到fd对应的FdContext
-    RWMutexType::ReadLock lock(m_mutex);
-    if ((int)m_fdContexts.size() <= fd) {
+    FdContext *fd_ctx = getFdContext(fd, false);
+    if (!fd_ctx) {
         return false;
     }
-    FdContext *fd_ctx = m_fdContexts[fd];
-    lock.unlock();
 
     FdContext::MutexType::Lock lock2(fd_ctx->mutex);
-    if (!fd_ctx->events) {
+    if (!fd_ctx->events && !fd_ctx->registered) {
         return false;
     }
 
-    // 删除全部事件
+    // 删除全部事件，常驻注册的fd在这里从epoll中删除
     int op = EPOLL_CTL_DEL;
     epoll_event epevent;
     epevent.events   = 0;
     epevent.data.ptr = fd_ctx;
 
+    countIo(m_epollCtls);
     int rt = epoll_ctl(m_epfd, op, fd, &epevent);
-    if (rt) {
+    // 旧fd绕过hook直接关闭时epoll已经自动删掉了它，这个fd号也可能已经被新fd复用，返回ENOENT或EBADF
+    // 这时照样清除注册状态并唤醒等待者，否则复用这个fd号的新fd在addEvent里会跳过epoll_ctl，永远等不到事件
+    if (rt && errno != ENOENT && errno != EBADF) {
         WILL_LOG_ERROR(g_logger) << "epoll_ctl(" << m_epfd << ", "
                                   << (EpollCtlOp)op << ", " << fd << ", " << (EPOLL_EVENTS)epevent.events << "):"
                                   << rt << " (" << errno << ") (" << strerror(errno) << ")";
         return false;
     }
+    fd_ctx->registered = false;
+    fd_ctx->ready      = NONE;
 
     // 触发全部已注册的事件
     if (fd_ctx->events & READ) {
@@ -315,6 +384,46 @@ bool IOManager::cancelAll(int fd) {
     return true;
 }
 
+bool IOManager::submitIO(Poller::IoRequest &req) {
+    // 请求和IO缓冲区通常在协程栈上，内核和reap完成的idle线程都会按地址写入
+    // 共享栈协程切出后这块地址属于别的协程，只能走等待就绪的流程
+    if (Fiber::GetThis()->isSharedStack()) {
+        return false;
+    }
+    req.fiber     = Fiber::GetThis();
+    req.scheduler = Scheduler::GetThis();
+    req.priority  = Scheduler::GetCurrentPriority();
+    if (!m_poller->submit(&req)) {
+        req.fiber.reset();
+        return false;
+    }
+    ++m_pendingEventCount;
+    countIo(m_submits);
+    // 当前线程马上就会进入idle时，SQE由idle下一次等待时和其他协程的SQE一起提交
+    // 还有任务要执行时立即提交，否则IO要等这些任务都执行完才发给内核
+    if (hasReadyTasks()) {
+        m_poller->flush();
+    }
+    // 完成后idle把当前协程放回调度队列
+    Fiber *fiber = req.fiber.get();
+    fiber->yield();
+    return true;
+}
+
+void IOManager::cancelIO(int fd) {
+    m_poller->cancel(fd);
+}
+
+IOManager::IoStats IOManager::getIoStats() const {
+    IoStats stats;
+    stats.waits   = m_poller->getSyscalls();
+    stats.ctls    = m_epollCtls.load(std::memory_order_relaxed);
+    stats.ios     = m_ioSyscalls.load(std::memory_order_relaxed);
+    stats.tickles = m_tickleCalls.load(std::memory_order_relaxed);
+    stats.submits = m_submits.load(std::memory_order_relaxed);
+    return stats;
+}
+
 IOManager *IOManager::GetThis() {
     return dynamic_cast<IOManager *>(Scheduler::GetThis());
 }
@@ -323,13 +432,45 @@ IOManager *IOManager::GetThis() {
 // 通知调度协程、也就是Scheduler::run()从idle中退出
 // Scheduler::run()每次从idle协程中退出之后，都会重新把任务队列里的所有任务执行完了再重新进入idle
 // 如果没有调度线程处理于idle状态，那也就没必要发通知了
+// 上一次通知还没被idle线程取走时也不再发，连续多次schedule最多只写一次eventfd
 void IOManager::tickle() {
     WILL_LOG_DEBUG(g_logger) << "tickle";
-    if(!hasIdleThreads()) {
+    // idle线程批量调度就绪的协程时自己也算空闲线程，但它马上就会回到调度循环，不用通知自己
+    if(!hasOtherIdleThreads()) {
+        // 调度线程自己投递的任务它回到调度循环就能看到，不用通知
+        // use_caller的主线程在run()之外时不会再检查队列，和外部线程一样处理
+        if (isWorkerThread()) {
+            return;
+        }
+        // 外部线程投递时所有调度线程可能正在进入idle的途中，先留下记录再确认一次空闲线程数
+        // 与idle中先增加空闲线程数、再检查记录配对，两边至少有一边能看到对方
+        m_missedTickle.store(true);
+        if(!hasIdleThreads()) {
+            return;
+        }
+    }
+    if (m_tickled.exchange(true)) {
         return;
     }
-    int rt = write(m_tickleFds[1], "T", 1);
-    WILL_ASSERT(rt == 1);
+    countIo(m_tickleCalls);
+    uint64_t one = 1;
+    int rt = write(m_tickleFd, &one, sizeof(one));
+    WILL_ASSERT(rt == sizeof(one));
+    countTickleSent();
+}
+
+// 只唤醒信箱里有新任务的线程，信号在该线程屏蔽期间会保持pending，下一次epoll_pwait会立即返回，不会丢失
+void IOManager::tickleThread(int thread) {
+    WILL_LOG_DEBUG(g_logger) << "tickle thread=" << thread;
+    countIo(m_tickleCalls);
+    int rt = syscall(SYS_tgkill, getpid(), thread, s_wakeup_signal);
+    if (rt) {
+        WILL_LOG_ERROR(g_logger) << "tgkill(" << thread << ") fail errno=" << errno
+                                 << " errstr=" << strerror(errno);
+        tickle();
+        return;
+    }
+    countTickleSent();
 }
 
 bool IOManager::stopping() {
@@ -357,17 +498,39 @@ void IOManager::idle() {
         delete[] ptr;
     });
 
+    // 平时屏蔽定向唤醒信号，只在epoll_pwait期间解除屏蔽，保证信号要么打断epoll_pwait，要么保持pending到下一次epoll_pwait
+    sigset_t wakeup_set;
+    sigemptyset(&wakeup_set);
+    sigaddset(&wakeup_set, s_wakeup_signal);
+    sigset_t old_mask;
+    pthread_sigmask(SIG_BLOCK, &wakeup_set, &old_mask);
+    sigset_t wait_mask = old_mask;
+    sigdelset(&wait_mask, s_wakeup_signal);
+
+    // 直接提交的IO操作中本轮完成的请求
+    std::vector<Poller::IoRequest *> completed;
+
     while (true) {
         // 获取下一个定时器的超时时间，顺便判断调度器是否停止
         uint64_t next_timeout = 0;
         if( WILL_UNLIKELY(stopping(next_timeout))) {
             WILL_LOG_DEBUG(g_logger) << "name=" << getName() << "idle stopping exit";
+            // stop()的多次tickle只会写一次eventfd，退出前把唤醒传给下一个还阻塞着的线程
+            tickle();
+            break;
+        }
+
+        // 弹性线程池中空闲太久的线程退出线程池
+        if (retireIdleThread()) {
+            WILL_LOG_DEBUG(g_logger) << "name=" << getName() << " idle retire exit";
             break;
         }
 
         // 阻塞在epoll_wait上，等待事件发生或定时器超时
         int rt = 0;
-        do{
+        // 信箱里已经有任务时不阻塞，信号可能在本协程屏蔽信号之前就已经被调度协程消耗掉了
+        // 外部线程投递任务时如果赶上没有空闲线程，也不阻塞，回到调度协程检查一次任务队列
+        if (!hasMailboxTask() && !(m_missedTickle.load() && m_missedTickle.exchange(false))) {
             // 默认超时时间5秒，如果下一个定时器的超时时间大于5秒，仍以5秒来计算超时，避免定时器超时时间太大时，epoll_wait一直阻塞
             static const int MAX_TIMEOUT = 5000;
             if(next_timeout != ~0ull) {
@@ -375,31 +538,52 @@ void IOManager::idle() {
             } else {
                 next_timeout = MAX_TIMEOUT;
             }
-            rt = epoll_wait(m_epfd, events, MAX_EVNETS, (int)next_timeout);
+            // 弹性线程池需要按时醒来检查是否空闲太久
+            uint64_t idle_timeout = getIdleTimeout();
+            if (idle_timeout && next_timeout > idle_timeout) {
+                next_timeout = idle_timeout;
+            }
+            rt = m_poller->wait(events, MAX_EVNETS, (int)next_timeout, &wait_mask, completed);
             if(rt < 0 && errno == EINTR) {
-                continue;
-            } else {
-                break;
+                // 被定向唤醒，回到调度协程检查信箱
+                countTickleReceived();
+                rt = 0;
             }
-        } while(true);
+        }
 
-        // 收集所有已超时的定时器，执行回调函数
+        // 收集所有已超时的定时器，一次性加入调度
         std::vector<std::function<void()>> cbs;
         listExpiredCb(cbs);
         if(!cbs.empty()) {
-            for(const auto &cb : cbs) {
-                schedule(cb);
-            }
+            scheduleBatch(std::make_move_iterator(cbs.begin()), std::make_move_iterator(cbs.end()));
             cbs.clear();
         }
-        
+
+        // 本轮就绪的事件中由本调度器执行的协程和回调函数，按优先级分组，处理完所有事件后批量加入调度
+        std::vector<Fiber::ptr> ready_fibers[PRIORITY_COUNT];
+        std::vector<std::function<void()>> ready_cbs[PRIORITY_COUNT];
+
+        // 直接提交的IO操作完成后，等待的协程和就绪事件一起批量调度
+        for (auto req : completed) {
+            FdContext::EventContext ctx;
+            ctx.scheduler = req->scheduler;
+            ctx.priority  = req->priority;
+            ctx.fiber.swap(req->fiber);
+            collectEvent(std::move(ctx), ready_fibers, ready_cbs);
+            --m_pendingEventCount;
+        }
+        completed.clear();
+
         // 遍历所有发生的事件，根据epoll_event的私有指针找到对应的FdContext，进行事件处理
         for (int i = 0; i < rt; ++i) {
             epoll_event &event = events[i];
-            if (event.data.fd == m_tickleFds[0]) {
-                // ticklefd[0]用于通知协程调度，这时只需要把管道里的内容读完即可
-                uint8_t dummy[256];
-                while (read(m_tickleFds[0], dummy, sizeof(dummy)) > 0);
+            if (event.data.fd == m_tickleFd) {
+                // 一次read就能清空eventfd的计数，清空之后才清除标记，之后的tickle会重新写eventfd
+                uint64_t dummy;
+                countIo(m_tickleCalls);
+                read(m_tickleFd, &dummy, sizeof(dummy));
+                m_tickled.store(false);
+                countTickleReceived();
                 continue;
             }
 
@@ -411,6 +595,28 @@ void IOManager::idle() {
             //因此要为fd加锁
             FdContext::MutexType::Lock lock(fd_ctx->mutex);
             
+            // 常驻注册的fd不修改epoll，有等待者的事件直接调度，没有等待者的记在ready里留给下一次addEvent
+            if (fd_ctx->registered) {
+                int real_events = NONE;
+                if (event.events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+                    real_events |= READ;
+                }
+                if (event.events & (EPOLLOUT | EPOLLERR | EPOLLHUP)) {
+                    real_events |= WRITE;
+                }
+                int waiting   = fd_ctx->events & real_events;
+                fd_ctx->ready = (Event)(fd_ctx->ready | (real_events & ~waiting));
+                if (waiting & READ) {
+                    collectEvent(fd_ctx->takeEvent(READ), ready_fibers, ready_cbs);
+                    --m_pendingEventCount;
+                }
+                if (waiting & WRITE) {
+                    collectEvent(fd_ctx->takeEvent(WRITE), ready_fibers, ready_cbs);
+                    --m_pendingEventCount;
+                }
+                continue;
+            }
+
             // 出错，比如写读端已经关闭的pipe
             // EPOLLHUP: 套接字对端关闭
             // 出现这两种事件，应该同时触发fd的读和写事件，否则有可能出现注册的事件永远执行不到的情况 
@@ -434,6 +640,7 @@ void IOManager::idle() {
             int op          = left_events ? EPOLL_CTL_MOD : EPOLL_CTL_DEL;
             event.events    = EPOLLET | left_events;
 
+            countIo(m_epollCtls);
             int rt2 = epoll_ctl(m_epfd, op, fd_ctx->fd, &event);
             if (rt2) {
                 WILL_LOG_ERROR(g_logger) << "epoll_ctl(" << m_epfd << ", "
@@ -443,16 +650,27 @@ void IOManager::idle() {
             }
 
             // 处理已经发生的事件，也就是让调度器调度指定的函数或协程
+            // 属于其他调度器的事件直接调度，属于本调度器的先收集起来
             if (real_events & READ) {
-                fd_ctx->triggerEvent(READ);
+                collectEvent(fd_ctx->takeEvent(READ), ready_fibers, ready_cbs);
                 --m_pendingEventCount;
             }
             if (real_events & WRITE) {
-                fd_ctx->triggerEvent(WRITE);
+                collectEvent(fd_ctx->takeEvent(WRITE), ready_fibers, ready_cbs);
                 --m_pendingEventCount;
             }
         } // end for
 
+        // 一次epoll_wait最多返回256个事件，批量调度只需加两次锁
+        for (int i = 0; i < PRIORITY_COUNT; ++i) {
+            scheduleBatch(std::make_move_iterator(ready_fibers[i].begin()),
+                          std::make_move_iterator(ready_fibers[i].end()), -1, (Priority)i);
+            scheduleBatch(std::make_move_iterator(ready_cbs[i].begin()),
+                          std::make_move_iterator(ready_cbs[i].end()), -1, (Priority)i);
+            ready_fibers[i].clear();
+            ready_cbs[i].clear();
+        }
+
         // 一旦处理完所有的事件，idle协程yield，这样可以让调度协程(Scheduler::run)重新检查是否有新任务要调度
         // 上面triggerEvent实际也只是把对应的fiber重新加入调度，要执行的话还要等idle协程退出 
         Fiber::ptr cur = Fiber::GetThis();
@@ -461,6 +679,23 @@ void IOManager::idle() {
 
         raw_ptr->yield();
     } // end while(true)
+
+    pthread_sigmask(SIG_SETMASK, &old_mask, nullptr);
+}
+
+void IOManager::collectEvent(FdContext::EventContext ctx, std::vector<Fiber::ptr> *fibers,
+                             std::vector<std::function<void()>> *cbs) {
+    if (ctx.scheduler != this) {
+        if (ctx.cb) {
+            ctx.scheduler->schedule(std::move(ctx.cb), -1, ctx.priority);
+        } else {
+            ctx.scheduler->schedule(std::move(ctx.fiber), -1, ctx.priority);
+        }
+    } else if (ctx.cb) {
+        cbs[ctx.priority].push_back(std::move(ctx.cb));
+    } else {
+        fibers[ctx.priority].push_back(std::move(ctx.fiber));
+    }
 }
 
 void IOManager::onTimerInsertedAtFront() {
@@ -1,6 +1,7 @@
 #ifndef __WILL_IOMANAGER_H__
 #define __WILL_IOMANAGER_H__
 
+#include "poller.h"
 #include "scheduler.h"
 #include "timer.h"
 
@@ -23,6 +24,12 @@ public:
     };
 
 private:
+    // FdContext表每段的大小和段数，能容纳的最大fd为FD_SEGMENT_SIZE * FD_SEGMENT_COUNT - 1
+    // 默认的fs.nr_open为1048576，这里留了4倍的余量，段指针表只占32KB，在堆上分配，IOManager可以放在协程栈上
+    enum {
+        FD_SEGMENT_SIZE  = 1024,
+        FD_SEGMENT_COUNT = 4096
+    };
     
     // socket fd上下文类
     // 每个socket fd都对应一个FdContext，包括fd的值，fd上的事件，以及fd的读写事件上下文
@@ -35,6 +42,8 @@ private:
         struct EventContext {
             // 执行事件回调的调度器
             Scheduler *scheduler = nullptr;
+            // 事件触发后重新调度时使用的优先级，沿用注册事件时所在任务的优先级
+            Scheduler::Priority priority = Scheduler::NORMAL;
             // 事件回调协程
             Fiber::ptr fiber;
             // 事件回调函数
@@ -46,6 +55,9 @@ private:
 
         void resetEventContext(EventContext &ctx);
 
+        // 清除事件，并取出对应的事件上下文交给调用者调度，用于批量调度
+        EventContext takeEvent(Event event);
+
         // 根据事件类型调用对应上下文结构中的调度器去调度回调协程或回调函数
         void triggerEvent(Event event);
 
@@ -57,15 +69,42 @@ private:
         int fd = 0;
         // 该fd添加了哪些事件的回调函数，或者说该fd关心哪些事件
         Event events = NONE;
+        // 是否以常驻方式加入了epoll，见IOManager::setPersistentEvents
+        bool registered = false;
+        // 常驻注册时，已经来过就绪边沿、但当时没有等待者的事件
+        Event ready = NONE;
         // 事件的Mutex
         MutexType mutex;
     };
 
 public:
     
+    // IO相关系统调用的统计，用来比较不同后端、不同注册方式下每个请求的系统调用次数
+    // 统计随Scheduler的统计开关一起开启或关闭
+    struct IoStats {
+        // 等待IO的系统调用：epoll_pwait、epoll_wait、io_uring_enter
+        uint64_t waits = 0;
+        // epoll_ctl的调用次数
+        uint64_t ctls = 0;
+        // hook里直接发出的IO系统调用：read、write、accept、connect等
+        uint64_t ios = 0;
+        // tickle相关的系统调用：写、读eventfd和tgkill
+        uint64_t tickles = 0;
+        // 直接提交给io_uring的IO操作数
+        uint64_t submits = 0;
+
+        uint64_t syscalls() const { return waits + ctls + ios + tickles; }
+    };
+
     // 线程数量
     // use_caller 是否将调用线程包含进去
-    IOManager(size_t threads = 1, bool use_caller = true, const std::string &name = "IOManager");
+    // mode 调度模式，参考Scheduler::Mode
+    // elastic 弹性线程池配置，参考Scheduler::ElasticConfig
+    // affinity 工作线程的CPU绑定配置，参考Scheduler::AffinityConfig
+    // poller 等待IO的后端，参考Poller::Type，io_uring不可用时退回epoll
+    IOManager(size_t threads = 1, bool use_caller = true, const std::string &name = "IOManager",
+              Mode mode = LIST, const ElasticConfig &elastic = ElasticConfig(),
+              const AffinityConfig &affinity = AffinityConfig(), Poller::Type poller = Poller::EPOLL);
 
     ~IOManager();
 
@@ -95,13 +134,42 @@ public:
     // 是否删除成功
     bool cancelAll(int fd);
 
+    // 常驻注册模式，默认关闭
+    // 关闭时每次addEvent都要epoll_ctl加入事件，事件触发后idle再epoll_ctl把它删掉，每次等待两次epoll_ctl
+    // 开启后fd在第一次等待时以EPOLLIN|EPOLLOUT|EPOLLET加入epoll，直到cancelAll才删除，中间的等待不再调用epoll_ctl
+    // 没有等待者时到来的就绪记在FdContext里，下一次addEvent直接触发，调用方重试IO
+    // 开启后关闭fd之前应该调用cancelAll(hook的close会调用)，否则fd被复用时会被当成已经注册过
+    // 绕过hook关闭的fd，hook的socket和accept拿到复用这个fd号的新fd时会用cancelAll清掉遗留的注册
+    // 只影响之后新加入epoll的fd
+    void setPersistentEvents(bool v) { m_persistentEvents = v; }
+    bool isPersistentEvents() const { return m_persistentEvents; }
+
+    // 实际使用的后端
+    Poller::Type getPollerType() const { return m_poller->getType(); }
+
+    // 后端支持时直接提交IO操作并挂起当前协程，完成后结果在req.result里，返回true
+    // 后端不支持直接提交时返回false，调用方改用addEvent等待就绪
+    // 共享栈协程也返回false，req和IO缓冲区在完成之前必须一直可以按原地址访问
+    bool submitIO(Poller::IoRequest &req);
+
+    // 取消fd上所有直接提交、还没有完成的IO操作，关闭fd之前调用
+    void cancelIO(int fd);
+
+    IoStats getIoStats() const;
+
+    // hook里直接发出一次IO系统调用时调用
+    void countIoSyscall() { countIo(m_ioSyscalls); }
+
     static IOManager *GetThis();
 
 protected:
     
-    // 写pipe让idle协程从epoll_wait退出，待idle协程yield之后Scheduler::run就可以调度其他任务
+    // 写eventfd让idle协程从epoll_wait退出，待idle协程yield之后Scheduler::run就可以调度其他任务
     void tickle() override;
 
+    // 向指定线程发送唤醒信号，让它从epoll_pwait中返回，其他idle线程不受影响
+    void tickleThread(int thread) override;
+
     // 判断条件是Scheduler::stopping()外加IOManager的m_pendingEventCount为0，表示没有IO事件可调度了
     bool stopping() override;
 
@@ -115,21 +183,44 @@ protected:
     // 当有定时器插入到头部时，要重新更新epoll_wait的超时时间，这里是唤醒idle协程以便于使用新的超时时间
     void onTimerInsertedAtFront() override;
 
-    // 重置socket句柄上下文的容器大小
-    // size 容量大小
-    void contextResize(size_t size);
+    // 收集idle中就绪的事件，属于本调度器的按优先级放入fibers或cbs等待批量调度，属于其他调度器的直接调度
+    // fibers cbs 长度为PRIORITY_COUNT的数组，下标为优先级
+    void collectEvent(FdContext::EventContext ctx, std::vector<Fiber::ptr> *fibers,
+                      std::vector<std::function<void()>> *cbs);
+
+    // 按fd找到FdContext，读取不加锁
+    // auto_create fd所在的段还没有创建时是否创建，不创建时返回nullptr，fd超出范围也返回nullptr
+    FdContext *getFdContext(int fd, bool auto_create);
+
+    void countIo(std::atomic<uint64_t> &counter) {
+        if (isStatsEnabled()) {
+            counter.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
 
 private:
     // epoll 文件句柄
     int m_epfd = 0;
-    // pipe 文件句柄，fd[0]读端，fd[1]写端
-    int m_tickleFds[2];
+    // tickle用的eventfd
+    int m_tickleFd = -1;
+    // eventfd已经写过、还没被idle线程读走
+    std::atomic<bool> m_tickled = {false};
+    // 外部线程tickle时没有空闲线程，idle阻塞前需要再检查一次任务队列
+    std::atomic<bool> m_missedTickle = {false};
     // 当前等待执行的IO事件数量
     std::atomic<size_t> m_pendingEventCount = {0};
-    // IOManager的Mutex
-    RWMutexType m_mutex;
-    // socket事件上下文的容器
-    std::vector<FdContext *> m_fdContexts;
+    // socket事件上下文的表，按fd分段，每段FD_SEGMENT_SIZE个，第一次用到时创建
+    // 段创建之后直到IOManager析构都不会移动或释放，查找不需要加锁，FdContext的地址可以一直保存在epoll_event里
+    std::unique_ptr<std::atomic<FdContext *>[]> m_fdSegments;
+    // 等待IO的后端
+    Poller::ptr m_poller;
+    // 是否使用常驻注册
+    std::atomic<bool> m_persistentEvents = {false};
+    // IoStats中不由后端统计的部分
+    std::atomic<uint64_t> m_epollCtls   = {0};
+    std::atomic<uint64_t> m_ioSyscalls  = {0};
+    std::atomic<uint64_t> m_tickleCalls = {0};
+    std::atomic<uint64_t> m_submits     = {0};
 };
 
 } // end namespace will
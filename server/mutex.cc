@@ -1,3 +1,5 @@
+#include <errno.h>
+#include <time.h>
 #include "mutex.h"
 
 namespace will {
@@ -18,6 +20,24 @@ void Semaphore::wait() {
     }
 }
 
+bool Semaphore::waitFor(uint64_t timeout_ms) {
+    // sem_timedwait只接受CLOCK_REALTIME的绝对时间
+    timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    uint64_t nsec = ts.tv_nsec + timeout_ms % 1000 * 1000000ull;
+    ts.tv_sec += timeout_ms / 1000 + nsec / 1000000000ull;
+    ts.tv_nsec = nsec % 1000000000ull;
+    while(sem_timedwait(&m_semaphore, &ts)) {
+        if(errno == ETIMEDOUT) {
+            return false;
+        }
+        if(errno != EINTR) {
+            throw std::logic_error("sem_timedwait error");
+        }
+    }
+    return true;
+}
+
 void Semaphore::notify() {
     if(sem_post(&m_semaphore)) {
         throw std::logic_error("sem_post error");
@@ -23,6 +23,9 @@ public:
 
     void wait();
 
+    // 最多等待timeout_ms毫秒，超时返回false
+    bool waitFor(uint64_t timeout_ms);
+
     void notify();
 private:
     sem_t m_semaphore;
@@ -0,0 +1,179 @@
+#ifndef __WILL_PARALLEL_H__
+#define __WILL_PARALLEL_H__
+
+#include <stdint.h>
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <vector>
+#include "fiber_sync.h"
+#include "scheduler.h"
+
+namespace will {
+
+// 在Scheduler的工作线程上并行执行CPU密集的计算，比如在servlet里压缩或聚合大块数据
+// 区间按grain切成若干块，最多投递线程数个任务，每个任务从共享的计数器上领取下一块，块的耗时不均匀时自动均衡
+// 调用方在WaitGroup上等待，在协程里调用时只挂起当前协程，在普通线程里调用时阻塞线程
+// 调用方本身就是scheduler的工作线程时也参与领取，不会因为占着一个线程而少一份算力，单线程的调度器上也不会死锁
+// 任意一块抛出的异常在所有块结束后重新抛给调用方，抛出异常之后还没开始的块被跳过
+// scheduler 为nullptr时使用当前线程的调度器，都没有时在当前线程上串行执行
+// grain 每块的元素数，为0时按线程数自动切分，每个线程大约分到4块
+
+// ParallelFor的共享状态，任务可能在调用方返回之后才被调度，所以用shared_ptr持有
+template <class F>
+struct ParallelForState : Noncopyable {
+    ParallelForState(size_t b, size_t e, size_t g, size_t c, F &f)
+        : begin(b), end(e), grain(g), chunks(c), fn(f) {
+    }
+
+    // 领取并执行剩下的块，直到全部领完
+    void run() {
+        size_t idx;
+        while ((idx = next++) < chunks) {
+            if (!failed) {
+                size_t b = begin + idx * grain;
+                try {
+                    fn(idx, b, std::min(b + grain, end));
+                } catch (...) {
+                    Spinlock::Lock lock(mutex);
+                    if (!error) {
+                        error = std::current_exception();
+                    }
+                    failed = true;
+                }
+            }
+            wg.done();
+        }
+    }
+
+    size_t begin;
+    size_t end;
+    size_t grain;
+    size_t chunks;
+    // 调用方在所有块结束前不会返回，领到块的任务访问fn时它一定还活着
+    F &fn;
+    std::atomic<size_t> next = {0};
+    std::atomic<bool> failed = {false};
+    Spinlock mutex;
+    std::exception_ptr error;
+    WaitGroup wg;
+};
+
+// 返回区间的切块大小
+inline size_t ParallelGrain(Scheduler *scheduler, size_t count, size_t grain) {
+    if (grain > 0) {
+        return grain;
+    }
+    size_t parts = std::max<size_t>(scheduler ? scheduler->getThreadCount() : 1, 1) * 4;
+    return std::max<size_t>((count + parts - 1) / parts, 1);
+}
+
+// 按块并行执行fn(chunk_index, chunk_begin, chunk_end)，块下标从0开始
+template <class F>
+void ParallelForChunks(Scheduler *scheduler, size_t begin, size_t end, size_t grain, F fn) {
+    if (begin >= end) {
+        return;
+    }
+    if (!scheduler) {
+        scheduler = Scheduler::GetThis();
+    }
+    grain = ParallelGrain(scheduler, end - begin, grain);
+    size_t chunks = (end - begin + grain - 1) / grain;
+    bool in_pool = scheduler && Scheduler::GetThis() == scheduler;
+    if (!scheduler || chunks == 1) {
+        for (size_t i = 0; i < chunks; ++i) {
+            size_t b = begin + i * grain;
+            fn(i, b, std::min(b + grain, end));
+        }
+        return;
+    }
+
+    std::shared_ptr<ParallelForState<F> > state(new ParallelForState<F>(begin, end, grain, chunks, fn));
+    state->wg.add(chunks);
+    size_t workers = std::min(chunks, std::max<size_t>(scheduler->getThreadCount(), 1));
+    if (in_pool) {
+        // 调用方占着一个工作线程，自己领取一份
+        --workers;
+    }
+    std::vector<std::function<void()> > tasks(workers, [state]() { state->run(); });
+    scheduler->scheduleBatch(std::make_move_iterator(tasks.begin()), std::make_move_iterator(tasks.end()));
+    if (in_pool) {
+        state->run();
+    }
+    state->wg.wait();
+    if (state->error) {
+        std::rethrow_exception(state->error);
+    }
+}
+
+// 并行执行fn(chunk_begin, chunk_end)
+template <class F>
+void ParallelFor(Scheduler *scheduler, size_t begin, size_t end, size_t grain, F fn) {
+    ParallelForChunks(scheduler, begin, end, grain, [&fn](size_t, size_t b, size_t e) {
+        fn(b, e);
+    });
+}
+
+// 并行归约，每块用map(chunk_begin, chunk_end)求出部分结果，再按块的顺序用reduce(a, b)合并
+// 合并顺序固定，reduce满足结合律即可，不要求交换律，比如字符串拼接
+// identity 归约的初始值
+template <class T, class Map, class Reduce>
+T ParallelReduce(Scheduler *scheduler, size_t begin, size_t end, size_t grain,
+                 T identity, Map map, Reduce reduce) {
+    if (begin >= end) {
+        return identity;
+    }
+    Scheduler *sched = scheduler ? scheduler : Scheduler::GetThis();
+    grain = ParallelGrain(sched, end - begin, grain);
+    std::vector<T> parts((end - begin + grain - 1) / grain, identity);
+    ParallelForChunks(sched, begin, end, grain, [&parts, &map](size_t idx, size_t b, size_t e) {
+        parts[idx] = map(b, e);
+    });
+    T rt = std::move(identity);
+    for (auto &i : parts) {
+        rt = reduce(std::move(rt), std::move(i));
+    }
+    return rt;
+}
+
+// 并行排序，先并行排好每一块，再逐轮两两归并，每轮内的归并并行执行
+// 最后一轮只有一次归并，是串行的，线程数较多时加速比受这一步限制
+// 和std::sort一样不稳定
+template <class RandomIt, class Compare>
+void ParallelSort(Scheduler *scheduler, RandomIt first, RandomIt last, Compare comp, size_t grain = 0) {
+    size_t count = std::distance(first, last);
+    if (count < 2) {
+        return;
+    }
+    Scheduler *sched = scheduler ? scheduler : Scheduler::GetThis();
+    grain = ParallelGrain(sched, count, grain);
+    ParallelFor(sched, 0, count, grain, [first, &comp](size_t b, size_t e) {
+        std::sort(first + b, first + e, comp);
+    });
+    for (size_t width = grain; width < count; width *= 2) {
+        size_t pairs = (count + width * 2 - 1) / (width * 2);
+        ParallelFor(sched, 0, pairs, 1, [first, &comp, width, count](size_t b, size_t e) {
+            for (size_t i = b; i < e; ++i) {
+                size_t lo = i * width * 2;
+                size_t mid = std::min(lo + width, count);
+                size_t hi = std::min(lo + width * 2, count);
+                if (mid < hi) {
+                    std::inplace_merge(first + lo, first + mid, first + hi, comp);
+                }
+            }
+        });
+    }
+}
+
+template <class RandomIt>
+void ParallelSort(Scheduler *scheduler, RandomIt first, RandomIt last) {
+    typedef typename std::iterator_traits<RandomIt>::value_type T;
+    ParallelSort(scheduler, first, last, std::less<T>());
+}
+
+} // namespace will
+
+#endif
@@ -0,0 +1,438 @@
+#include <errno.h>
+#include <poll.h>
+#include <sched.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include "poller.h"
+#include "log.h"
+#include "macro.h"
+#include "mutex.h"
+
+namespace will {
+
+static will::Logger::ptr g_logger = WILL_LOG_NAME("system");
+
+namespace {
+
+class EpollPoller : public Poller {
+public:
+    EpollPoller(int epfd)
+        : Poller(epfd) {
+    }
+
+    Type getType() const override { return EPOLL; }
+
+    int wait(epoll_event *events, int max_events, int timeout_ms, const sigset_t *sigmask,
+             std::vector<IoRequest *> &completed) override {
+        countSyscall();
+        return epoll_pwait(m_epfd, events, max_events, timeout_ms, sigmask);
+    }
+};
+
+static_assert(sizeof(__kernel_timespec) == sizeof(int64_t) + sizeof(long long), "__kernel_timespec layout");
+
+// io_uring后端，直接使用系统调用，不依赖liburing
+// 所有调度线程共用一个io_uring，提交队列和完成队列各用一把锁保护
+class UringPoller : public Poller {
+public:
+    UringPoller(int epfd, uint32_t entries);
+
+    ~UringPoller();
+
+    bool isValid() const { return m_ringFd >= 0; }
+
+    Type getType() const override { return URING; }
+
+    int wait(epoll_event *events, int max_events, int timeout_ms, const sigset_t *sigmask,
+             std::vector<IoRequest *> &completed) override;
+
+    bool submit(IoRequest *req) override;
+
+    void flush() override;
+
+    void cancel(int fd) override;
+
+private:
+    // CQE的user_data，IoRequest的地址按8字节对齐，最低位为1表示这是请求的LINK_TIMEOUT
+    enum {
+        // 不需要处理的CQE，比如取消操作自己的CQE
+        TAG_IGNORE = 0,
+        // epoll fd的POLL请求
+        TAG_EPOLL = 2
+    };
+
+    // 解除所有映射
+    void release();
+
+    // 构造时调用，检查内核是否支持按fd取消所有请求，5.19之前的内核会以EINVAL拒绝这些标志
+    // 不支持时关闭fd之后挂着的请求不会结束，协程永远不会被唤醒，只能退回epoll
+    bool probeCancelFd();
+
+    int enter(uint32_t to_submit, uint32_t min_complete, uint32_t flags, const void *arg, size_t argsz);
+
+    // 持有m_sqLock时调用，保证提交队列至少有n个空位，队列满时先把排队的SQE提交掉
+    void reserve(uint32_t n);
+
+    // 持有m_sqLock时调用，返回本地队尾之后第i个SQE
+    io_uring_sqe *sqeAt(uint32_t i);
+
+    // 持有m_sqLock时调用，把填好的n个SQE对内核可见，等待下一次io_uring_enter提交
+    void publish(uint32_t n);
+
+    // 持有m_sqLock时调用，在epoll fd上挂一个一次性的POLL请求
+    void armEpoll();
+
+    // 持有m_sqLock时调用，立即提交排队的SQE
+    void flushLocked();
+
+private:
+    int m_ringFd = -1;
+    void *m_sqRing = MAP_FAILED;
+    size_t m_sqRingSize = 0;
+    void *m_cqRing = MAP_FAILED;
+    size_t m_cqRingSize = 0;
+    io_uring_sqe *m_sqes = (io_uring_sqe *)MAP_FAILED;
+    size_t m_sqesSize = 0;
+
+    uint32_t *m_sqHead = nullptr;
+    uint32_t *m_sqTail = nullptr;
+    uint32_t *m_sqArray = nullptr;
+    uint32_t m_sqMask = 0;
+    uint32_t m_sqEntries = 0;
+    uint32_t *m_cqHead = nullptr;
+    uint32_t *m_cqTail = nullptr;
+    io_uring_cqe *m_cqes = nullptr;
+    uint32_t m_cqMask = 0;
+
+    Spinlock m_sqLock;
+    // 已经填好但还没有对内核可见的队尾
+    uint32_t m_sqLocalTail = 0;
+    // 已经对内核可见、还没有提交的SQE数
+    uint32_t m_toSubmit = 0;
+    // epoll fd上是否挂着POLL请求
+    bool m_epollArmed = false;
+    Spinlock m_cqLock;
+};
+
+UringPoller::UringPoller(int epfd, uint32_t entries)
+    : Poller(epfd) {
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (fd < 0) {
+        WILL_LOG_WARN(g_logger) << "io_uring_setup(" << entries << ") fail errno=" << errno
+                                << " errstr=" << strerror(errno);
+        return;
+    }
+    // 等待时需要同时指定超时和信号掩码
+    if (!(params.features & IORING_FEAT_EXT_ARG)) {
+        WILL_LOG_WARN(g_logger) << "io_uring without IORING_FEAT_EXT_ARG";
+        close(fd);
+        return;
+    }
+
+    m_sqRingSize = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+    m_cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        m_sqRingSize = m_cqRingSize = std::max(m_sqRingSize, m_cqRingSize);
+    }
+    m_sqRing = mmap(nullptr, m_sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                    fd, IORING_OFF_SQ_RING);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        m_cqRing = m_sqRing;
+    } else if (m_sqRing != MAP_FAILED) {
+        m_cqRing = mmap(nullptr, m_cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        fd, IORING_OFF_CQ_RING);
+    }
+    m_sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+    if (m_cqRing != MAP_FAILED) {
+        m_sqes = (io_uring_sqe *)mmap(nullptr, m_sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                      fd, IORING_OFF_SQES);
+    }
+    if (m_sqes == MAP_FAILED) {
+        WILL_LOG_WARN(g_logger) << "io_uring mmap fail errno=" << errno << " errstr=" << strerror(errno);
+        close(fd);
+        release();
+        return;
+    }
+
+    char *sq = (char *)m_sqRing;
+    m_sqHead    = (uint32_t *)(sq + params.sq_off.head);
+    m_sqTail    = (uint32_t *)(sq + params.sq_off.tail);
+    m_sqArray   = (uint32_t *)(sq + params.sq_off.array);
+    m_sqMask    = *(uint32_t *)(sq + params.sq_off.ring_mask);
+    m_sqEntries = params.sq_entries;
+    char *cq = (char *)m_cqRing;
+    m_cqHead = (uint32_t *)(cq + params.cq_off.head);
+    m_cqTail = (uint32_t *)(cq + params.cq_off.tail);
+    m_cqes   = (io_uring_cqe *)(cq + params.cq_off.cqes);
+    m_cqMask = *(uint32_t *)(cq + params.cq_off.ring_mask);
+    m_sqLocalTail = *m_sqTail;
+    m_ringFd = fd;
+
+    if (!probeCancelFd()) {
+        WILL_LOG_WARN(g_logger) << "io_uring without IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL";
+        release();
+        close(fd);
+        m_ringFd = -1;
+    }
+}
+
+UringPoller::~UringPoller() {
+    release();
+    if (m_ringFd >= 0) {
+        close(m_ringFd);
+    }
+}
+
+void UringPoller::release() {
+    if (m_sqes != MAP_FAILED) {
+        munmap(m_sqes, m_sqesSize);
+    }
+    if (m_cqRing != MAP_FAILED && m_cqRing != m_sqRing) {
+        munmap(m_cqRing, m_cqRingSize);
+    }
+    if (m_sqRing != MAP_FAILED) {
+        munmap(m_sqRing, m_sqRingSize);
+    }
+    m_sqes   = (io_uring_sqe *)MAP_FAILED;
+    m_cqRing = m_sqRing = MAP_FAILED;
+}
+
+bool UringPoller::probeCancelFd() {
+    // 取消epoll fd上的请求，这时还没有任何请求，支持时以ENOENT完成
+    io_uring_sqe *sqe = sqeAt(0);
+    sqe->opcode       = IORING_OP_ASYNC_CANCEL;
+    sqe->fd           = m_epfd;
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+    sqe->user_data    = TAG_IGNORE;
+    publish(1);
+    m_toSubmit = 0;
+    if (enter(1, 1, IORING_ENTER_GETEVENTS, nullptr, 0) != 1) {
+        return false;
+    }
+    uint32_t head = *m_cqHead;
+    if (head == __atomic_load_n(m_cqTail, __ATOMIC_ACQUIRE)) {
+        return false;
+    }
+    int res = m_cqes[head & m_cqMask].res;
+    __atomic_store_n(m_cqHead, head + 1, __ATOMIC_RELEASE);
+    return res != -EINVAL;
+}
+
+int UringPoller::enter(uint32_t to_submit, uint32_t min_complete, uint32_t flags, const void *arg, size_t argsz) {
+    countSyscall();
+    return syscall(__NR_io_uring_enter, m_ringFd, to_submit, min_complete, flags, arg, argsz);
+}
+
+void UringPoller::reserve(uint32_t n) {
+    while (m_sqLocalTail + n - __atomic_load_n(m_sqHead, __ATOMIC_ACQUIRE) > m_sqEntries) {
+        if (m_toSubmit) {
+            flushLocked();
+        } else {
+            // 排队的SQE已经被其他线程取走，正在提交
+            sched_yield();
+        }
+    }
+}
+
+io_uring_sqe *UringPoller::sqeAt(uint32_t i) {
+    uint32_t idx = (m_sqLocalTail + i) & m_sqMask;
+    io_uring_sqe *sqe = &m_sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    m_sqArray[idx] = idx;
+    return sqe;
+}
+
+void UringPoller::publish(uint32_t n) {
+    m_sqLocalTail += n;
+    __atomic_store_n(m_sqTail, m_sqLocalTail, __ATOMIC_RELEASE);
+    m_toSubmit += n;
+}
+
+void UringPoller::armEpoll() {
+    reserve(1);
+    io_uring_sqe *sqe  = sqeAt(0);
+    sqe->opcode        = IORING_OP_POLL_ADD;
+    sqe->fd            = m_epfd;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data     = TAG_EPOLL;
+    publish(1);
+    m_epollArmed = true;
+}
+
+void UringPoller::flushLocked() {
+    int rt = enter(m_toSubmit, 0, 0, nullptr, 0);
+    if (rt > 0) {
+        m_toSubmit -= rt;
+    } else if (rt < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+        WILL_LOG_ERROR(g_logger) << "io_uring_enter submit=" << m_toSubmit << " fail errno=" << errno
+                                 << " errstr=" << strerror(errno);
+    }
+}
+
+int UringPoller::wait(epoll_event *events, int max_events, int timeout_ms, const sigset_t *sigmask,
+                      std::vector<IoRequest *> &completed) {
+    uint32_t to_submit = 0;
+    {
+        Spinlock::Lock lock(m_sqLock);
+        if (!m_epollArmed) {
+            armEpoll();
+        }
+        to_submit  = m_toSubmit;
+        m_toSubmit = 0;
+    }
+
+    // 提交所有排队的SQE并等待至少一个CQE，只用一次系统调用
+    __kernel_timespec ts;
+    ts.tv_sec  = timeout_ms / 1000;
+    ts.tv_nsec = (timeout_ms % 1000) * 1000000ll;
+    io_uring_getevents_arg arg;
+    memset(&arg, 0, sizeof(arg));
+    arg.sigmask    = (uint64_t)(uintptr_t)sigmask;
+    arg.sigmask_sz = _NSIG / 8;
+    arg.ts         = (uint64_t)(uintptr_t)&ts;
+    int rt  = enter(to_submit, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+    int err = rt < 0 ? errno : 0;
+    // 有SQE被提交时返回提交数，没有全部提交时不会等待，剩下的留给下一次
+    uint32_t submitted = rt > 0 ? rt : 0;
+    if (submitted < to_submit) {
+        Spinlock::Lock lock(m_sqLock);
+        m_toSubmit += to_submit - submitted;
+    }
+    if (rt < 0 && err != EINTR && err != ETIME && err != EAGAIN && err != EBUSY) {
+        WILL_LOG_ERROR(g_logger) << "io_uring_enter fail errno=" << err << " errstr=" << strerror(err);
+    }
+
+    bool epoll_ready = false;
+    {
+        Spinlock::Lock lock(m_cqLock);
+        uint32_t head = *m_cqHead;
+        uint32_t tail = __atomic_load_n(m_cqTail, __ATOMIC_ACQUIRE);
+        for (; head != tail; ++head) {
+            io_uring_cqe &cqe = m_cqes[head & m_cqMask];
+            uint64_t data     = cqe.user_data;
+            if (data == TAG_EPOLL) {
+                epoll_ready = true;
+                continue;
+            }
+            if (data == TAG_IGNORE) {
+                continue;
+            }
+            IoRequest *req = (IoRequest *)(uintptr_t)(data & ~1ull);
+            if (data & 1) {
+                if (cqe.res == -ETIME) {
+                    req->timedOut = true;
+                }
+            } else {
+                req->result = cqe.res;
+            }
+            if (--req->remaining == 0) {
+                completed.push_back(req);
+            }
+        }
+        __atomic_store_n(m_cqHead, head, __ATOMIC_RELEASE);
+    }
+
+    if (!epoll_ready) {
+        if (err == EINTR && completed.empty()) {
+            errno = EINTR;
+            return -1;
+        }
+        return 0;
+    }
+    countSyscall();
+    int n = epoll_wait(m_epfd, events, max_events, 0);
+    // 立即重新挂上POLL请求，本线程去执行任务时其他idle线程还能被epoll上的事件和tickle唤醒
+    Spinlock::Lock lock(m_sqLock);
+    armEpoll();
+    flushLocked();
+    return n < 0 ? 0 : n;
+}
+
+bool UringPoller::submit(IoRequest *req) {
+    bool timeout = req->timeoutMs != ~0ull;
+    req->remaining = timeout ? 2 : 1;
+    req->timedOut  = false;
+    if (timeout) {
+        req->tsSec  = req->timeoutMs / 1000;
+        req->tsNsec = (req->timeoutMs % 1000) * 1000000ll;
+    }
+
+    Spinlock::Lock lock(m_sqLock);
+    reserve(req->remaining);
+    io_uring_sqe *sqe = sqeAt(0);
+    sqe->fd           = req->fd;
+    sqe->addr         = (uint64_t)(uintptr_t)req->addr;
+    switch (req->op) {
+    case IO_RECV:
+        sqe->opcode    = IORING_OP_RECV;
+        sqe->len       = req->len;
+        sqe->msg_flags = req->flags;
+        break;
+    case IO_SEND:
+        sqe->opcode    = IORING_OP_SEND;
+        sqe->len       = req->len;
+        sqe->msg_flags = req->flags;
+        break;
+    case IO_ACCEPT:
+        sqe->opcode       = IORING_OP_ACCEPT;
+        sqe->addr2        = (uint64_t)(uintptr_t)req->addr2;
+        sqe->accept_flags = req->flags;
+        break;
+    case IO_CONNECT:
+        sqe->opcode = IORING_OP_CONNECT;
+        sqe->off    = req->len;
+        break;
+    }
+    sqe->user_data = (uint64_t)(uintptr_t)req;
+    if (timeout) {
+        // 操作在超时前没有完成时被内核取消，以ECANCELED完成
+        sqe->flags |= IOSQE_IO_LINK;
+        io_uring_sqe *link = sqeAt(1);
+        link->opcode       = IORING_OP_LINK_TIMEOUT;
+        link->addr         = (uint64_t)(uintptr_t)&req->tsSec;
+        link->len          = 1;
+        link->user_data    = (uint64_t)(uintptr_t)req | 1;
+    }
+    publish(req->remaining);
+    return true;
+}
+
+void UringPoller::flush() {
+    Spinlock::Lock lock(m_sqLock);
+    if (m_toSubmit) {
+        flushLocked();
+    }
+}
+
+void UringPoller::cancel(int fd) {
+    Spinlock::Lock lock(m_sqLock);
+    reserve(1);
+    io_uring_sqe *sqe = sqeAt(0);
+    sqe->opcode       = IORING_OP_ASYNC_CANCEL;
+    sqe->fd           = fd;
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+    sqe->user_data    = TAG_IGNORE;
+    publish(1);
+    // fd马上就要被关闭并可能被复用，立即提交
+    flushLocked();
+}
+
+} // namespace
+
+Poller::ptr Poller::Create(Type type, int epfd) {
+    if (type == URING) {
+        std::unique_ptr<UringPoller> poller(new UringPoller(epfd, 4096));
+        if (poller->isValid()) {
+            return Poller::ptr(poller.release());
+        }
+        WILL_LOG_WARN(g_logger) << "io_uring unavailable, fall back to epoll";
+    }
+    return Poller::ptr(new EpollPoller(epfd));
+}
+
+} // namespace will
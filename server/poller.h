@@ -0,0 +1,112 @@
+#ifndef __WILL_POLLER_H__
+#define __WILL_POLLER_H__
+
+#include <signal.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <atomic>
+#include <memory>
+#include <vector>
+#include "fiber.h"
+#include "noncopyable.h"
+#include "scheduler.h"
+
+namespace will {
+
+// IOManager等待IO的后端，决定idle阻塞在哪个系统调用上，以及IO操作能否直接提交给内核
+// 两种后端都用epoll管理addEvent注册的就绪事件，fd的注册、tickle和定向唤醒的逻辑不变
+// EPOLL 默认后端，idle阻塞在epoll_pwait上，hook的IO先尝试系统调用，EAGAIN时注册就绪事件，就绪后再调用一次
+// URING idle阻塞在io_uring_enter上，epoll fd作为一个POLL请求挂在io_uring上
+//       hook的读写、accept、connect直接作为SQE提交，完成后由idle把结果交给等待的协程，超时用链接的LINK_TIMEOUT实现
+//       协程提交的SQE先放在提交队列里，由下一次idle的io_uring_enter一起提交，同一轮里多个协程的提交只需要一次系统调用
+//       提交的线程回到调度循环后还有任务要执行时，IOManager会立即flush，不让IO等到这些任务执行完
+class Poller : Noncopyable {
+public:
+    typedef std::unique_ptr<Poller> ptr;
+
+    enum Type {
+        EPOLL,
+        URING
+    };
+
+    // 可以直接提交的IO操作
+    enum IoOp {
+        // addr len flags 对应recv的buf len flags
+        IO_RECV,
+        // addr len flags 对应send的buf len flags
+        IO_SEND,
+        // addr addr2 对应accept的addr addrlen，flags对应accept4的flags
+        IO_ACCEPT,
+        // addr len 对应connect的addr addrlen
+        IO_CONNECT
+    };
+
+    // 一次直接提交的IO操作，由等待的协程在栈上持有，所有CQE都收到之前协程不会恢复
+    // 内核和reap的线程按地址写入请求和缓冲区，共享栈协程切出后地址会被别的协程占用，不能直接提交
+    struct IoRequest {
+        IoOp op;
+        int fd = -1;
+        void *addr = nullptr;
+        uint64_t len = 0;
+        void *addr2 = nullptr;
+        int flags = 0;
+        // 超时时间，~0ull表示不超时
+        uint64_t timeoutMs = ~0ull;
+
+        // 等待完成的协程和它所在的调度器
+        Fiber::ptr fiber;
+        Scheduler *scheduler = nullptr;
+        Scheduler::Priority priority = Scheduler::NORMAL;
+        // 操作的返回值，失败时为负的错误码
+        int result = 0;
+        // 是否因为超时被取消
+        bool timedOut = false;
+        // 还没收到的CQE数，带超时时操作和超时各有一个CQE
+        int remaining = 0;
+        // LINK_TIMEOUT使用的超时时间，和__kernel_timespec布局相同，内核读取之前必须一直有效
+        int64_t tsSec = 0;
+        long long tsNsec = 0;
+    };
+
+    Poller(int epfd)
+        : m_epfd(epfd) {
+    }
+
+    virtual ~Poller() {}
+
+    virtual Type getType() const = 0;
+
+    // 等待就绪事件或IO完成，最多等待timeout_ms毫秒，等待期间使用sigmask作为信号掩码
+    // events max_events 输出epoll fd上的就绪事件
+    // completed 输出所有CQE都已收到的IO请求
+    // 返回就绪事件数，被信号打断且没有就绪事件时返回-1，errno为EINTR
+    virtual int wait(epoll_event *events, int max_events, int timeout_ms, const sigset_t *sigmask,
+                     std::vector<IoRequest *> &completed) = 0;
+
+    // 提交一个IO操作，不等待完成，后端不支持直接提交时返回false
+    virtual bool submit(IoRequest *req) { return false; }
+
+    // 立即把排队的IO操作提交给内核，不等待完成，默认由下一次wait一起提交
+    virtual void flush() {}
+
+    // 取消fd上所有已经提交、还没完成的IO操作，被取消的操作以ECANCELED完成
+    // io_uring后端依赖5.19加入的按fd取消，创建时检查，不支持的内核直接使用epoll
+    virtual void cancel(int fd) {}
+
+    // 后端等待和提交发出的系统调用数
+    uint64_t getSyscalls() const { return m_syscalls.load(std::memory_order_relaxed); }
+
+    // 按type创建后端，io_uring不可用或内核不支持按fd取消时退回epoll
+    static Poller::ptr Create(Type type, int epfd);
+
+protected:
+    void countSyscall() { m_syscalls.fetch_add(1, std::memory_order_relaxed); }
+
+protected:
+    int m_epfd;
+    std::atomic<uint64_t> m_syscalls = {0};
+};
+
+} // namespace will
+
+#endif
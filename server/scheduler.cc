@@ -1,6 +1,11 @@
+#include <stdlib.h>
+#include <algorithm>
+#include <map>
+#include <sstream>
 #include "scheduler.h"
 #include "macro.h"
 #include "hook.h"
+#include "stack_profiler.h"
 
 namespace will {
 
@@ -10,12 +15,116 @@ static will::Logger::ptr g_logger = WILL_LOG_NAME("system");
 static thread_local Scheduler *t_scheduler = nullptr;
 // 当前线程的调度协程，每个线程都独有一份(线程的主协程)
 static thread_local Fiber *t_scheduler_fiber = nullptr;
+// 当前调度线程在所属调度器m_workers中的下标，不是调度线程时为-1
+static thread_local int t_worker_index = -1;
+// 窃取任务时挑选受害者线程用的随机数种子
+static thread_local unsigned int t_steal_seed = 0;
+// 当前线程正在执行的调度任务的优先级
+static thread_local Scheduler::Priority t_task_priority = Scheduler::NORMAL;
+// 当前调度线程开始连续空闲的时间，毫秒，0表示正在执行任务，只有弹性线程池会记录
+static thread_local uint64_t t_idle_since = 0;
 
-Scheduler::Scheduler(size_t threads, bool use_caller, const std::string &name) {
+// 工作窃取模式下，本地队列每取这么多次任务就检查一次全局队列，防止外部投递的任务被饿死
+static const uint64_t s_global_check_interval = 61;
+
+// 弹性线程池中，排队时间持续超过阈值这么久才扩容，每隔这么久最多扩容一个线程，微秒
+static const uint64_t s_grow_interval_us = 100 * 1000;
+
+struct Scheduler::Worker {
+    // 本地队列和信箱的锁，只有本线程、窃取者和投递者会竞争
+    Spinlock mutex;
+    // 本地任务队列，本线程从头部取任务，窃取者也从头部批量拿走一半
+    RunQueue tasks;
+    // 信箱，存放指定在本线程执行的任务，不会被窃取
+    RunQueue mailbox;
+    // 信箱中的任务数，信箱为空时不用加锁就能跳过
+    std::atomic<size_t> mailboxSize = {0};
+    // 占用这个位置的线程id，线程还未进入run时为-1
+    std::atomic<int> threadId = {-1};
+    // 线程是否准备进入或已经处于idle
+    std::atomic<bool> idle = {false};
+
+    // 以下统计数据只由占用这个Worker的线程写入，其他线程随时可以读取
+    std::atomic<uint64_t> taskCount       = {0};
+    std::atomic<uint64_t> runTime         = {0};
+    std::atomic<uint64_t> idleTime        = {0};
+    std::atomic<uint64_t> ticklesSent     = {0};
+    std::atomic<uint64_t> ticklesReceived = {0};
+    std::atomic<uint64_t> wastedScans     = {0};
+    std::atomic<uint64_t> deferredWakes   = {0};
+    std::atomic<uint64_t> fiberPoolHits   = {0};
+    std::atomic<uint64_t> fiberPoolMisses = {0};
+    std::atomic<size_t> fiberPoolSize     = {0};
+    // 任务从入队到开始执行的等待时间
+    Histogram queueLatency;
+    // 任务每次被resume后连续运行的时间
+    Histogram runSlice;
+
+    // 已结束的协程及其栈，回调任务优先从这里取协程，只由占用这个Worker的线程访问
+    std::vector<Fiber::ptr> fiberPool;
+};
+
+// 任务节点对象池，每个线程缓存一批空闲节点，投递线程和执行线程往往不是同一个，
+// 所以缓存超过上限时整批归还到全局空闲链表，缓存为空时再从全局空闲链表整批取回
+struct Scheduler::TaskPool {
+    // 线程缓存与全局空闲链表之间每次转移的节点数
+    static const size_t BATCH = 64;
+
+    struct Cache {
+        TaskQueue free;
+        ~Cache() {
+            Spinlock::Lock lock(s_mutex);
+            s_free.append(free);
+        }
+    };
+
+    static Spinlock s_mutex;
+    // 全局空闲节点链表
+    static TaskQueue s_free;
+    // 当前线程的空闲节点缓存
+    static thread_local Cache t_cache;
+};
+
+Spinlock Scheduler::TaskPool::s_mutex;
+Scheduler::TaskQueue Scheduler::TaskPool::s_free;
+thread_local Scheduler::TaskPool::Cache Scheduler::TaskPool::t_cache;
+
+Scheduler::ScheduleTask *Scheduler::AllocTask() {
+    TaskQueue &cache = TaskPool::t_cache.free;
+    if (WILL_UNLIKELY(cache.empty())) {
+        Spinlock::Lock lock(TaskPool::s_mutex);
+        for (size_t i = 0; i < TaskPool::BATCH && !TaskPool::s_free.empty(); ++i) {
+            cache.push(TaskPool::s_free.pop());
+        }
+    }
+    ScheduleTask *task = cache.pop();
+    return task ? task : new ScheduleTask;
+}
+
+void Scheduler::FreeTask(ScheduleTask *task) {
+    task->reset();
+    TaskQueue &cache = TaskPool::t_cache.free;
+    cache.push(task);
+    if (WILL_UNLIKELY(cache.size >= 2 * TaskPool::BATCH)) {
+        TaskQueue batch;
+        for (size_t i = 0; i < TaskPool::BATCH; ++i) {
+            batch.push(cache.pop());
+        }
+        Spinlock::Lock lock(TaskPool::s_mutex);
+        TaskPool::s_free.append(batch);
+    }
+}
+
+Scheduler::Scheduler(size_t threads, bool use_caller, const std::string &name, Mode mode,
+                     const ElasticConfig &elastic, const AffinityConfig &affinity) {
     WILL_ASSERT(threads > 0);
 
     m_useCaller = use_caller;
     m_name      = name;
+    m_mode      = mode;
+    for (auto &i : m_queueDepth) {
+        i = 0;
+    }
 
     if (use_caller) {
         --threads;
@@ -37,6 +146,81 @@ Scheduler::Scheduler(size_t threads, bool use_caller, const std::string &name) {
         m_rootThread = -1;
     }
     m_threadCount = threads;
+
+    size_t max_threads = m_threadCount;
+    if (elastic.maxThreads > 0) {
+        // 至少保留一个工作线程处理定时器和IO事件，并负责发现排队过长
+        WILL_ASSERT(elastic.minThreads > 0 && elastic.minThreads <= elastic.maxThreads);
+        m_elastic     = true;
+        m_minThreads  = elastic.minThreads;
+        m_maxThreads  = elastic.maxThreads;
+        m_growWait    = elastic.growWaitUs;
+        m_idleTimeout = elastic.idleTimeoutMs;
+        m_threadCount = std::min(std::max(threads, m_minThreads), m_maxThreads);
+        max_threads   = m_maxThreads;
+    }
+
+    // Worker按线程数上限一次准备好，之后数组不再变化，查找Worker时不需要加锁
+    m_workers.resize(max_threads + (use_caller ? 1 : 0));
+    for (auto &i : m_workers) {
+        i = new Worker;
+    }
+    // caller线程固定使用下标0，这样在stop之前投递给caller线程的任务也能直接进入它的信箱
+    if (use_caller) {
+        m_workers[0]->threadId = m_rootThread;
+    }
+    initAffinity(affinity);
+}
+
+void Scheduler::initAffinity(const AffinityConfig &affinity) {
+    m_workerCpus.assign(m_workers.size(), -1);
+    m_workerNodes.assign(m_workers.size(), -1);
+    if (affinity.policy == AFFINITY_NONE) {
+        return;
+    }
+
+    std::vector<int> cpus;
+    if (affinity.policy == AFFINITY_EXPLICIT) {
+        cpus = affinity.cpus;
+    } else {
+        // 按NUMA节点分组，节点内按CPU编号排序
+        std::vector<int> available = GetAvailableCpus();
+        std::map<int, std::vector<int>> nodes;
+        for (int cpu : available) {
+            nodes[GetCpuNode(cpu)].push_back(cpu);
+        }
+        if (affinity.policy == AFFINITY_COMPACT) {
+            for (auto &i : nodes) {
+                cpus.insert(cpus.end(), i.second.begin(), i.second.end());
+            }
+        } else {
+            // 每轮从每个节点各取一个CPU
+            for (size_t round = 0; cpus.size() < available.size(); ++round) {
+                for (auto &i : nodes) {
+                    if (round < i.second.size()) {
+                        cpus.push_back(i.second[round]);
+                    }
+                }
+            }
+        }
+    }
+    if (cpus.empty()) {
+        WILL_LOG_ERROR(g_logger) << m_name << " no cpu to bind, policy=" << affinity.policy;
+        return;
+    }
+
+    // 只有一个NUMA节点时不需要指定内存节点
+    std::set<int> node_set;
+    for (int cpu : cpus) {
+        node_set.insert(GetCpuNode(cpu));
+    }
+    // use_caller的主线程固定使用下标0，不绑定，工作线程从下一个下标开始依次使用cpus
+    for (size_t i = m_useCaller ? 1 : 0, n = 0; i < m_workers.size(); ++i, ++n) {
+        m_workerCpus[i] = cpus[n % cpus.size()];
+        if (node_set.size() > 1) {
+            m_workerNodes[i] = GetCpuNode(m_workerCpus[i]);
+        }
+    }
 }
 
 Scheduler *Scheduler::GetThis() { 
@@ -47,6 +231,10 @@ Fiber *Scheduler::GetMainFiber() {
     return t_scheduler_fiber;
 }
 
+Scheduler::Priority Scheduler::GetCurrentPriority() {
+    return t_task_priority;
+}
+
 void Scheduler::setThis() {
     t_scheduler = this;
 }
@@ -57,6 +245,9 @@ Scheduler::~Scheduler() {
     if (GetThis() == this) {
         t_scheduler = nullptr;
     }
+    for (auto i : m_workers) {
+        delete i;
+    }
 }
 
 void Scheduler::start() {
@@ -67,24 +258,135 @@ void Scheduler::start() {
         return;
     }
     WILL_ASSERT(m_threads.empty());
-    m_threads.resize(m_threadCount);
     for (size_t i = 0; i < m_threadCount; i++) {
-        //这里是new的一个Thread类，在构造函数中就会直接启动线程。
-        m_threads[i].reset(new Thread(std::bind(&Scheduler::run, this),
-                                      m_name + "_" + std::to_string(i)));
-        m_threadIds.push_back(m_threads[i]->getId());
+        addThread();
+    }
+}
+
+void Scheduler::addThread() {
+    //这里是new的一个Thread类，在构造函数中就会直接启动线程。
+    Thread::ptr thread(new Thread(std::bind(&Scheduler::run, this),
+                                  m_name + "_" + std::to_string(m_threadSeq++)));
+    m_threadIds.push_back(thread->getId());
+    // 线程id可能被系统复用
+    m_retiredThreadIds.erase(thread->getId());
+    m_threads.push_back(thread);
+}
+
+void Scheduler::checkGrow(uint64_t enqueue_time, uint64_t now) {
+    if (enqueue_time == 0) {
+        return;
+    }
+    if (now - enqueue_time < m_growWait) {
+        m_slowSince = 0;
+        return;
+    }
+    uint64_t since = m_slowSince;
+    if (since == 0) {
+        m_slowSince.compare_exchange_strong(since, now);
+        return;
+    }
+    // 偶尔排队过长不扩容，持续过长且没有空闲线程时才扩容，每个周期最多由一个线程扩容一次
+    if (now - since < s_grow_interval_us || hasIdleThreads() || m_threadCount >= m_maxThreads) {
+        return;
+    }
+    if (!m_slowSince.compare_exchange_strong(since, now)) {
+        return;
+    }
+    std::vector<Thread::ptr> retired;
+    {
+        MutexType::Lock lock(m_mutex);
+        if (m_stopping || m_threadCount >= m_maxThreads) {
+            return;
+        }
+        retired.swap(m_retiredThreads);
+        ++m_threadCount;
+        addThread();
+    }
+    WILL_LOG_INFO(g_logger) << m_name << " grow, threads=" << m_threadCount;
+    // 顺便回收已经退出线程池的线程
+    for (auto &i : retired) {
+        i->join();
     }
 }
 
+bool Scheduler::retireIdleThread() {
+    if (!m_elastic || GetThis() != this || t_worker_index < 0 || t_idle_since == 0) {
+        return false;
+    }
+    int id = will::GetThreadId();
+    // caller线程不属于线程池，不会退出
+    if (id == m_rootThread || will::GetCurrentMS() - t_idle_since < m_idleTimeout) {
+        return false;
+    }
+    // 绑定在本线程共享栈上的协程还会回来，线程不能退出
+    if (Fiber::GetSharedStackFibers()) {
+        return false;
+    }
+
+    Worker *worker   = m_workers[t_worker_index];
+    bool need_tickle = false;
+    {
+        MutexType::Lock lock(m_mutex);
+        if (m_stopping || m_threadCount <= m_minThreads) {
+            return false;
+        }
+        {
+            Spinlock::Lock worker_lock(worker->mutex);
+            // 信箱里的任务只能由本线程执行，等执行完再退出
+            if (!worker->mailbox.empty()) {
+                return false;
+            }
+            // 本地队列剩余的任务交给全局队列，加锁顺序与stopping()保持一致，不会误判
+            size_t count = worker->tasks.size();
+            m_tasks.append(worker->tasks);
+            m_localTaskCount -= count;
+            need_tickle = count > 0;
+            // 释放Worker，释放之后投递者在加锁确认时会发现线程已经不在了，转而放入全局队列
+            worker->idle     = false;
+            worker->threadId = -1;
+        }
+        // 之后指定在本线程执行的任务改为由任意线程执行，已经在全局队列中的也一样处理
+        m_retiredThreadIds.insert(id);
+        for (auto &queue : m_tasks.queues) {
+            for (ScheduleTask *it = queue.head; it; it = it->next) {
+                if (it->thread == id) {
+                    it->thread  = -1;
+                    need_tickle = true;
+                }
+            }
+        }
+        for (auto it = m_threads.begin(); it != m_threads.end(); ++it) {
+            if ((*it)->getId() == id) {
+                m_retiredThreads.push_back(*it);
+                m_threads.erase(it);
+                break;
+            }
+        }
+        m_threadIds.erase(std::remove(m_threadIds.begin(), m_threadIds.end(), id), m_threadIds.end());
+        --m_threadCount;
+    }
+    t_worker_index = -1;
+    if (need_tickle) {
+        tickle();
+    }
+    WILL_LOG_INFO(g_logger) << m_name << " retire idle thread " << id << ", threads=" << m_threadCount;
+    return true;
+}
+
 bool Scheduler::stopping() {
     MutexType::Lock lock(m_mutex);
-    return m_stopping && m_tasks.empty() && m_activeThreadCount == 0;
+    return m_stopping && m_tasks.empty() && m_localTaskCount == 0 && m_activeThreadCount == 0;
 }
 
 void Scheduler::tickle() { 
     WILL_LOG_DEBUG(g_logger) << "ticlke"; 
 }
 
+void Scheduler::tickleThread(int thread) {
+    tickle();
+}
+
 void Scheduler::idle() {
     WILL_LOG_DEBUG(g_logger) << "idle";
     while (!stopping()) {
@@ -106,7 +408,8 @@ void Scheduler::stop() {
            WILL_ASSERT(GetThis() != this);
     }
 
-    for (size_t i = 0; i < m_threadCount; i++) {
+    size_t threads = m_threadCount;
+    for (size_t i = 0; i < threads; i++) {
         tickle();
     }
 
@@ -124,16 +427,547 @@ void Scheduler::stop() {
     {
         MutexType::Lock lock(m_mutex);
         thrs.swap(m_threads);
+        thrs.insert(thrs.end(), m_retiredThreads.begin(), m_retiredThreads.end());
+        m_retiredThreads.clear();
     }
     for (auto &i : thrs) {
         i->join();
     }
 }
 
+void Scheduler::RecordRun(Worker *worker, uint64_t start) {
+    uint64_t used = will::GetMonotonicUS() - start;
+    worker->runSlice.add(used);
+    Histogram::Inc(worker->runTime, used);
+    Histogram::Inc(worker->taskCount, 1);
+}
+
+void Scheduler::countTickleSent() {
+    if (!m_statsEnabled.load(std::memory_order_relaxed)) {
+        return;
+    }
+    if (GetThis() == this && t_worker_index >= 0) {
+        Histogram::Inc(m_workers[t_worker_index]->ticklesSent, 1);
+    } else {
+        m_externalTickles.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+void Scheduler::countTickleReceived() {
+    if (m_statsEnabled.load(std::memory_order_relaxed) && GetThis() == this && t_worker_index >= 0) {
+        Histogram::Inc(m_workers[t_worker_index]->ticklesReceived, 1);
+    }
+}
+
+Scheduler::Stats Scheduler::getStats() const {
+    Stats stats;
+    stats.name              = m_name;
+    stats.threadCount       = m_threadCount;
+    stats.activeThreadCount = m_activeThreadCount;
+    stats.idleThreadCount   = m_idleThreadCount;
+    for (int i = 0; i < PRIORITY_COUNT; ++i) {
+        stats.queueDepth[i] = m_queueDepth[i];
+    }
+    stats.externalTickles = m_externalTickles;
+    for (auto worker : m_workers) {
+        ThreadStats ts;
+        ts.threadId        = worker->threadId;
+        ts.tasks           = worker->taskCount.load(std::memory_order_relaxed);
+        ts.runTime         = worker->runTime.load(std::memory_order_relaxed);
+        ts.idleTime        = worker->idleTime.load(std::memory_order_relaxed);
+        ts.ticklesSent     = worker->ticklesSent.load(std::memory_order_relaxed);
+        ts.ticklesReceived = worker->ticklesReceived.load(std::memory_order_relaxed);
+        ts.wastedScans     = worker->wastedScans.load(std::memory_order_relaxed);
+        ts.deferredWakes   = worker->deferredWakes.load(std::memory_order_relaxed);
+        ts.fiberPoolHits   = worker->fiberPoolHits.load(std::memory_order_relaxed);
+        ts.fiberPoolMisses = worker->fiberPoolMisses.load(std::memory_order_relaxed);
+        ts.fiberPoolSize   = worker->fiberPoolSize.load(std::memory_order_relaxed);
+        stats.threads.push_back(ts);
+
+        Histogram::Snapshot snap;
+        worker->queueLatency.snapshot(snap);
+        stats.queueLatency.merge(snap);
+        worker->runSlice.snapshot(snap);
+        stats.runSlice.merge(snap);
+    }
+    return stats;
+}
+
+std::ostream &Scheduler::Stats::dump(std::ostream &os) const {
+    static const char *s_priority_names[PRIORITY_COUNT] = {"critical", "normal", "background"};
+    os << "[Scheduler name=" << name
+       << " threads=" << threadCount
+       << " active=" << activeThreadCount
+       << " idle=" << idleThreadCount
+       << " queue_depth={";
+    for (int i = 0; i < PRIORITY_COUNT; ++i) {
+        os << (i ? " " : "") << s_priority_names[i] << "=" << queueDepth[i];
+    }
+    uint64_t hits = 0, misses = 0;
+    for (auto &ts : threads) {
+        hits += ts.fiberPoolHits;
+        misses += ts.fiberPoolMisses;
+    }
+    os << "} external_tickles=" << externalTickles
+       << " fiber_pool_hit_rate=" << (hits + misses ? (double)hits / (hits + misses) : 0)
+       << "\n    queue_latency_us=";
+    queueLatency.dump(os);
+    os << "\n    run_slice_us=";
+    runSlice.dump(os);
+    for (size_t i = 0; i < threads.size(); ++i) {
+        const ThreadStats &ts = threads[i];
+        os << "\n    worker[" << i << "] thread=" << ts.threadId
+           << " tasks=" << ts.tasks
+           << " run_us=" << ts.runTime
+           << " idle_us=" << ts.idleTime
+           << " tickles_sent=" << ts.ticklesSent
+           << " tickles_received=" << ts.ticklesReceived
+           << " wasted_scans=" << ts.wastedScans
+           << " deferred_wakes=" << ts.deferredWakes
+           << " fiber_pool_hits=" << ts.fiberPoolHits
+           << " fiber_pool_misses=" << ts.fiberPoolMisses
+           << " fiber_pool_size=" << ts.fiberPoolSize;
+    }
+    os << "]";
+    return os;
+}
+
+std::string Scheduler::Stats::toString() const {
+    std::stringstream ss;
+    dump(ss);
+    return ss.str();
+}
+
+void Scheduler::scheduleTask(ScheduleTask *task) {
+    if (m_elastic || m_statsEnabled.load(std::memory_order_relaxed)) {
+        task->enqueueTime = will::GetMonotonicUS();
+    }
+    if (deferWake(task)) {
+        return;
+    }
+    dispatchTask(task);
+}
+
+bool Scheduler::deferWake(ScheduleTask *task) {
+    // 已经切出的协程和普通回调直接入队，大部分任务只多一次原子读
+    if (!task->fiber) {
+        return false;
+    }
+    Fiber::State state = task->fiber->getState();
+    if (state != Fiber::RUNNING && state != Fiber::SUSPENDING) {
+        return false;
+    }
+    // 登记成功后任务可能马上被其他线程取走，任务内容要在登记之前写好
+    if (!task->enqueueTime && (m_elastic || m_statsEnabled.load(std::memory_order_relaxed))) {
+        task->enqueueTime = will::GetMonotonicUS();
+    }
+    task->scheduler = this;
+    switch (task->fiber->deferWake(task)) {
+    case Fiber::WAKE_DEFERRED:
+        return true;
+    case Fiber::WAKE_MERGED:
+        // 协程切出一次只会被resume一次，重复的唤醒直接丢弃
+        FreeTask(task);
+        return true;
+    default:
+        task->scheduler = nullptr;
+        return false;
+    }
+}
+
+void Scheduler::ScheduleDeferredWake(void *wake) {
+    ScheduleTask *task   = static_cast<ScheduleTask *>(wake);
+    Scheduler *scheduler = task->scheduler;
+    task->scheduler      = nullptr;
+    if (scheduler->m_statsEnabled.load(std::memory_order_relaxed) && GetThis() == scheduler && t_worker_index >= 0) {
+        Histogram::Inc(scheduler->m_workers[t_worker_index]->deferredWakes, 1);
+    }
+    scheduler->dispatchTask(task);
+}
+
+void Scheduler::dispatchTask(ScheduleTask *task) {
+    // 指定了线程的任务直接投递到目标线程的信箱，只唤醒目标线程
+    // 工作窃取模式下，调度线程自己投递的任务优先放入本地队列，不需要竞争全局锁
+    if (task->thread != -1) {
+        if (scheduleMailbox(task)) {
+            return;
+        }
+    } else if (m_mode == WORK_STEALING && scheduleLocal(task)) {
+        return;
+    }
+    scheduleGlobal(task);
+}
+
+bool Scheduler::scheduleLocal(ScheduleTask *task) {
+    if (GetThis() != this || t_worker_index < 0) {
+        return false;
+    }
+    Worker *worker = m_workers[t_worker_index];
+    bool need_tickle = false;
+    {
+        Spinlock::Lock lock(worker->mutex);
+        need_tickle = worker->tasks.empty();
+        worker->tasks.push(task);
+        ++m_localTaskCount;
+    }
+    ++m_queueDepth[task->priority];
+    // 本地队列由空变为非空时通知一下空闲线程过来窃取
+    if (need_tickle && hasIdleThreads()) {
+        tickle();
+    }
+    return true;
+}
+
+bool Scheduler::hasMailboxTask() {
+    if (GetThis() != this || t_worker_index < 0) {
+        return false;
+    }
+    return m_workers[t_worker_index]->mailboxSize > 0;
+}
+
+bool Scheduler::hasReadyTasks() {
+    if (!isWorkerThread()) {
+        return false;
+    }
+    Worker *worker = m_workers[t_worker_index];
+    if (worker->mailboxSize > 0) {
+        return true;
+    }
+    {
+        Spinlock::Lock lock(worker->mutex);
+        if (!worker->tasks.empty()) {
+            return true;
+        }
+    }
+    // 排队任务总数多于本地队列和信箱中的任务数，说明全局队列里还有任务
+    size_t queued = 0;
+    for (int i = 0; i < PRIORITY_COUNT; ++i) {
+        queued += m_queueDepth[i];
+    }
+    return queued > m_localTaskCount;
+}
+
+bool Scheduler::isWorkerThread() const {
+    return GetThis() == this && t_worker_index >= 0;
+}
+
+bool Scheduler::hasOtherIdleThreads() {
+    size_t self = isWorkerThread() && m_workers[t_worker_index]->idle ? 1 : 0;
+    return m_idleThreadCount > self;
+}
+
+void Scheduler::setFiberPoolWatermarks(size_t low, size_t high) {
+    WILL_ASSERT(low <= high);
+    m_fiberPoolLow  = low;
+    m_fiberPoolHigh = high;
+}
+
+Fiber::ptr Scheduler::acquireFiber(Worker *worker, std::function<void()> cb, bool stats, const char *key) {
+    // 自适应栈大小选出的规格和池里的协程不同，直接新建，栈从分配器的线程缓存里取，开销不大
+    size_t stacksize = StackProfiler::GetStackSize(key);
+    if (worker->fiberPool.empty() || (stacksize && stacksize != Fiber::GetDefaultStackSize())) {
+        if (stats) {
+            Histogram::Inc(worker->fiberPoolMisses, 1);
+        }
+        Fiber::ptr fiber(new Fiber(cb, stacksize));
+        fiber->setStackKey(key);
+        return fiber;
+    }
+    Fiber::ptr fiber = std::move(worker->fiberPool.back());
+    worker->fiberPool.pop_back();
+    worker->fiberPoolSize.store(worker->fiberPool.size(), std::memory_order_relaxed);
+    if (stats) {
+        Histogram::Inc(worker->fiberPoolHits, 1);
+    }
+    fiber->reset(cb);
+    fiber->setStackKey(key);
+    return fiber;
+}
+
+void Scheduler::releaseFiber(Worker *worker, Fiber::ptr &fiber) {
+    // 只回收调度器自己创建的同规格协程，用户还持有的协程不能复用
+    if (fiber->getState() != Fiber::TERM || fiber.use_count() != 1 || !fiber->isRunInScheduler()
+        || fiber->isSharedStack() || fiber->getStackSize() != Fiber::GetDefaultStackSize()) {
+        fiber.reset();
+        return;
+    }
+    std::vector<Fiber::ptr> &pool = worker->fiberPool;
+    pool.push_back(std::move(fiber));
+    // 超过高水位后一次释放到低水位，避免在水位附近反复分配和释放栈
+    if (pool.size() > m_fiberPoolHigh.load(std::memory_order_relaxed)) {
+        pool.resize(std::min(pool.size(), m_fiberPoolLow.load(std::memory_order_relaxed)));
+    }
+    worker->fiberPoolSize.store(pool.size(), std::memory_order_relaxed);
+}
+
+size_t Scheduler::claimWorker() {
+    int id = will::GetThreadId();
+    // caller线程固定使用下标0
+    if (m_useCaller && id == m_rootThread) {
+        return 0;
+    }
+    for (size_t i = m_useCaller ? 1 : 0; i < m_workers.size(); ++i) {
+        int expected = -1;
+        if (m_workers[i]->threadId.compare_exchange_strong(expected, id)) {
+            return i;
+        }
+    }
+    WILL_ASSERT2(false, "no free worker, name=" << m_name);
+    return 0;
+}
+
+Scheduler::Worker *Scheduler::getWorker(int thread) {
+    // 线程数很少，线性查找的代价可以忽略，和任务队列长度无关
+    for (auto i : m_workers) {
+        if (i->threadId == thread) {
+            return i;
+        }
+    }
+    return nullptr;
+}
+
+bool Scheduler::scheduleMailbox(ScheduleTask *task) {
+    int thread     = task->thread;
+    Worker *worker = getWorker(thread);
+    if (!worker) {
+        return false;
+    }
+    {
+        Spinlock::Lock lock(worker->mutex);
+        // 加锁后再确认一次，弹性线程池中目标线程可能刚刚退出
+        if (worker->threadId != thread) {
+            return false;
+        }
+        worker->mailbox.push(task);
+        ++worker->mailboxSize;
+        ++m_localTaskCount;
+    }
+    ++m_queueDepth[task->priority];
+    // 必须先放入信箱再检查idle，与run()中先置idle再检查信箱配对，避免丢失唤醒
+    if (worker->idle && thread != will::GetThreadId()) {
+        tickleThread(thread);
+    }
+    return true;
+}
+
+void Scheduler::scheduleGlobal(ScheduleTask *task) {
+    //往任务队列里加任务，need_tickle表示是否要唤醒，
+    //如果之前任务队列里是没有任务的，那此时加入任务就要唤醒
+    bool need_tickle = false;
+    {
+        MutexType::Lock lock(m_mutex);
+        // 目标线程已经退出线程池，改为由任意线程执行，避免任务永远留在全局队列
+        if (task->thread != -1 && m_retiredThreadIds.count(task->thread)) {
+            task->thread = -1;
+        }
+        need_tickle = m_tasks.empty();
+        m_tasks.push(task);
+    }
+    ++m_queueDepth[task->priority];
+    if (need_tickle) {
+        tickle(); // 唤醒idle协程
+    }
+}
+
+void Scheduler::scheduleTasks(TaskQueue &tasks, int thread, Priority priority) {
+    if (tasks.empty()) {
+        return;
+    }
+    size_t count = tasks.size;
+    m_queueDepth[priority] += count;
+    if (m_elastic || m_statsEnabled.load(std::memory_order_relaxed)) {
+        uint64_t now = will::GetMonotonicUS();
+        for (ScheduleTask *it = tasks.head; it; it = it->next) {
+            it->enqueueTime = now;
+        }
+    }
+
+    if (thread != -1) {
+        Worker *worker = getWorker(thread);
+        bool delivered = false;
+        if (worker) {
+            Spinlock::Lock lock(worker->mutex);
+            // 加锁后再确认一次，弹性线程池中目标线程可能刚刚退出
+            if (worker->threadId == thread) {
+                worker->mailbox.queues[priority].append(tasks);
+                worker->mailboxSize += count;
+                m_localTaskCount += count;
+                delivered = true;
+            }
+        }
+        if (delivered) {
+            if (worker->idle && thread != will::GetThreadId()) {
+                tickleThread(thread);
+            }
+            return;
+        }
+    }
+
+    if (thread == -1 && m_mode == WORK_STEALING && GetThis() == this && t_worker_index >= 0) {
+        Worker *worker = m_workers[t_worker_index];
+        Spinlock::Lock lock(worker->mutex);
+        worker->tasks.queues[priority].append(tasks);
+        m_localTaskCount += count;
+    } else {
+        MutexType::Lock lock(m_mutex);
+        if (thread != -1 && m_retiredThreadIds.count(thread)) {
+            for (ScheduleTask *it = tasks.head; it; it = it->next) {
+                it->thread = -1;
+            }
+        }
+        m_tasks.queues[priority].append(tasks);
+    }
+
+    // 一批任务只唤醒一个空闲线程，它取走任务后发现队列里还有剩余，会通过tickle_me接着唤醒下一个
+    // 是否真的需要通知由tickle()判断，没有空闲线程时也要调用，外部线程投递时可能赶上线程正在进入idle
+    tickle();
+}
+
+Scheduler::ScheduleTask *Scheduler::takeGlobal(bool &tickle_me) {
+    ScheduleTask *task = nullptr;
+    // 检查过但跳过的任务数
+    uint64_t skipped = 0;
+    MutexType::Lock lock(m_mutex);
+    int levels[PRIORITY_COUNT];
+    m_tasks.order(levels);
+    // 按优先级顺序遍历所有调度任务
+    for (int level : levels) {
+        ScheduleTask *prev = nullptr;
+        ScheduleTask *it   = m_tasks.queues[level].head;
+        while (it) {
+            if (it->thread != -1 && it->thread != will::GetThreadId()) {
+                // 指定了调度线程，但不是在当前线程上调度，标记一下需要通知其他线程进行调度，然后跳过这个任务，继续下一个
+                // 只有目标线程还没进入调度时任务才会留在全局队列，其他情况都直接进了目标线程的信箱
+                prev = it;
+                it   = it->next;
+                tickle_me = true;
+                ++skipped;
+                continue;
+            }
+
+            // 找到一个未指定线程，或是指定了当前线程的任务
+            // 刚添加事件就被触发、协程还没来得及yield的唤醒已经登记在协程上，不会进入队列，队列中的协程都可以直接resume
+            WILL_ASSERT(it->fiber || it->cb);
+
+            // 当前调度线程找到一个任务，准备开始调度，将其从任务队列中剔除，活动线程数加1
+            task = m_tasks.removeAfter(level, prev);
+            ++m_activeThreadCount;
+            --m_queueDepth[level];
+            break;
+        }
+        if (task) {
+            break;
+        }
+    }
+    // 当前线程拿完一个任务后，发现任务队列还有剩余，那么tickle一下其他线程
+    tickle_me |= (task && !m_tasks.empty());
+    if (skipped && m_statsEnabled.load(std::memory_order_relaxed)) {
+        Histogram::Inc(m_workers[t_worker_index]->wastedScans, skipped);
+    }
+    return task;
+}
+
+Scheduler::ScheduleTask *Scheduler::TakeRunnable(RunQueue &queue) {
+    int levels[PRIORITY_COUNT];
+    queue.order(levels);
+    for (int level : levels) {
+        if (!queue.queues[level].empty()) {
+            return queue.removeAfter(level, nullptr);
+        }
+    }
+    return nullptr;
+}
+
+Scheduler::ScheduleTask *Scheduler::takeMailbox() {
+    Worker *worker = m_workers[t_worker_index];
+    if (worker->mailboxSize == 0) {
+        return nullptr;
+    }
+    Spinlock::Lock lock(worker->mutex);
+    ScheduleTask *task = TakeRunnable(worker->mailbox);
+    if (task) {
+        ++m_activeThreadCount;
+        --worker->mailboxSize;
+        --m_localTaskCount;
+        --m_queueDepth[task->priority];
+    }
+    return task;
+}
+
+Scheduler::ScheduleTask *Scheduler::takeLocal(bool &tickle_me) {
+    Worker *worker = m_workers[t_worker_index];
+    Spinlock::Lock lock(worker->mutex);
+    ScheduleTask *task = TakeRunnable(worker->tasks);
+    if (task) {
+        // 先增加活跃线程数再减少队列计数，保证stopping()不会在两者之间误判
+        ++m_activeThreadCount;
+        --m_localTaskCount;
+        --m_queueDepth[task->priority];
+    }
+    // 本地队列还有剩余任务，通知空闲线程过来窃取
+    tickle_me |= !worker->tasks.empty();
+    return task;
+}
+
+Scheduler::ScheduleTask *Scheduler::steal(bool &tickle_me) {
+    size_t count = m_workers.size();
+    if (count <= 1) {
+        return nullptr;
+    }
+    if (t_steal_seed == 0) {
+        t_steal_seed = will::GetThreadId();
+    }
+    // 从随机位置开始轮询一遍其他线程，避免所有窃取者都盯着同一个受害者
+    size_t start = rand_r(&t_steal_seed) % count;
+    RunQueue stolen;
+    for (size_t i = 0; i < count && stolen.empty(); ++i) {
+        size_t idx = (start + i) % count;
+        if ((int)idx == t_worker_index) {
+            continue;
+        }
+        Worker *victim = m_workers[idx];
+        Spinlock::Lock lock(victim->mutex);
+        // 每个优先级各窃取一半，保持任务原有的优先级
+        for (int level = 0; level < PRIORITY_COUNT; ++level) {
+            TaskQueue &from = victim->tasks.queues[level];
+            size_t n = (from.size + 1) / 2;
+            for (size_t j = 0; j < n; ++j) {
+                stolen.queues[level].push(from.pop());
+            }
+        }
+    }
+    if (stolen.empty()) {
+        return nullptr;
+    }
+
+    Worker *worker = m_workers[t_worker_index];
+    {
+        Spinlock::Lock lock(worker->mutex);
+        worker->tasks.append(stolen);
+    }
+    return takeLocal(tickle_me);
+}
+
 void Scheduler::run() {
     WILL_LOG_DEBUG(g_logger) << "run";
     set_hook_enable(true);
     setThis();
+
+    // 每个调度线程占用一个本地队列和信箱
+    size_t worker_index = claimWorker();
+    t_worker_index      = worker_index;
+    Worker *worker      = m_workers[worker_index];
+
+    // 先绑定CPU和NUMA节点，再创建idle协程等线程私有的数据，这样它们都分配在本地节点上
+    if (m_workerCpus[worker_index] >= 0) {
+        will::SetThreadAffinity(m_workerCpus[worker_index]);
+        WILL_LOG_DEBUG(g_logger) << m_name << " bind thread " << will::GetThreadId()
+                                 << " to cpu " << m_workerCpus[worker_index];
+    }
+    if (m_workerNodes[worker_index] >= 0) {
+        will::SetThreadMemoryNode(m_workerNodes[worker_index]);
+    }
+
     //创建调度器的线程一定是开启了主协程的，且调度器的rootfiber的run函数不是在主协程上运行
     //这里判断当前线程是否为主线程，如果不是，则在当前线程上不一定创建了主协程
     //调用GetThis创建主协程（即调度携程)。
@@ -142,69 +976,78 @@ void Scheduler::run() {
     }
     //注意idle协程是每个线程都有一个，线程处于空闲状态时就运行idle协程。
     Fiber::ptr idle_fiber(new Fiber(std::bind(&Scheduler::idle, this)));
-    Fiber::ptr cb_fiber;
-
-    ScheduleTask task;
-    while (true) {
-        task.reset();
-        bool tickle_me = false; // 是否tickle其他线程进行任务调度
-        {
-            MutexType::Lock lock(m_mutex);
-            auto it = m_tasks.begin();
-            // 遍历所有调度任务
-            while (it != m_tasks.end()) {
-                if (it->thread != -1 && it->thread != will::GetThreadId()) {
-                    // 指定了调度线程，但不是在当前线程上调度，标记一下需要通知其他线程进行调度，然后跳过这个任务，继续下一个
-                    ++it;
-                    tickle_me = true;
-                    continue;
-                }
 
-                // 找到一个未指定线程，或是指定了当前线程的任务
-                WILL_ASSERT(it->fiber || it->cb);
 
-                // hook IO相关的系统调用时，在检测到IO未就绪的情况下，会先添加对应的读写事件，再yield当前协程，等IO就绪后再resume当前协程
-                // 多线程高并发情境下，有可能发生刚添加事件就被触发的情况，如果此时当前协程还未来得及yield，则这里就有可能出现协程状态仍为RUNNING的情况
-                // 这里简单地跳过这种情况，以损失一点性能为代价，否则整个协程框架都要大改
-                if(it->fiber && it->fiber->getState() == Fiber::RUNNING) {
-                    ++it;
-                    continue;
-                }
-                
-                // 当前调度线程找到一个任务，准备开始调度，将其从任务队列中剔除，活动线程数加1
-                task = *it;
-                m_tasks.erase(it++);
-                ++m_activeThreadCount;
-                break;
+    uint64_t tick = 0;
+    while (true) {
+        ScheduleTask *task = nullptr;
+        bool tickle_me     = false; // 是否tickle其他线程进行任务调度
+        if ((task = takeMailbox())) {
+            // 指定在本线程执行的任务只会出现在本线程的信箱里，优先处理
+        } else if (m_mode == WORK_STEALING) {
+            // 优先取本地队列，每隔一段时间先看一眼全局队列，本地和全局都没有任务时再去窃取
+            if (++tick % s_global_check_interval == 0) {
+                (task = takeGlobal(tickle_me)) || (task = takeLocal(tickle_me)) || (task = steal(tickle_me));
+            } else {
+                (task = takeLocal(tickle_me)) || (task = takeGlobal(tickle_me)) || (task = steal(tickle_me));
             }
-            // 当前线程拿完一个任务后，发现任务队列还有剩余，那么tickle一下其他线程
-            tickle_me |= (it != m_tasks.end());
+        } else {
+            task = takeGlobal(tickle_me);
         }
 
         if (tickle_me) {
             tickle();
         }
+        // 开始执行的时间，只有开启统计或弹性线程池时才读取时钟
+        bool stats     = m_statsEnabled.load(std::memory_order_relaxed);
+        uint64_t start = 0;
+        if (task && (stats || m_elastic)) {
+            start = will::GetMonotonicUS();
+            if (stats && task->enqueueTime) {
+                worker->queueLatency.add(start - task->enqueueTime);
+            }
+            if (m_elastic) {
+                t_idle_since = 0;
+                checkGrow(task->enqueueTime, start);
+            }
+        }
         //注意，此时要任务指定是在本线程执行才可能取得task，若任务队列里没有任务指定线程为任意或本线程
         //则task为null
-        if (task.fiber) {
+        if (task && task->fiber) {
             //进入这一步表示取得了任务，且任务类型为协程
+            //先把协程从任务节点中移出并归还节点，节点马上可以被复用
+            Fiber::ptr fiber;
+            fiber.swap(task->fiber);
+            t_task_priority = task->priority;
+            FreeTask(task);
             //这里resume这个名字没有取好，叫交换比较恰当，就是此时让出当前协程的执行权，执行任务携带的协程
             // resume协程，resume返回时，协程要么执行完了，要么半路yield了，总之这个任务就算完成了，活跃线程数减一
             //执行完后会回到这里
-            task.fiber->resume();
+            fiber->resume();
+            t_task_priority = NORMAL;
             --m_activeThreadCount;
-            task.reset();
-        } else if (task.cb) {
-            //取得了任务，类型为函数
-            if (cb_fiber) {
-                cb_fiber->reset(task.cb);
-            } else {
-                cb_fiber.reset(new Fiber(task.cb));
+            if (stats) {
+                RecordRun(worker, start);
             }
-            task.reset();
+            // 中途yield过的回调协程在别的线程上执行完后，也回收到当前线程的协程池
+            releaseFiber(worker, fiber);
+        } else if (task) {
+            //取得了任务，类型为函数
+            //协程入口只捕获任务节点指针，std::function可以内联存放，回调执行完后在协程里归还节点
+            std::function<void()> entry = [task]() {
+                task->cb();
+                FreeTask(task);
+            };
+            Fiber::ptr cb_fiber = acquireFiber(worker, entry, stats, task->cb.targetType().name());
+            t_task_priority     = task->priority;
             cb_fiber->resume();
+            t_task_priority = NORMAL;
             --m_activeThreadCount;
-            cb_fiber.reset();
+            if (stats) {
+                RecordRun(worker, start);
+            }
+            // 回调执行完了，协程放回协程池；半路yield的协程已经被别处持有，等它执行完再回收
+            releaseFiber(worker, cb_fiber);
         } else {
             // 进到这个分支情况一定是任务队列空了，调度idle协程即可
             if (idle_fiber->getState() == Fiber::TERM) {
@@ -212,11 +1055,35 @@ void Scheduler::run() {
                 WILL_LOG_DEBUG(g_logger) << "idle fiber term";
                 break;
             }
+            // 先标记idle再检查信箱，与scheduleMailbox()中先放入信箱再检查idle配对，避免丢失唤醒
+            worker->idle = true;
+            if (worker->mailboxSize > 0) {
+                worker->idle = false;
+                continue;
+            }
+            if (m_elastic && t_idle_since == 0) {
+                t_idle_since = will::GetCurrentMS();
+            }
+            uint64_t idle_start = stats ? will::GetMonotonicUS() : 0;
             ++m_idleThreadCount;
             idle_fiber->resume();
             --m_idleThreadCount;
+            if (t_worker_index < 0) {
+                // 空闲太久已经在idle中退出了线程池，Worker可能已经被新线程占用，不能再访问
+                WILL_LOG_DEBUG(g_logger) << "retired";
+                break;
+            }
+            worker->idle = false;
+            if (stats) {
+                Histogram::Inc(worker->idleTime, will::GetMonotonicUS() - idle_start);
+            }
         }
     }
+    // 退出线程池时已经释放了Worker，这里只释放仍属于本线程的Worker
+    int id = will::GetThreadId();
+    worker->threadId.compare_exchange_strong(id, -1);
+    t_worker_index = -1;
+    t_idle_since   = 0;
     WILL_LOG_DEBUG(g_logger) << "Scheduler::run() exit";
 }
 
@@ -2,10 +2,13 @@
 #define __WILL_SCHEDULER_H__
 
 #include <functional>
-#include <list>
 #include <memory>
+#include <set>
 #include <string>
+#include <type_traits>
+#include "callable.h"
 #include "fiber.h"
+#include "histogram.h"
 #include "log.h"
 #include "thread.h"
 
@@ -17,32 +20,197 @@ public:
     typedef std::shared_ptr<Scheduler> ptr;
     typedef Mutex MutexType;
 
-    Scheduler(size_t threads = 1, bool use_caller = true, const std::string &name = "Scheduler");
+    // 调度模式
+    enum Mode {
+        // 所有线程共享一个全局任务队列
+        LIST,
+        // 每个调度线程有自己的本地队列，本地队列为空时随机挑选其他线程窃取任务，
+        // 调度器外部线程投递的任务放入全局注入队列
+        WORK_STEALING
+    };
+
+    // 任务优先级，数值越小越优先
+    // 出队时高优先级优先，但低优先级按固定比例获得先出队的机会，不会被饿死
+    enum Priority {
+        // 延迟敏感的任务，例如accept循环、健康检查
+        CRITICAL = 0,
+        // 普通任务，默认优先级
+        NORMAL = 1,
+        // 后台批量任务，例如日志推送
+        BACKGROUND = 2,
+        PRIORITY_COUNT = 3
+    };
+
+    // 弹性线程池配置，maxThreads为0表示不开启，工作线程数固定为构造时指定的线程数
+    struct ElasticConfig {
+        // min_threads max_threads 工作线程数的上下限，不包含use_caller的主线程，构造时指定的线程数作为初始线程数
+        // grow_wait_us 任务排队时间持续超过这个阈值时增加一个工作线程
+        // idle_timeout_ms 工作线程连续空闲超过这个时长时退出，工作线程数不会低于min_threads
+        ElasticConfig(size_t min_threads = 0, size_t max_threads = 0, uint64_t grow_wait_us = 1000,
+                      uint64_t idle_timeout_ms = 60000)
+            : minThreads(min_threads)
+            , maxThreads(max_threads)
+            , growWaitUs(grow_wait_us)
+            , idleTimeoutMs(idle_timeout_ms) {}
+
+        size_t minThreads;
+        size_t maxThreads;
+        uint64_t growWaitUs;
+        uint64_t idleTimeoutMs;
+    };
+
+    // 工作线程的CPU绑定策略
+    enum AffinityPolicy {
+        // 不绑定，由系统调度
+        AFFINITY_NONE,
+        // 先占满一个NUMA节点的CPU，再使用下一个节点
+        AFFINITY_COMPACT,
+        // 轮流使用各个NUMA节点的CPU，使线程平均分布在各节点上
+        AFFINITY_SCATTER,
+        // 按给定的CPU列表依次绑定
+        AFFINITY_EXPLICIT
+    };
+
+    // 工作线程的CPU绑定配置
+    // 线程绑定CPU后，线程之后分配的内存(协程栈、线程缓存等)优先使用该CPU所在NUMA节点的内存
+    // use_caller的主线程是调用者的线程，不做绑定
+    struct AffinityConfig {
+        // policy 绑定策略
+        // cpus AFFINITY_EXPLICIT时使用的CPU列表，第i个工作线程绑定到cpus[i % cpus.size()]
+        AffinityConfig(AffinityPolicy policy = AFFINITY_NONE, const std::vector<int> &cpus = std::vector<int>())
+            : policy(policy)
+            , cpus(cpus) {}
+
+        AffinityPolicy policy;
+        std::vector<int> cpus;
+    };
+
+    // 单个调度线程的统计数据，时间单位都是微秒
+    struct ThreadStats {
+        // 占用这个位置的线程id，-1表示当前没有线程
+        int threadId = -1;
+        // 执行的任务数
+        uint64_t tasks = 0;
+        // 执行任务的总时间
+        uint64_t runTime = 0;
+        // 处于idle协程中的总时间
+        uint64_t idleTime = 0;
+        // 发出的tickle数
+        uint64_t ticklesSent = 0;
+        // 在idle中被tickle唤醒的次数
+        uint64_t ticklesReceived = 0;
+        // 出队时检查过但不能在本线程执行而跳过的任务数
+        uint64_t wastedScans = 0;
+        // 协程切出完成前就被唤醒，切出后由本线程补做调度的次数
+        uint64_t deferredWakes = 0;
+        // 回调任务从协程池取到协程的次数
+        uint64_t fiberPoolHits = 0;
+        // 协程池为空，需要新建协程的次数
+        uint64_t fiberPoolMisses = 0;
+        // 协程池中缓存的协程数
+        size_t fiberPoolSize = 0;
+    };
+
+    // 调度器统计数据的快照，时间单位都是微秒
+    // 线程的统计数据按Worker统计，弹性线程池中新线程占用了退出线程的Worker时，数据继续累加
+    struct Stats {
+        std::string name;
+        size_t threadCount       = 0;
+        size_t activeThreadCount = 0;
+        size_t idleThreadCount   = 0;
+        // 各优先级排队中的任务数
+        size_t queueDepth[PRIORITY_COUNT] = {0};
+        // 不属于本调度器的线程发出的tickle数
+        uint64_t externalTickles = 0;
+        std::vector<ThreadStats> threads;
+        // 任务从入队到开始执行的等待时间
+        Histogram::Snapshot queueLatency;
+        // 任务每次被resume后连续运行的时间
+        Histogram::Snapshot runSlice;
+
+        std::ostream &dump(std::ostream &os) const;
+
+        std::string toString() const;
+    };
+
+    // threads 线程数量，开启弹性线程池时作为初始线程数
+    // use_caller 是否将调用线程包含进去
+    // name 调度器名称
+    // mode 调度模式
+    // elastic 弹性线程池配置
+    // affinity 工作线程的CPU绑定配置
+    Scheduler(size_t threads = 1, bool use_caller = true, const std::string &name = "Scheduler",
+              Mode mode = LIST, const ElasticConfig &elastic = ElasticConfig(),
+              const AffinityConfig &affinity = AffinityConfig());
 
     virtual ~Scheduler();
 
     const std::string &getName() const { return m_name; }
 
+    Mode getMode() const { return m_mode; }
+
     static Scheduler *GetThis();
 
     static Fiber *GetMainFiber();
 
-    // FiberOrCb 调度任务类型，可以是协程对象或函数指针
+    // 返回当前线程正在执行的调度任务的优先级，不在调度任务中时返回NORMAL
+    // IO事件和定时器唤醒协程时沿用这个优先级，协程在等待IO前后保持同一优先级
+    static Priority GetCurrentPriority();
+
+    // 返回某个优先级在全局队列、本地队列和信箱中排队的任务总数
+    size_t getQueueDepth(Priority priority) const { return m_queueDepth[priority]; }
+
+    // FiberOrCb 调度任务类型，可以是协程对象或任意可调用对象
     // fc 协程对象或指针
     // thread 指定运行该任务的线程号，-1表示任意线程
+    // priority 任务优先级
     template <class FiberOrCb>
-    void schedule(FiberOrCb fc, int thread = -1) {
-        bool need_tickle = false;
-        {
-            MutexType::Lock lock(m_mutex);
-            need_tickle = scheduleNoLock(fc, thread);
+    void schedule(FiberOrCb fc, int thread = -1, Priority priority = NORMAL) {
+        ScheduleTask *task = NewTask(std::move(fc), thread, priority);
+        if (task) {
+            scheduleTask(task);
         }
+    }
 
-        if (need_tickle) {
-            tickle(); // 唤醒idle协程
+    // 批量添加调度任务，只加一次锁，只tickle一次，其余空闲线程由取到任务的线程依次唤醒
+    // InputIterator 迭代器类型，元素为协程对象或可调用对象，传入move_iterator时元素会被移动而不是复制
+    // begin end 任务范围
+    // thread 指定运行这批任务的线程号，-1表示任意线程
+    // priority 这批任务的优先级
+    template <class InputIterator>
+    void scheduleBatch(InputIterator begin, InputIterator end, int thread = -1, Priority priority = NORMAL) {
+        TaskQueue tasks;
+        for (; begin != end; ++begin) {
+            ScheduleTask *task = NewTask(*begin, thread, priority);
+            if (!task) {
+                continue;
+            }
+            if (task->thread != thread) {
+                // 绑定了线程的共享栈协程单独投递到它的线程
+                scheduleTask(task);
+            } else if (!deferWake(task)) {
+                tasks.push(task);
+            }
         }
+        scheduleTasks(tasks, thread, priority);
     }
 
+    bool isElastic() const { return m_elastic; }
+
+    // 当前的工作线程数，不包含use_caller的主线程
+    size_t getThreadCount() const { return m_threadCount; }
+
+    // 获取统计数据的快照，可以在任意线程随时调用，读取的是各线程计数的近似值
+    Stats getStats() const;
+
+    // 统计默认开启，关闭后只保留队列长度的统计
+    void setStatsEnabled(bool v) { m_statsEnabled = v; }
+
+    bool isStatsEnabled() const { return m_statsEnabled; }
+
+    // 设置每个调度线程缓存已结束协程的水位，缓存数超过high时释放到只剩low个，high为0表示不缓存
+    void setFiberPoolWatermarks(size_t low, size_t high);
+
     void start();
 
     // 停止调度器，等所有调度任务都执行完了再返回
@@ -52,6 +220,10 @@ protected:
     // 通知协程调度器有任务了
     virtual void tickle();
 
+    // 只通知指定的线程，用于唤醒信箱里有新任务的线程，默认退化为tickle()
+    // thread 线程id
+    virtual void tickleThread(int thread);
+
     // 协程调度函数
     void run();
 
@@ -67,52 +239,285 @@ protected:
     // 当调度协程进入idle时空闲线程数加1，从idle协程返回时空闲线程数减1
     bool hasIdleThreads() { return m_idleThreadCount > 0; }
 
-private:
-    // 添加调度任务，无锁
-    // FiberOrCb 调度任务类型，可以是协程对象或函数指针
-    // fc 协程对象或指针
-    // thread 指定运行该任务的线程号，-1表示任意线程
-    template <class FiberOrCb>
-    bool scheduleNoLock(FiberOrCb fc, int thread) {
-        //往任务队列里加任务，need_tickle表示是否要唤醒，
-        //如果之前任务队列里是没有任务的，那此时加入任务就要唤醒
-        bool need_tickle = m_tasks.empty();
-        ScheduleTask task(fc, thread);
-        if (task.fiber || task.cb) {
-            m_tasks.push_back(task);
-        }
-        return need_tickle;
-    }
+    // 除当前线程以外是否还有空闲线程，idle协程里调度任务时当前线程自己也计在空闲线程数里
+    bool hasOtherIdleThreads();
+
+    // 当前线程是否是本调度器正在执行调度循环的线程，use_caller的主线程在run()之外时不算
+    bool isWorkerThread() const;
+
+    // 当前线程的信箱里是否有待执行的任务，idle阻塞前需要再检查一次
+    bool hasMailboxTask();
+
+    // 当前线程回到调度循环后是否还有任务马上可以执行，不加全局锁，只是估计
+    // 其他线程本地队列里的任务要靠窃取才能取到，不算在内
+    bool hasReadyTasks();
+
+    // 子类真正发出或收到tickle时调用，用于统计
+    void countTickleSent();
+    void countTickleReceived();
+
+    // 弹性线程池的空闲超时时间，未开启弹性线程池时返回0
+    uint64_t getIdleTimeout() const { return m_elastic ? m_idleTimeout : 0; }
+
+    // 弹性线程池中，当前工作线程空闲超过idle_timeout_ms且工作线程数多于下限时，让当前线程退出线程池
+    // 信箱里还有指定在本线程执行的任务时不退出，返回true时idle协程应该立即返回
+    bool retireIdleThread();
 
 private:
+    // Fiber在切出完成后通过ScheduleDeferredWake交回登记的唤醒
+    friend class Fiber;
+
     // 调度任务，协程/函数二选一，可指定在哪个线程上调度
+    // 任务节点从对象池分配，通过next串成侵入式链表，在队列之间移动时只移动指针，不复制任务内容
     struct ScheduleTask {
         Fiber::ptr fiber;
-        std::function<void()> cb;
-        int thread;
+        Callable cb;
+        int thread          = -1;
+        Priority priority   = NORMAL;
+        // 入队时间，GetMonotonicUS()，开启统计或弹性线程池时才记录
+        uint64_t enqueueTime = 0;
+        // 唤醒被登记在协程上时，切出完成后由这个调度器重新调度
+        Scheduler *scheduler = nullptr;
+        ScheduleTask *next  = nullptr;
 
-        ScheduleTask(Fiber::ptr f, int thr) {
-            fiber  = f;
-            thread = thr;
+        void reset() {
+            fiber       = nullptr;
+            cb          = nullptr;
+            thread      = -1;
+            priority    = NORMAL;
+            enqueueTime = 0;
+            scheduler   = nullptr;
+            next        = nullptr;
         }
-        //传指针用swap，防止一份资源被过多指针指向
-        ScheduleTask(Fiber::ptr *f, int thr) {
-            fiber.swap(*f);
-            thread = thr;
+    };
+
+    // 侵入式FIFO任务队列，本身不加锁
+    struct TaskQueue {
+        ScheduleTask *head = nullptr;
+        ScheduleTask *tail = nullptr;
+        size_t size        = 0;
+
+        bool empty() const { return head == nullptr; }
+
+        void push(ScheduleTask *task) {
+            task->next = nullptr;
+            if (tail) {
+                tail->next = task;
+            } else {
+                head = task;
+            }
+            tail = task;
+            ++size;
         }
-        ScheduleTask(std::function<void()> f, int thr) {
-            cb     = f;
-            thread = thr;
+
+        // 把other中的任务整体接到队尾，other被清空
+        void append(TaskQueue &other) {
+            if (other.empty()) {
+                return;
+            }
+            if (tail) {
+                tail->next = other.head;
+            } else {
+                head = other.head;
+            }
+            tail = other.tail;
+            size += other.size;
+            other.head = other.tail = nullptr;
+            other.size = 0;
         }
-        ScheduleTask() { thread = -1; }
 
-        void reset() {
-            fiber  = nullptr;
-            cb     = nullptr;
-            thread = -1;
+        // 移除prev之后的节点，prev为nullptr表示移除头节点
+        ScheduleTask *removeAfter(ScheduleTask *prev) {
+            ScheduleTask *task = prev ? prev->next : head;
+            if (prev) {
+                prev->next = task->next;
+            } else {
+                head = task->next;
+            }
+            if (tail == task) {
+                tail = prev;
+            }
+            task->next = nullptr;
+            --size;
+            return task;
+        }
+
+        ScheduleTask *pop() {
+            return head ? removeAfter(nullptr) : nullptr;
         }
     };
 
+    // 按优先级分级的任务队列，本身不加锁
+    struct RunQueue {
+        TaskQueue queues[PRIORITY_COUNT];
+        // 成功出队的次数，用来决定下一次先检查哪个优先级
+        uint64_t picks = 0;
+
+        bool empty() const {
+            for (auto &i : queues) {
+                if (!i.empty()) {
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        size_t size() const {
+            size_t n = 0;
+            for (auto &i : queues) {
+                n += i.size;
+            }
+            return n;
+        }
+
+        void push(ScheduleTask *task) { queues[task->priority].push(task); }
+
+        // 把other中的任务按优先级整体接到队尾，other被清空
+        void append(RunQueue &other) {
+            for (int i = 0; i < PRIORITY_COUNT; ++i) {
+                queues[i].append(other.queues[i]);
+            }
+        }
+
+        // 按防饿死策略填充本次出队时各优先级的检查顺序
+        // 所有优先级都有积压时，每16次出队CRITICAL先出12次，NORMAL先出3次，BACKGROUND先出1次
+        void order(int levels[PRIORITY_COUNT]) const {
+            int first = CRITICAL;
+            if (picks % 16 == 15) {
+                first = BACKGROUND;
+            } else if (picks % 4 == 3) {
+                first = NORMAL;
+            }
+            int n       = 0;
+            levels[n++] = first;
+            for (int i = 0; i < PRIORITY_COUNT; ++i) {
+                if (i != first) {
+                    levels[n++] = i;
+                }
+            }
+        }
+
+        // 移除level级队列中prev之后的节点，prev为nullptr表示移除头节点
+        ScheduleTask *removeAfter(int level, ScheduleTask *prev) {
+            ++picks;
+            return queues[level].removeAfter(prev);
+        }
+    };
+
+    // 每个调度线程的本地队列和信箱
+    struct Worker;
+    // 任务节点对象池
+    struct TaskPool;
+
+    // 从对象池取一个任务节点并填充，任务为空时返回nullptr
+    template <class FiberOrCb>
+    static ScheduleTask *NewTask(FiberOrCb &&fc, int thread, Priority priority) {
+        ScheduleTask *task = AllocTask();
+        SetTask(task, std::forward<FiberOrCb>(fc));
+        if (!task->fiber && !task->cb) {
+            FreeTask(task);
+            return nullptr;
+        }
+        task->thread   = thread;
+        task->priority = priority;
+        // 共享栈协程只能回到绑定的线程上运行
+        if (task->fiber && thread == -1) {
+            task->thread = task->fiber->getBoundThread();
+        }
+        return task;
+    }
+
+    static void SetTask(ScheduleTask *task, Fiber::ptr f) {
+        task->fiber = std::move(f);
+    }
+
+    //传指针用swap，防止一份资源被过多指针指向
+    static void SetTask(ScheduleTask *task, Fiber::ptr *f) {
+        task->fiber.swap(*f);
+    }
+
+    template <class F>
+    static typename std::enable_if<
+        !std::is_convertible<F, Fiber::ptr>::value && !std::is_convertible<F, Fiber::ptr *>::value>::type
+    SetTask(ScheduleTask *task, F &&f) {
+        task->cb = Callable(std::forward<F>(f));
+    }
+
+    static ScheduleTask *AllocTask();
+
+    // 归还任务节点，同时释放节点持有的协程和回调
+    static void FreeTask(ScheduleTask *task);
+
+    // 调度一个任务，协程还没切出完成时先把唤醒登记在协程上，否则交给dispatchTask
+    void scheduleTask(ScheduleTask *task);
+
+    // 根据thread和调度模式将任务放入信箱、本地队列或全局队列
+    void dispatchTask(ScheduleTask *task);
+
+    // 任务的协程正在运行或正在切出时，把任务登记到协程上，等切出完成后再入队
+    // 返回true表示任务已经被登记或合并，调用方不能再使用这个任务节点
+    bool deferWake(ScheduleTask *task);
+
+    // 协程切出完成后由resume的调用方调用，把登记的任务放入队列
+    static void ScheduleDeferredWake(void *wake);
+
+    // 当前线程是本调度器的调度线程时，将任务放入本地队列
+    // 返回false表示当前线程不是本调度器的调度线程，任务需要放入全局队列
+    bool scheduleLocal(ScheduleTask *task);
+
+    // 将指定了线程的任务放入目标线程的信箱，目标线程空闲时只唤醒它
+    // 返回false表示目标线程不属于本调度器或还未开始调度，任务需要放入全局队列
+    bool scheduleMailbox(ScheduleTask *task);
+
+    // 将任务放入全局队列，如果之前全局队列为空则tickle
+    void scheduleGlobal(ScheduleTask *task);
+
+    // 批量放入同一优先级的任务，根据thread和调度模式选择信箱、本地队列或全局队列，只加一次锁
+    void scheduleTasks(TaskQueue &tasks, int thread, Priority priority);
+
+    // 从当前线程的协程池取一个协程执行cb，池为空时新建
+    // key 任务回调的类型名，用于栈用量统计和自适应栈大小
+    Fiber::ptr acquireFiber(Worker *worker, std::function<void()> cb, bool stats, const char *key);
+
+    // 把执行完的协程放回当前线程的协程池，fiber被其他地方持有或不是默认栈大小时不回收
+    void releaseFiber(Worker *worker, Fiber::ptr &fiber);
+
+    // 查找线程id对应的Worker，不属于本调度器时返回nullptr
+    Worker *getWorker(int thread);
+
+    // 从全局队列取一个可以在当前线程执行的任务
+    ScheduleTask *takeGlobal(bool &tickle_me);
+
+    // 按优先级顺序从queue中取出第一个任务，调用者负责加锁
+    static ScheduleTask *TakeRunnable(RunQueue &queue);
+
+    // 从当前线程的信箱取一个任务
+    ScheduleTask *takeMailbox();
+
+    // 从本地队列取一个任务
+    ScheduleTask *takeLocal(bool &tickle_me);
+
+    // 随机挑选其他调度线程，窃取其本地队列中的一半任务
+    ScheduleTask *steal(bool &tickle_me);
+
+    // 为当前线程占用一个空闲的Worker，返回其下标
+    size_t claimWorker();
+
+    // 弹性线程池中，任务的排队时间持续超过阈值且没有空闲线程时增加一个工作线程
+    // enqueue_time 刚取出的任务的入队时间
+    // now 当前时间，GetMonotonicUS()
+    void checkGrow(uint64_t enqueue_time, uint64_t now);
+
+    // 任务执行完后记录当前线程的执行次数、执行时间和运行时长分布
+    // start 开始执行的时间，GetMonotonicUS()
+    static void RecordRun(Worker *worker, uint64_t start);
+
+    // 新建一个工作线程，调用者需持有m_mutex
+    void addThread();
+
+    // 按绑定策略为每个Worker计算要绑定的CPU和NUMA节点
+    void initAffinity(const AffinityConfig &affinity);
+
 private:
     // 协程调度器名称
     std::string m_name;
@@ -120,12 +525,51 @@ private:
     MutexType m_mutex;
     // 线程池
     std::vector<Thread::ptr> m_threads;
-    // 任务队列
-    std::list<ScheduleTask> m_tasks;
+    // 任务队列，工作窃取模式下作为全局注入队列
+    RunQueue m_tasks;
+    // 每个优先级排队中的任务数
+    std::atomic<size_t> m_queueDepth[PRIORITY_COUNT];
+    // 是否开启统计
+    std::atomic<bool> m_statsEnabled = {true};
+    // 不属于本调度器的线程发出的tickle数
+    std::atomic<uint64_t> m_externalTickles = {0};
+    // 协程池的低水位和高水位
+    std::atomic<size_t> m_fiberPoolLow  = {16};
+    std::atomic<size_t> m_fiberPoolHigh = {64};
+    // 调度模式
+    Mode m_mode;
+    // 每个调度线程的本地队列和信箱，数量为最大工作线程数加上use_caller的主线程，use_caller时主线程固定使用下标0
+    // start之后数组大小不再变化，线程退出后它的Worker可以被新线程占用
+    std::vector<Worker *> m_workers;
+    // 所有本地队列和信箱中的任务总数
+    std::atomic<size_t> m_localTaskCount = {0};
     // 线程池的线程ID数组
     std::vector<int> m_threadIds;
-    // 工作线程数量，不包含use_caller的主线程
-    size_t m_threadCount = 0;
+    // 工作线程数量，不包含use_caller的主线程，弹性线程池中会动态变化
+    std::atomic<size_t> m_threadCount = {0};
+    // 已经创建过的工作线程数，用于给新线程命名
+    size_t m_threadSeq = 0;
+    // 每个Worker绑定的CPU，与m_workers一一对应，-1表示不绑定，线程占用Worker时绑定到对应的CPU
+    std::vector<int> m_workerCpus;
+    // 每个Worker使用的NUMA节点，-1表示不指定，只有一个节点时不指定
+    std::vector<int> m_workerNodes;
+
+    // 是否开启弹性线程池
+    bool m_elastic = false;
+    // 弹性线程池的工作线程数下限
+    size_t m_minThreads = 0;
+    // 弹性线程池的工作线程数上限
+    size_t m_maxThreads = 0;
+    // 触发扩容的排队时间阈值，微秒
+    uint64_t m_growWait = 0;
+    // 工作线程空闲多久后退出，毫秒
+    uint64_t m_idleTimeout = 0;
+    // 排队时间开始持续超过阈值的时间，微秒，0表示当前没有超过
+    std::atomic<uint64_t> m_slowSince = {0};
+    // 已经退出线程池的线程，等下次扩容或stop时回收
+    std::vector<Thread::ptr> m_retiredThreads;
+    // 已经退出线程池的线程id，之后指定在这些线程上执行的任务改为由任意线程执行
+    std::set<int> m_retiredThreadIds;
     // 活跃线程数
     std::atomic<size_t> m_activeThreadCount = {0};
     // idle线程数
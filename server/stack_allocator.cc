@@ -0,0 +1,217 @@
+#include <sys/mman.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <fstream>
+#include <vector>
+#include "stack_allocator.h"
+#include "log.h"
+#include "macro.h"
+#include "mutex.h"
+
+namespace will {
+
+static Logger::ptr g_logger = WILL_LOG_NAME("system");
+
+// 最小规格4KB，最大规格2^(MIN_SHIFT + CLASSES - 1)，更大的栈单独映射
+static const int MIN_SHIFT = 12;
+static const int CLASSES   = 16;
+// 每次映射的区域大小，规格较大时一个区域至少放一个栈
+static const size_t REGION_SIZE = 8 * 1024 * 1024;
+// 线程缓存与全局空闲链表之间每次转移的栈数
+static const size_t BATCH = 16;
+// 给进程其他部分(malloc、线程栈、动态库等)保留的VMA数
+static const int64_t RESERVED_MAPS = 8192;
+
+static std::atomic<bool> s_huge_pages{false};
+static std::atomic<uint64_t> s_mapped_bytes{0};
+static std::atomic<uint64_t> s_used_stacks{0};
+// 还可以设置保护页的栈数
+static std::atomic<int64_t> s_guard_budget{-1};
+
+static size_t GetPageSize() {
+    static size_t s_page_size = sysconf(_SC_PAGESIZE);
+    return s_page_size;
+}
+
+// 每个保护页多占两个VMA，超过vm.max_map_count后包括malloc在内的所有mmap都会失败，
+// 所以只在预算内设置保护页，预算用完后的栈没有保护页，其他功能不受影响
+static bool TakeGuardBudget() {
+    if (WILL_UNLIKELY(s_guard_budget.load(std::memory_order_relaxed) < 0)) {
+        int64_t max_map_count = 65530;
+        std::ifstream ifs("/proc/sys/vm/max_map_count");
+        ifs >> max_map_count;
+        int64_t expected = -1;
+        s_guard_budget.compare_exchange_strong(expected, std::max((int64_t)0, (max_map_count - RESERVED_MAPS) / 2));
+    }
+    if (s_guard_budget.fetch_sub(1) > 0) {
+        return true;
+    }
+    s_guard_budget = 0;
+    static std::atomic<bool> s_warned{false};
+    if (!s_warned.exchange(true)) {
+        WILL_LOG_WARN(g_logger) << "stack guard page budget exhausted, new stacks have no guard page, "
+                                   "raise vm.max_map_count for more";
+    }
+    return false;
+}
+
+// 返回size所属的规格，超过最大规格时返回-1
+static int GetSizeClass(size_t size) {
+    int shift = MIN_SHIFT;
+    while (((size_t)1 << shift) < size) {
+        ++shift;
+    }
+    return shift - MIN_SHIFT < CLASSES ? shift - MIN_SHIFT : -1;
+}
+
+static size_t GetClassSize(int cls) {
+    return (size_t)1 << (cls + MIN_SHIFT);
+}
+
+// 映射count个带保护页的栈，栈的低地址依次放入out
+static bool MapStacks(size_t stack_size, size_t count, std::vector<void *> &out) {
+    size_t page  = GetPageSize();
+    size_t slot  = stack_size + page;
+    size_t bytes = slot * count;
+    // MAP_NORESERVE：只有真正写到的页才占用内存，没用到的栈空间不计入RSS
+    void *base = mmap(nullptr, bytes, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (base == MAP_FAILED) {
+        WILL_LOG_ERROR(g_logger) << "mmap stack region fail, bytes=" << bytes << " errno=" << errno;
+        return false;
+    }
+    if (s_huge_pages.load(std::memory_order_relaxed)) {
+        madvise(base, bytes, MADV_HUGEPAGE);
+    }
+    for (size_t i = 0; i < count; ++i) {
+        char *guard = (char *)base + i * slot;
+        // 栈向低地址增长，保护页放在低地址一侧
+        if (TakeGuardBudget() && mprotect(guard, page, PROT_NONE)) {
+            WILL_LOG_ERROR(g_logger) << "mprotect stack guard page fail, errno=" << errno;
+        }
+        out.push_back(guard + page);
+    }
+    s_mapped_bytes += bytes;
+    return true;
+}
+
+namespace {
+
+struct GlobalFreeList {
+    Mutex mutex;
+    std::vector<void *> stacks;
+};
+
+static GlobalFreeList s_global[CLASSES];
+
+// 线程缓存是否已经析构，普通bool没有析构函数，线程退出的任何阶段都可以读
+// 线程局部变量按构造的逆序析构，比t_cache先构造的对象(比如共享栈)析构时t_cache已经不在了
+static thread_local bool t_cache_destroyed = false;
+
+// 释放物理内存后把一批栈归还到全局空闲链表，映射保留下来复用
+static void ReturnToGlobal(int cls, void *const *first, void *const *last) {
+    size_t stack_size = GetClassSize(cls);
+    for (void *const *i = first; i != last; ++i) {
+        madvise(*i, stack_size, MADV_DONTNEED);
+    }
+    GlobalFreeList &global = s_global[cls];
+    Mutex::Lock lock(global.mutex);
+    global.stacks.insert(global.stacks.end(), first, last);
+}
+
+// 每个线程按规格缓存的空闲栈，线程退出时全部归还到全局空闲链表
+struct Cache {
+    std::vector<void *> stacks[CLASSES];
+
+    ~Cache() {
+        t_cache_destroyed = true;
+        for (int i = 0; i < CLASSES; ++i) {
+            if (stacks[i].empty()) {
+                continue;
+            }
+            Mutex::Lock lock(s_global[i].mutex);
+            s_global[i].stacks.insert(s_global[i].stacks.end(), stacks[i].begin(), stacks[i].end());
+        }
+    }
+};
+
+static thread_local Cache t_cache;
+
+} // namespace
+
+void *StackAllocator::Alloc(size_t size) {
+    int cls = GetSizeClass(size);
+    if (cls < 0) {
+        // 超过最大规格的栈单独映射，按页取整
+        size_t page = GetPageSize();
+        std::vector<void *> out;
+        if (!MapStacks((size + page - 1) / page * page, 1, out)) {
+            return nullptr;
+        }
+        ++s_used_stacks;
+        return out[0];
+    }
+
+    std::vector<void *> &cache = t_cache.stacks[cls];
+    if (WILL_UNLIKELY(cache.empty())) {
+        GlobalFreeList &global = s_global[cls];
+        Mutex::Lock lock(global.mutex);
+        size_t n = std::min(BATCH, global.stacks.size());
+        cache.insert(cache.end(), global.stacks.end() - n, global.stacks.end());
+        global.stacks.resize(global.stacks.size() - n);
+    }
+    if (WILL_UNLIKELY(cache.empty())) {
+        size_t stack_size = GetClassSize(cls);
+        size_t count      = std::max((size_t)1, REGION_SIZE / (stack_size + GetPageSize()));
+        if (!MapStacks(stack_size, count, cache)) {
+            return nullptr;
+        }
+    }
+    void *vp = cache.back();
+    cache.pop_back();
+    ++s_used_stacks;
+    return vp;
+}
+
+void StackAllocator::Dealloc(void *vp, size_t size) {
+    if (!vp) {
+        return;
+    }
+    --s_used_stacks;
+    int cls = GetSizeClass(size);
+    if (cls < 0) {
+        size_t page  = GetPageSize();
+        size_t bytes = (size + page - 1) / page * page + page;
+        munmap((char *)vp - page, bytes);
+        s_mapped_bytes -= bytes;
+        return;
+    }
+
+    if (WILL_UNLIKELY(t_cache_destroyed)) {
+        // 线程退出时线程缓存已经析构，直接还给全局空闲链表
+        ReturnToGlobal(cls, &vp, &vp + 1);
+        return;
+    }
+    std::vector<void *> &cache = t_cache.stacks[cls];
+    cache.push_back(vp);
+    if (WILL_UNLIKELY(cache.size() >= 2 * BATCH)) {
+        // 归还到全局的栈短时间内不会再用，先释放物理内存
+        ReturnToGlobal(cls, cache.data() + cache.size() - BATCH, cache.data() + cache.size());
+        cache.resize(cache.size() - BATCH);
+    }
+}
+
+void StackAllocator::SetTransparentHugePages(bool v) {
+    s_huge_pages = v;
+}
+
+uint64_t StackAllocator::GetMappedBytes() {
+    return s_mapped_bytes;
+}
+
+uint64_t StackAllocator::GetUsedStacks() {
+    return s_used_stacks;
+}
+
+} // namespace will
@@ -0,0 +1,35 @@
+#ifndef __WILL_STACK_ALLOCATOR_H__
+#define __WILL_STACK_ALLOCATOR_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace will {
+
+// 协程栈分配器，从大块mmap区域中切出协程栈，每个栈的低地址一侧有一个PROT_NONE的保护页，栈溢出时立即SIGSEGV而不是悄悄破坏堆
+// 栈大小向上取整到2的幂作为规格，每个线程按规格缓存一批空闲栈，缓存超过上限时整批归还到全局空闲链表，
+// 归还到全局的栈会用MADV_DONTNEED释放物理内存，大量连接结束后RSS可以回落
+// 每个保护页都会把映射拆成单独的VMA，保护页的数量受vm.max_map_count限制，超过后新映射的栈不再设置保护页，
+// 几十万个协程都需要保护页时要相应调大vm.max_map_count
+class StackAllocator {
+public:
+    // 分配至少size字节的栈，返回栈的低地址
+    static void *Alloc(size_t size);
+
+    // 归还Alloc分配的栈，size必须与分配时相同
+    static void Dealloc(void *vp, size_t size);
+
+    // 新映射的区域是否使用透明大页，默认关闭，只对之后新映射的区域生效
+    // 保护页会拆分大页，只有栈规格不小于2MB时才有意义
+    static void SetTransparentHugePages(bool v);
+
+    // 已经映射的字节数，包含保护页
+    static uint64_t GetMappedBytes();
+
+    // 正在被协程使用的栈数
+    static uint64_t GetUsedStacks();
+};
+
+} // namespace will
+
+#endif
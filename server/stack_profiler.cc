@@ -0,0 +1,151 @@
+#include <cxxabi.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <sstream>
+#include <unordered_map>
+#include "stack_profiler.h"
+#include "fiber.h"
+#include "mutex.h"
+
+namespace will {
+
+// 涂栈用的字节，栈上的正常数据很少恰好是连续的0xa5
+static const uint8_t PAINT_BYTE  = 0xa5;
+static const uint64_t PAINT_WORD = 0xa5a5a5a5a5a5a5a5ULL;
+// 自适应模式下最小的栈大小，给信号处理、日志和hook留出空间
+static const size_t MIN_ADAPTIVE_STACK = 16 * 1024;
+
+static std::atomic<bool> s_enabled{false};
+static std::atomic<bool> s_adaptive{false};
+static std::atomic<size_t> s_margin{8 * 1024};
+static std::atomic<uint64_t> s_min_samples{100};
+
+namespace {
+
+struct UsageTable {
+    RWMutex mutex;
+    // key为入口类型名(未demangle)或servlet名
+    std::unordered_map<std::string, StackProfiler::Usage> usages;
+};
+
+// 函数内静态变量，协程在其他全局对象析构时结束也能安全访问
+static UsageTable &GetTable() {
+    static UsageTable *s_table = new UsageTable;
+    return *s_table;
+}
+
+} // namespace
+
+static std::string Demangle(const std::string &name) {
+    int status = 0;
+    char *str  = abi::__cxa_demangle(name.c_str(), nullptr, nullptr, &status);
+    if (status != 0 || !str) {
+        return name;
+    }
+    std::string rt(str);
+    free(str);
+    return rt;
+}
+
+// 按用量推荐的栈大小，不超过默认栈大小
+static size_t SuggestSize(const StackProfiler::Usage &usage) {
+    size_t need = usage.maxUsed + s_margin.load(std::memory_order_relaxed);
+    size_t size = MIN_ADAPTIVE_STACK;
+    while (size < need) {
+        size <<= 1;
+    }
+    return std::min(size, (size_t)Fiber::GetDefaultStackSize());
+}
+
+void StackProfiler::SetEnabled(bool v) {
+    s_enabled = v;
+}
+
+bool StackProfiler::IsEnabled() {
+    return s_enabled.load(std::memory_order_relaxed);
+}
+
+void StackProfiler::SetAdaptive(bool v, size_t margin, uint64_t min_samples) {
+    s_margin      = margin;
+    s_min_samples = min_samples;
+    s_adaptive    = v;
+}
+
+bool StackProfiler::IsAdaptive() {
+    return s_adaptive.load(std::memory_order_relaxed);
+}
+
+size_t StackProfiler::GetStackSize(const char *key) {
+    if (!IsAdaptive() || !key) {
+        return 0;
+    }
+    UsageTable &table = GetTable();
+    RWMutex::ReadLock lock(table.mutex);
+    auto it = table.usages.find(key);
+    if (it == table.usages.end() || it->second.samples < s_min_samples.load(std::memory_order_relaxed)) {
+        return 0;
+    }
+    return SuggestSize(it->second);
+}
+
+void StackProfiler::Paint(void *stack, size_t size) {
+    memset(stack, PAINT_BYTE, size);
+}
+
+size_t StackProfiler::Scan(const void *stack, size_t size) {
+    // 栈向低地址增长，从低地址往上第一个不是涂栈字节的位置就是用到的最深处，栈的低地址按页对齐，可以按8字节比较
+    const uint64_t *p   = (const uint64_t *)stack;
+    const uint64_t *end = p + size / sizeof(uint64_t);
+    while (p < end && *p == PAINT_WORD) {
+        ++p;
+    }
+    const uint8_t *b = (const uint8_t *)p;
+    while (b < (const uint8_t *)stack + size && *b == PAINT_BYTE) {
+        ++b;
+    }
+    return (const uint8_t *)stack + size - b;
+}
+
+void StackProfiler::Record(const std::string &key, size_t used, size_t stack_size) {
+    UsageTable &table = GetTable();
+    RWMutex::WriteLock lock(table.mutex);
+    Usage &usage    = table.usages[key];
+    usage.samples  += 1;
+    usage.maxUsed   = std::max(usage.maxUsed, (uint64_t)used);
+    usage.sumUsed  += used;
+    usage.stackSize = stack_size;
+}
+
+std::map<std::string, StackProfiler::Usage> StackProfiler::GetUsage() {
+    std::map<std::string, Usage> rt;
+    UsageTable &table = GetTable();
+    RWMutex::ReadLock lock(table.mutex);
+    for (auto &i : table.usages) {
+        rt[Demangle(i.first)] = i.second;
+    }
+    return rt;
+}
+
+void StackProfiler::Reset() {
+    UsageTable &table = GetTable();
+    RWMutex::WriteLock lock(table.mutex);
+    table.usages.clear();
+}
+
+std::string StackProfiler::Dump() {
+    std::stringstream ss;
+    for (auto &i : GetUsage()) {
+        const Usage &usage = i.second;
+        ss << i.first
+           << " samples=" << usage.samples
+           << " max=" << usage.maxUsed
+           << " avg=" << (usage.samples ? usage.sumUsed / usage.samples : 0)
+           << " stack=" << usage.stackSize
+           << " suggest=" << SuggestSize(usage) << std::endl;
+    }
+    return ss.str();
+}
+
+} // namespace will
@@ -0,0 +1,66 @@
+#ifndef __WILL_STACK_PROFILER_H__
+#define __WILL_STACK_PROFILER_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <map>
+#include <string>
+
+namespace will {
+
+// 协程栈用量统计，开启后新分配的栈整个涂上固定字节，协程结束时从栈的低地址往上找第一个被改写的字节，得到栈用量的高水位
+// 统计按协程入口函数的类型聚合，HTTP请求另外按servlet名字聚合，用来确定各类协程实际需要多大的栈
+// 涂栈会写满整个栈，所有页都会计入RSS，只适合在压测或灰度时打开
+// 自适应模式下，不指定栈大小的新协程按同一入口的历史最大用量加上安全余量选择栈规格，样本不够时仍使用默认栈大小
+// 自适应选出的栈比默认栈小，某次调用的栈用量超过历史最大值加余量时会踩到保护页，余量要按业务留足
+class StackProfiler {
+public:
+    // 某个入口的栈用量统计
+    struct Usage {
+        // 样本数
+        uint64_t samples   = 0;
+        // 最大用量，字节
+        uint64_t maxUsed   = 0;
+        // 用量之和，除以样本数得到平均用量
+        uint64_t sumUsed   = 0;
+        // 最近一个样本的栈大小
+        uint64_t stackSize = 0;
+    };
+
+    // 开启或关闭涂栈统计，只对之后分配的栈生效
+    static void SetEnabled(bool v);
+
+    static bool IsEnabled();
+
+    // 开启或关闭自适应栈大小
+    // margin 在历史最大用量上追加的安全余量，字节
+    // min_samples 入口的样本数达到这个值之后才按用量选择栈大小
+    static void SetAdaptive(bool v, size_t margin = 8 * 1024, uint64_t min_samples = 100);
+
+    static bool IsAdaptive();
+
+    // 按入口的历史用量推荐的栈大小，在16KB和默认栈大小之间取2的幂，样本不够或没有开启自适应时返回0
+    static size_t GetStackSize(const char *key);
+
+    // 把整个栈涂上固定字节
+    static void Paint(void *stack, size_t size);
+
+    // 涂过的栈从栈顶往下已经用到的字节数
+    static size_t Scan(const void *stack, size_t size);
+
+    // 记录一次栈用量，key为入口类型名或servlet名
+    static void Record(const std::string &key, size_t used, size_t stack_size);
+
+    // 返回各入口的统计，入口类型名已经demangle
+    static std::map<std::string, Usage> GetUsage();
+
+    // 清空统计
+    static void Reset();
+
+    // 按入口输出统计和推荐栈大小，每个入口一行
+    static std::string Dump();
+};
+
+} // namespace will
+
+#endif
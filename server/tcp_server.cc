@@ -14,7 +14,8 @@ TcpServer::TcpServer(will::IOManager* io_worker,
     ,m_recvTimeout(g_tcp_server_read_timeout)
     ,m_name("will/1.0.0")
     ,m_type("tcp")
-    ,m_isStop(true) {
+    ,m_isStop(true)
+    ,m_sharedStack(false) {
 }
 
 TcpServer::~TcpServer() {
@@ -71,8 +72,13 @@ void TcpServer::startAccept(Socket::ptr sock) {
         if(client) {
             client->setRecvTimeout(m_recvTimeout);
             //这里的bind是c++11用来绑定函数和参数的bind
-            m_ioWorker->schedule(std::bind(&TcpServer::handleClient,
+            if(m_sharedStack) {
+                m_ioWorker->schedule(Fiber::ptr(new Fiber(std::bind(&TcpServer::handleClient,
+                        shared_from_this(), client), 0, true, true)));
+            } else {
+                m_ioWorker->schedule(std::bind(&TcpServer::handleClient,
                         shared_from_this(), client));
+            }
         } else {
             WILL_LOG_ERROR(g_logger) << "accept errno=" << errno
                 << " errstr=" << strerror(errno);
@@ -85,9 +91,10 @@ bool TcpServer::start() {
         return true;
     }
     m_isStop = false;
+    // accept循环对延迟敏感，以CRITICAL优先级调度，不会被积压的普通任务拖慢
     for(auto& sock : m_socks) {
         m_acceptWorker->schedule(std::bind(&TcpServer::startAccept,
-                    shared_from_this(), sock));
+                    shared_from_this(), sock), -1, Scheduler::CRITICAL);
     }
     return true;
 }
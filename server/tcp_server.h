@@ -39,6 +39,12 @@ public:
 
     bool isStop() const { return m_isStop;}
 
+    // 连接处理协程是否运行在共享栈上，大量空闲长连接时可以大幅减少内存占用
+    // 共享栈上的连接不使用io_uring直接提交，IOManager使用io_uring后端时读写仍走epoll等待就绪
+    void setSharedStack(bool v) { m_sharedStack = v;}
+
+    bool isSharedStack() const { return m_sharedStack;}
+
     virtual std::string toString(const std::string& prefix = "");
 
 protected:
@@ -61,6 +67,8 @@ protected:
     std::string m_type;
     // 服务是否停止
     bool m_isStop;
+    // 连接处理协程是否运行在共享栈上
+    bool m_sharedStack;
 };
 
 }
@@ -3,8 +3,10 @@
 #include <time.h>
 #include <dirent.h>
 #include <signal.h>
+#include <sched.h>
 #include <sys/syscall.h>
 #include <sys/stat.h>
+#include <linux/mempolicy.h>
 #include <algorithm>
 #include "util.h"
 #include "log.h"
@@ -50,6 +52,12 @@ uint64_t GetCurrentUS() {
     return tv.tv_sec * 1000 * 1000ul + tv.tv_usec;
 }
 
+uint64_t GetMonotonicUS() {
+    struct timespec ts = {0};
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000 * 1000ul + ts.tv_nsec / 1000;
+}
+
 static int __lstat(const char *file, struct stat *st = nullptr) {
     struct stat lst;
     int ret = lstat(file, &lst);
@@ -66,4 +74,62 @@ bool Unlink(const std::string &filename, bool exist) {
     return ::unlink(filename.c_str()) == 0;
 }
 
+std::vector<int> GetAvailableCpus() {
+    std::vector<int> cpus;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(set), &set)) {
+        WILL_LOG_ERROR(g_logger) << "sched_getaffinity errno=" << errno << " errstr=" << strerror(errno);
+        return cpus;
+    }
+    for (int i = 0; i < CPU_SETSIZE; ++i) {
+        if (CPU_ISSET(i, &set)) {
+            cpus.push_back(i);
+        }
+    }
+    return cpus;
+}
+
+int GetCpuNode(int cpu) {
+    std::string path = "/sys/devices/system/cpu/cpu" + std::to_string(cpu);
+    DIR *dir         = opendir(path.c_str());
+    if (!dir) {
+        return 0;
+    }
+    int node = 0;
+    struct dirent *dp;
+    while ((dp = readdir(dir)) != nullptr) {
+        if (strncmp(dp->d_name, "node", 4) == 0 && isdigit(dp->d_name[4])) {
+            node = atoi(dp->d_name + 4);
+            break;
+        }
+    }
+    closedir(dir);
+    return node;
+}
+
+bool SetThreadAffinity(int cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    int rt = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (rt) {
+        WILL_LOG_ERROR(g_logger) << "pthread_setaffinity_np cpu=" << cpu << " rt=" << rt
+                                 << " errstr=" << strerror(rt);
+        return false;
+    }
+    return true;
+}
+
+bool SetThreadMemoryNode(int node) {
+    unsigned long mask = 1ul << node;
+    // 不依赖libnuma，直接调用系统调用
+    if (syscall(SYS_set_mempolicy, MPOL_PREFERRED, &mask, sizeof(mask) * 8)) {
+        WILL_LOG_ERROR(g_logger) << "set_mempolicy node=" << node << " errno=" << errno
+                                 << " errstr=" << strerror(errno);
+        return false;
+    }
+    return true;
+}
+
 } // namespace will
\ No newline at end of file
@@ -32,8 +32,23 @@ uint64_t GetCurrentMS();
 // 获取当前时间的微秒
 uint64_t GetCurrentUS();
 
+// 获取单调递增的微秒数，不受系统时间调整影响，用于计算时间间隔，参考clock_gettime(2)，使用CLOCK_MONOTONIC
+uint64_t GetMonotonicUS();
+
 bool Unlink(const std::string &filename, bool exist = false);
 
+// 获取当前线程允许运行的CPU编号，参考sched_getaffinity(2)
+std::vector<int> GetAvailableCpus();
+
+// 获取CPU所在的NUMA节点，读取/sys/devices/system/cpu/cpuN/nodeM，没有NUMA信息时返回0
+int GetCpuNode(int cpu);
+
+// 将当前线程绑定到指定CPU上，参考pthread_setaffinity_np(3)
+bool SetThreadAffinity(int cpu);
+
+// 当前线程之后的内存分配优先使用指定NUMA节点的内存，节点内存不足时回退到其他节点，参考set_mempolicy(2)
+bool SetThreadMemoryNode(int node);
+
 } // namespace will
 
 #endif // __WILL_UTIL_H__
@@ -8,9 +8,20 @@
 #include "noncopyable.h"
 #include "macro.h"
 #include "thread.h"
+#include "context.h"
 #include "fiber.h"
+#include "fiber_local.h"
+#include "stack_allocator.h"
+#include "stack_profiler.h"
+#include "histogram.h"
 #include "scheduler.h"
+#include "poller.h"
 #include "iomanager.h"
+#include "fiber_sync.h"
+#include "channel.h"
+#include "future.h"
+#include "parallel.h"
+#include "coro.h"
 #include "fd_manager.h"
 #include "hook.h"
 #include "endian.h"
@@ -0,0 +1,178 @@
+#include "../will/will.h"
+#include <fstream>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+static will::Logger::ptr g_logger = WILL_LOG_ROOT();
+
+static const size_t s_msg_size = 64;
+static const size_t s_buf_size = 256;
+
+static uint64_t get_rss() {
+    uint64_t size = 0, rss = 0;
+    std::ifstream ifs("/proc/self/statm");
+    ifs >> size >> rss;
+    return rss * sysconf(_SC_PAGESIZE);
+}
+
+// 已经接受的连接数，用来确认空闲连接都已经挂起在读上
+static std::atomic<size_t> s_accepted{0};
+
+// 在IOManager的协程里调用，hook过的socket会被FdMgr管理并设为非阻塞，两种服务端都可以用
+static int listen_local() {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    int on = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family      = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    WILL_ASSERT(bind(fd, (sockaddr *)&addr, sizeof(addr)) == 0);
+    WILL_ASSERT(listen(fd, 4096) == 0);
+    return fd;
+}
+
+static uint16_t get_port(int fd) {
+    sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    getsockname(fd, (sockaddr *)&addr, &len);
+    return ntohs(addr.sin_port);
+}
+
+// 每个连接一个协程，通过hook的read/write挂起
+static void fiber_server(int lfd) {
+    while (true) {
+        int fd = accept(lfd, nullptr, nullptr);
+        if (fd < 0) {
+            break;
+        }
+        ++s_accepted;
+        will::IOManager::GetThis()->schedule([fd]() {
+            char buf[s_buf_size];
+            while (true) {
+                ssize_t n = read(fd, buf, sizeof(buf));
+                if (n <= 0 || write(fd, buf, n) != n) {
+                    break;
+                }
+            }
+            close(fd);
+        });
+    }
+}
+
+// 每个连接一个Task，挂起时只保留协程帧
+static will::Task<> coro_echo(int fd) {
+    char buf[s_buf_size];
+    while (true) {
+        ssize_t n = co_await will::AsyncRead(fd, buf, sizeof(buf));
+        if (n <= 0 || co_await will::AsyncWrite(fd, buf, n) != n) {
+            break;
+        }
+    }
+    close(fd);
+}
+
+static will::Task<> coro_server(int lfd) {
+    while (true) {
+        int fd = co_await will::AsyncAccept(lfd);
+        if (fd < 0) {
+            break;
+        }
+        ++s_accepted;
+        will::Spawn(will::IOManager::GetThis(), coro_echo(fd));
+    }
+}
+
+// 客户端协程，每个连接来回发送rounds次消息，返回所有连接完成的耗时，不包含客户端调度器停止的时间
+static uint64_t run_clients(uint16_t port, size_t conns, size_t rounds) {
+    uint64_t start = will::GetCurrentUS();
+    will::WaitGroup wg;
+    wg.add(conns);
+    will::IOManager client(1, false, "client");
+    for (size_t i = 0; i < conns; ++i) {
+        client.schedule([&wg, port, rounds]() {
+            int fd = socket(AF_INET, SOCK_STREAM, 0);
+            int on = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+            sockaddr_in addr;
+            memset(&addr, 0, sizeof(addr));
+            addr.sin_family      = AF_INET;
+            addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+            addr.sin_port        = htons(port);
+            WILL_ASSERT(connect(fd, (sockaddr *)&addr, sizeof(addr)) == 0);
+            char msg[s_msg_size] = {0};
+            char buf[s_msg_size];
+            for (size_t r = 0; r < rounds; ++r) {
+                WILL_ASSERT(write(fd, msg, sizeof(msg)) == (ssize_t)sizeof(msg));
+                size_t got = 0;
+                while (got < sizeof(buf)) {
+                    ssize_t n = read(fd, buf + got, sizeof(buf) - got);
+                    WILL_ASSERT(n > 0);
+                    got += n;
+                }
+            }
+            close(fd);
+            wg.done();
+        });
+    }
+    wg.wait();
+    return will::GetCurrentUS() - start;
+}
+
+// 打开count个空闲连接，服务端的处理协程都挂起在读上，统计服务端每个连接的常驻内存
+static uint64_t idle_rss(uint16_t port, size_t count, std::vector<int> &fds) {
+    size_t accepted = s_accepted;
+    uint64_t rss = get_rss();
+    for (size_t i = 0; i < count; ++i) {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family      = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        addr.sin_port        = htons(port);
+        WILL_ASSERT(connect(fd, (sockaddr *)&addr, sizeof(addr)) == 0);
+        fds.push_back(fd);
+    }
+    while (s_accepted < accepted + count) {
+        usleep(1000);
+    }
+    usleep(100 * 1000);
+    return (get_rss() - rss) / count;
+}
+
+static void bench_echo(bool coro, size_t conns, size_t rounds, size_t idle) {
+    will::IOManager server(1, false, "server");
+    int lfd = will::Async(&server, listen_local).get();
+    uint16_t port = get_port(lfd);
+    if (coro) {
+        will::Spawn(&server, coro_server(lfd));
+    } else {
+        server.schedule(std::bind(fiber_server, lfd));
+    }
+
+    uint64_t used = run_clients(port, conns, rounds);
+
+    std::vector<int> fds;
+    uint64_t rss = idle_rss(port, idle, fds);
+    for (int fd : fds) {
+        close(fd);
+    }
+    // 关闭监听socket，等待中的accept被取消后服务端退出
+    server.schedule([lfd]() { close(lfd); });
+
+    WILL_LOG_INFO(g_logger) << "echo " << (coro ? "coroutine" : "fiber")
+                            << " conns=" << conns << " rounds=" << rounds
+                            << " used=" << used / 1000 << "ms"
+                            << " rps=" << (used ? conns * rounds * 1000000 / used : 0)
+                            << " idle_conns=" << idle << " rss/conn=" << rss;
+}
+
+int main(int argc, char **argv) {
+    size_t conns  = argc > 1 ? atoi(argv[1]) : 100;
+    size_t rounds = argc > 2 ? atoi(argv[2]) : 1000;
+    size_t idle   = argc > 3 ? atoi(argv[3]) : 5000;
+    bench_echo(false, conns, rounds, idle);
+    bench_echo(true, conns, rounds, idle);
+    return 0;
+}
@@ -0,0 +1,63 @@
+#include "../will/will.h"
+#include <sys/eventfd.h>
+#include <thread>
+
+static will::Logger::ptr g_logger = WILL_LOG_ROOT();
+
+// 每个线程一个协程，在各自的fd上反复addEvent，再用delEvent删除或用cancelEvent触发回调
+// 开启常驻注册，第一次之后不再调用epoll_ctl，测到的主要是FdContext的查找和fd上的加锁
+static uint64_t bench(size_t threads, size_t iters, bool trigger) {
+    std::vector<int> fds;
+    for (size_t i = 0; i < threads; ++i) {
+        fds.push_back(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC));
+    }
+    std::atomic<uint64_t> fired{0};
+    uint64_t start = 0;
+    {
+        will::IOManager iom(threads, false, "fdtable");
+        iom.setPersistentEvents(true);
+        will::WaitGroup wg;
+        wg.add(threads);
+        start = will::GetCurrentUS();
+        for (size_t t = 0; t < threads; ++t) {
+            int fd = fds[t];
+            iom.schedule([&iom, &wg, &fired, fd, iters, trigger]() {
+                for (size_t i = 0; i < iters; ++i) {
+                    iom.addEvent(fd, will::IOManager::READ, [&fired]() { ++fired; });
+                    if (trigger) {
+                        iom.cancelEvent(fd, will::IOManager::READ);
+                    } else {
+                        iom.delEvent(fd, will::IOManager::READ);
+                    }
+                }
+                iom.cancelAll(fd);
+                wg.done();
+            });
+        }
+        wg.wait();
+        while (trigger && fired < threads * iters) {
+            usleep(100);
+        }
+    }
+    uint64_t used = will::GetCurrentUS() - start;
+    for (int fd : fds) {
+        close(fd);
+    }
+    return used;
+}
+
+int main(int argc, char **argv) {
+    size_t iters       = argc > 1 ? atoi(argv[1]) : 200000;
+    size_t max_threads = argc > 2 ? atoi(argv[2]) : std::max(std::thread::hardware_concurrency(), 4u);
+    for (size_t threads = 1; threads <= max_threads; threads *= 2) {
+        uint64_t del_us     = bench(threads, iters, false);
+        uint64_t trigger_us = bench(threads, iters, true);
+        size_t ops          = threads * iters;
+        WILL_LOG_INFO(g_logger) << "threads=" << threads
+                                << " add+del=" << del_us * 1000 / ops << "ns/op"
+                                << " (" << ops * 1000000 / del_us << " ops/s)"
+                                << " add+trigger=" << trigger_us * 1000 / ops << "ns/op"
+                                << " (" << ops * 1000000 / trigger_us << " ops/s)";
+    }
+    return 0;
+}
@@ -0,0 +1,295 @@
+#include "../will/will.h"
+#include <sched.h>
+#include <sys/socket.h>
+#include <ucontext.h>
+#include <fstream>
+
+static will::Logger::ptr g_logger = WILL_LOG_ROOT();
+
+static const uint64_t s_switches = 1000000;
+static const size_t s_stack_size = 128 * 1024;
+
+static void report(const char *name, uint64_t used_us) {
+    WILL_LOG_INFO(g_logger) << name << " switches=" << s_switches
+                            << " used=" << used_us / 1000 << "ms"
+                            << " ns/switch=" << used_us * 1000 / s_switches;
+}
+
+// Fiber::resume/yield一来一回，使用编译时选择的上下文切换实现
+static void bench_fiber() {
+    will::Fiber::GetThis();
+    will::Fiber::ptr fiber(new will::Fiber([]() {
+        for (uint64_t i = 0; i < s_switches; ++i) {
+            will::Fiber::GetThis()->yield();
+        }
+    }, 0, false));
+    uint64_t start = will::GetCurrentUS();
+    for (uint64_t i = 0; i < s_switches; ++i) {
+        fiber->resume();
+    }
+    report(WILL_CONTEXT_ASM ? "fiber(asm)" : "fiber(ucontext)", will::GetCurrentUS() - start);
+    // 最后一次resume让协程执行完
+    fiber->resume();
+}
+
+static ucontext_t s_main_uctx;
+static ucontext_t s_uctx;
+
+static void ucontext_entry() {
+    while (true) {
+        swapcontext(&s_uctx, &s_main_uctx);
+    }
+}
+
+// 直接用swapcontext一来一回，每次切换都有一次rt_sigprocmask系统调用
+static void bench_ucontext() {
+    std::vector<char> stack(s_stack_size);
+    getcontext(&s_uctx);
+    s_uctx.uc_link          = nullptr;
+    s_uctx.uc_stack.ss_sp   = &stack[0];
+    s_uctx.uc_stack.ss_size = stack.size();
+    makecontext(&s_uctx, &ucontext_entry, 0);
+    uint64_t start = will::GetCurrentUS();
+    for (uint64_t i = 0; i < s_switches; ++i) {
+        swapcontext(&s_main_uctx, &s_uctx);
+    }
+    report("ucontext", will::GetCurrentUS() - start);
+}
+
+#if WILL_CONTEXT_ASM_SUPPORTED
+static will::Context s_main_ctx;
+static will::Context s_ctx;
+
+static void asm_entry() {
+    while (true) {
+        will::will_swap_context(&s_ctx, s_main_ctx);
+    }
+}
+
+// 直接用汇编实现一来一回，只保存被调用者保存的寄存器
+static void bench_asm() {
+    std::vector<char> stack(s_stack_size);
+    s_ctx = will::MakeContext(&stack[0], stack.size(), &asm_entry);
+    uint64_t start = will::GetCurrentUS();
+    for (uint64_t i = 0; i < s_switches; ++i) {
+        will::will_swap_context(&s_main_ctx, s_ctx);
+    }
+    report("asm", will::GetCurrentUS() - start);
+}
+#endif
+
+// 当前进程的常驻内存，字节
+static uint64_t get_rss() {
+    uint64_t size = 0, rss = 0;
+    std::ifstream ifs("/proc/self/statm");
+    ifs >> size >> rss;
+    return rss * sysconf(_SC_PAGESIZE);
+}
+
+// 同时挂起大量协程，统计每个协程的创建耗时和常驻内存
+static void bench_stacks(size_t count) {
+    will::Fiber::GetThis();
+    std::vector<will::Fiber::ptr> fibers;
+    fibers.reserve(count);
+    uint64_t rss   = get_rss();
+    uint64_t start = will::GetCurrentUS();
+    for (size_t i = 0; i < count; ++i) {
+        fibers.emplace_back(new will::Fiber([]() {
+            will::Fiber::GetThis()->yield();
+        }, 0, false));
+        fibers.back()->resume();
+    }
+    uint64_t used = will::GetCurrentUS() - start;
+    WILL_LOG_INFO(g_logger) << "stacks fibers=" << count
+                            << " ns/fiber=" << used * 1000 / count
+                            << " rss/fiber=" << (get_rss() - rss) / count
+                            << " mapped=" << will::StackAllocator::GetMappedBytes() / 1024 / 1024 << "MB"
+                            << " used_stacks=" << will::StackAllocator::GetUsedStacks();
+    for (auto &i : fibers) {
+        i->resume();
+    }
+}
+
+// 每个连接一个协程阻塞在hook的read上，比较独立栈和共享栈时每个空闲连接的常驻内存
+static void bench_idle_conns(size_t count, bool shared) {
+    std::atomic<size_t> parked{0}, done{0};
+    std::vector<int> fds;
+    uint64_t rss = get_rss();
+    uint64_t idle_rss = 0;
+    {
+        will::IOManager iom(2, false, "idle");
+        for (size_t i = 0; i < count; ++i) {
+            int sv[2];
+            if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv)) {
+                WILL_LOG_ERROR(g_logger) << "socketpair errno=" << errno;
+                break;
+            }
+            fds.push_back(sv[0]);
+            fds.push_back(sv[1]);
+            int fd = sv[0];
+            // socketpair没有被hook，手动登记，read才会走协程的IO等待
+            will::FdMgr::GetInstance()->get(fd, true);
+            iom.schedule(will::Fiber::ptr(new will::Fiber([fd, &parked, &done]() {
+                char buf[256];
+                ++parked;
+                read(fd, buf, sizeof(buf));
+                ++done;
+            }, 0, true, shared)));
+        }
+        count = fds.size() / 2;
+        while (parked < count) {
+            usleep(1000);
+        }
+        usleep(100 * 1000);
+        idle_rss = get_rss() - rss;
+        for (size_t i = 0; i < count; ++i) {
+            write(fds[i * 2 + 1], "x", 1);
+        }
+        while (done < count) {
+            usleep(1000);
+        }
+    }
+    for (int fd : fds) {
+        will::FdMgr::GetInstance()->del(fd);
+        close(fd);
+    }
+    WILL_LOG_INFO(g_logger) << "idle_conns shared_stack=" << shared
+                            << " conns=" << count
+                            << " rss/conn=" << (count ? idle_rss / count : 0);
+}
+
+// 模拟accept突发：调度线程被占住时一次投递count个连接协程，统计排队期间的常驻内存峰值
+static void bench_accept_storm(size_t count) {
+    std::atomic<bool> release{false};
+    std::atomic<size_t> done{0};
+    uint64_t rss = get_rss();
+    uint64_t peak = 0;
+    uint64_t start = will::GetCurrentUS();
+    {
+        will::Scheduler sc(1, false, "storm");
+        sc.start();
+        // 先占住唯一的调度线程，后面的连接协程都只能排队，调度线程开启了hook，不能用usleep
+        sc.schedule([&release]() {
+            while (!release) {
+                sched_yield();
+            }
+        });
+        for (size_t i = 0; i < count; ++i) {
+            sc.schedule(will::Fiber::ptr(new will::Fiber([&done]() {
+                char buf[1024];
+                memset(buf, 0, sizeof(buf));
+                ++done;
+            })));
+        }
+        peak = get_rss() - rss;
+        release = true;
+        while (done < count) {
+            usleep(1000);
+        }
+        sc.stop();
+    }
+    WILL_LOG_INFO(g_logger) << "accept_storm fibers=" << count
+                            << " queued_rss/fiber=" << peak / count
+                            << " used=" << (will::GetCurrentUS() - start) / 1000 << "ms"
+                            << " used_stacks=" << will::StackAllocator::GetUsedStacks();
+}
+
+static thread_local uint64_t t_counter = 0;
+static will::FiberLocal<uint64_t> s_counter;
+static will::FiberLocal<std::string> s_request_id;
+
+// 比较协程局部变量和thread_local的访问开销，并检查每个协程看到的是自己的值、结束时析构
+static void bench_fiber_local() {
+    static const uint64_t s_accesses = 10000000;
+    will::Fiber::GetThis();
+    uint64_t start = will::GetCurrentUS();
+    for (uint64_t i = 0; i < s_accesses; ++i) {
+        ++t_counter;
+        asm volatile("" ::: "memory");
+    }
+    uint64_t tl_used = will::GetCurrentUS() - start;
+    uint64_t fl_used = 0;
+    will::Fiber::ptr fiber(new will::Fiber([&fl_used]() {
+        s_request_id.set("req-1");
+        uint64_t start = will::GetCurrentUS();
+        for (uint64_t i = 0; i < s_accesses; ++i) {
+            ++*s_counter;
+            asm volatile("" ::: "memory");
+        }
+        fl_used = will::GetCurrentUS() - start;
+        will::Fiber::GetThis()->yield();
+        WILL_ASSERT(*s_counter == s_accesses && *s_request_id == "req-1");
+    }, 0, false));
+    fiber->resume();
+    // 主协程有自己的一份
+    WILL_ASSERT(!s_counter.has() && s_request_id->empty());
+    fiber->resume();
+    WILL_LOG_INFO(g_logger) << "fiber_local accesses=" << s_accesses
+                            << " thread_local ns/access=" << tl_used * 1000.0 / s_accesses
+                            << " fiber_local ns/access=" << fl_used * 1000.0 / s_accesses;
+}
+
+// 模拟一个栈用量约depth KB的请求处理函数
+static int use_stack(int depth) {
+    volatile char buf[1024];
+    buf[0] = (char)depth;
+    if (depth <= 1) {
+        return buf[0];
+    }
+    return use_stack(depth - 1) + buf[0];
+}
+
+// 先涂栈统计各入口的栈用量，再打开自适应栈大小，比较挂起同样多协程时的常驻内存
+static void bench_stack_profile(size_t count) {
+    will::Fiber::GetThis();
+    will::StackProfiler::SetEnabled(true);
+    auto entry = []() {
+        use_stack(6);
+        will::Fiber::GetThis()->yield();
+    };
+    for (int round = 0; round < 2; ++round) {
+        std::vector<will::Fiber::ptr> fibers;
+        fibers.reserve(count);
+        uint64_t rss = get_rss();
+        for (size_t i = 0; i < count; ++i) {
+            fibers.emplace_back(new will::Fiber(entry, 0, false));
+            fibers.back()->resume();
+        }
+        WILL_LOG_INFO(g_logger) << "stack_profile adaptive=" << will::StackProfiler::IsAdaptive()
+                                << " fibers=" << count
+                                << " stack=" << fibers.back()->getStackSize()
+                                << " rss/fiber=" << (get_rss() - rss) / count;
+        for (auto &i : fibers) {
+            i->resume();
+        }
+        will::StackProfiler::SetAdaptive(true);
+    }
+    {
+        // 调度器的回调协程按回调的类型统计
+        will::Scheduler sc(1, false, "profile");
+        sc.start();
+        for (int i = 0; i < 100; ++i) {
+            sc.schedule([]() { use_stack(3); });
+        }
+        sc.stop();
+    }
+    WILL_LOG_INFO(g_logger) << "stack usage:\n" << will::StackProfiler::Dump();
+    will::StackProfiler::SetAdaptive(false);
+    will::StackProfiler::SetEnabled(false);
+}
+
+int main(int argc, char **argv) {
+    bench_ucontext();
+#if WILL_CONTEXT_ASM_SUPPORTED
+    bench_asm();
+#endif
+    bench_fiber();
+    bench_fiber_local();
+    bench_stacks(argc > 1 ? atoi(argv[1]) : 20000);
+    size_t conns = argc > 2 ? atoi(argv[2]) : 5000;
+    bench_idle_conns(conns, false);
+    bench_idle_conns(conns, true);
+    bench_stack_profile(argc > 3 ? atoi(argv[3]) : 5000);
+    bench_accept_storm(argc > 4 ? atoi(argv[4]) : 50000);
+    return 0;
+}
@@ -6,6 +6,27 @@ static will::Logger::ptr g_logger = WILL_LOG_ROOT();
 
 will::IOManager::ptr worker;
 
+// 已经处理的请求数，用来计算每个请求的系统调用次数
+static std::atomic<uint64_t> s_requests{0};
+
+// 每5秒输出一次这段时间内每个请求平均的IO系统调用次数
+static void report_syscalls() {
+    static uint64_t last_requests = 0;
+    static will::IOManager::IoStats last;
+    will::IOManager::IoStats now = will::IOManager::GetThis()->getIoStats();
+    uint64_t requests = s_requests - last_requests;
+    if (requests) {
+        WILL_LOG_INFO(g_logger) << "requests=" << requests
+                                << " syscalls/req=" << (double)(now.syscalls() - last.syscalls()) / requests
+                                << " waits/req=" << (double)(now.waits - last.waits) / requests
+                                << " ctls/req=" << (double)(now.ctls - last.ctls) / requests
+                                << " ios/req=" << (double)(now.ios - last.ios) / requests
+                                << " tickles/req=" << (double)(now.tickles - last.tickles) / requests;
+    }
+    last_requests += requests;
+    last = now;
+}
+
 void run() {
     g_logger->setLevel(will::LogLevel::INFO);
     
@@ -16,11 +37,13 @@ void run() {
     }
     auto sd = server->getServletDispatch();
     sd->addServlet("/will/xx", [](will::http::HttpRequest::ptr req, will::http::HttpResponse::ptr rsp, will::http::HttpSession::ptr session) {
+        ++s_requests;
         rsp->setBody(req->toString());
         return 0;
     });
 
     sd->addGlobServlet("/will/*", [](will::http::HttpRequest::ptr req, will::http::HttpResponse::ptr rsp, will::http::HttpSession::ptr session) {
+        ++s_requests;
         rsp->setBody("Glob:\r\n" + req->toString());
         return 0;
     });
@@ -51,10 +74,18 @@ void run() {
     });
 
     server->start();
+
+    // 连接都由当前IOManager处理，系统调用也只统计它
+    will::IOManager::GetThis()->setStatsEnabled(true);
+    will::IOManager::GetThis()->addTimer(5000, report_syscalls, true);
 }
 
 int main(int argc, char **argv) {
     will::IOManager iom(1, true, "main");
+    // test_http persistent 使用常驻注册，对比每个请求的epoll_ctl次数
+    if (argc > 1 && std::string(argv[1]) == "persistent") {
+        iom.setPersistentEvents(true);
+    }
     worker.reset(new will::IOManager(3, false, "worker"));
     iom.schedule(run);
     return 0;
@@ -0,0 +1,104 @@
+#include "../will/will.h"
+#include <random>
+#include <thread>
+
+static will::Logger::ptr g_logger = WILL_LOG_ROOT();
+
+static const size_t s_bytes = 32 * 1024 * 1024;
+static const size_t s_sort  = 4 * 1000 * 1000;
+
+// 模拟压缩、校验这类逐字节的CPU计算
+static uint64_t checksum(const std::vector<uint8_t> &data, size_t begin, size_t end) {
+    uint64_t h = 14695981039346656037ull;
+    for (size_t i = begin; i < end; ++i) {
+        h = (h ^ data[i]) * 1099511628211ull;
+    }
+    return h;
+}
+
+struct Result {
+    uint64_t for_us    = 0;
+    uint64_t reduce_us = 0;
+    uint64_t sort_us   = 0;
+    uint64_t sum       = 0;
+};
+
+// 在threads个线程的调度器上跑一遍ParallelFor、ParallelReduce和ParallelSort
+// 调用方是调度器里的协程，和servlet里的用法一致
+static Result run(size_t threads, const std::vector<uint8_t> &data, const std::vector<uint32_t> &keys) {
+    Result rt;
+    will::Scheduler sc(threads, false, "parallel");
+    sc.start();
+    will::Promise<void> finished;
+    will::Future<void> future = finished.getFuture();
+    sc.schedule([&]() {
+        const size_t blocks = 256;
+        std::vector<uint64_t> sums(blocks);
+        uint64_t start = will::GetCurrentUS();
+        will::ParallelFor(&sc, 0, blocks, 1, [&](size_t b, size_t e) {
+            for (size_t i = b; i < e; ++i) {
+                sums[i] = checksum(data, i * data.size() / blocks, (i + 1) * data.size() / blocks);
+            }
+        });
+        rt.for_us = will::GetCurrentUS() - start;
+
+        start = will::GetCurrentUS();
+        rt.sum = will::ParallelReduce(&sc, 0, data.size(), 0, (uint64_t)0,
+            [&data](size_t b, size_t e) {
+                uint64_t sum = 0;
+                for (size_t i = b; i < e; ++i) {
+                    sum += data[i] * data[i];
+                }
+                return sum;
+            },
+            [](uint64_t a, uint64_t b) { return a + b; });
+        rt.reduce_us = will::GetCurrentUS() - start;
+
+        std::vector<uint32_t> sorted(keys);
+        start = will::GetCurrentUS();
+        will::ParallelSort(&sc, sorted.begin(), sorted.end());
+        rt.sort_us = will::GetCurrentUS() - start;
+        WILL_ASSERT(std::is_sorted(sorted.begin(), sorted.end()));
+        finished.setValue();
+    });
+    future.get();
+    sc.stop();
+    return rt;
+}
+
+int main(int argc, char **argv) {
+    size_t max_threads = argc > 1 ? atoi(argv[1]) : std::max(std::thread::hardware_concurrency(), 4u);
+
+    std::mt19937 rng(42);
+    std::vector<uint8_t> data(s_bytes);
+    for (auto &i : data) {
+        i = rng();
+    }
+    std::vector<uint32_t> keys(s_sort);
+    for (auto &i : keys) {
+        i = rng();
+    }
+
+    uint64_t expect = 0;
+    for (auto i : data) {
+        expect += i * i;
+    }
+    uint64_t start = will::GetCurrentUS();
+    std::vector<uint32_t> sorted(keys);
+    std::sort(sorted.begin(), sorted.end());
+    WILL_LOG_INFO(g_logger) << "serial std::sort=" << (will::GetCurrentUS() - start) / 1000 << "ms";
+
+    Result base;
+    for (size_t threads = 1; threads <= max_threads; threads *= 2) {
+        Result rt = run(threads, data, keys);
+        WILL_ASSERT(rt.sum == expect);
+        if (threads == 1) {
+            base = rt;
+        }
+        WILL_LOG_INFO(g_logger) << "threads=" << threads
+                                << " for=" << rt.for_us / 1000 << "ms x" << (double)base.for_us / rt.for_us
+                                << " reduce=" << rt.reduce_us / 1000 << "ms x" << (double)base.reduce_us / rt.reduce_us
+                                << " sort=" << rt.sort_us / 1000 << "ms x" << (double)base.sort_us / rt.sort_us;
+    }
+    return 0;
+}
@@ -0,0 +1,346 @@
+#include "../will/will.h"
+#include <atomic>
+#include <new>
+#include <thread>
+#include <fcntl.h>
+#include <unistd.h>
+
+static will::Logger::ptr g_logger = WILL_LOG_ROOT();
+
+// 统计operator new的调用次数，用来衡量每个任务的内存分配次数
+static std::atomic<uint64_t> s_allocs{0};
+
+void *operator new(size_t size) {
+    ++s_allocs;
+    void *p = malloc(size);
+    if (!p) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void operator delete(void *p) noexcept {
+    free(p);
+}
+
+// 外部线程投递的根任务数，每个根任务在调度线程内再派生s_fanout个子任务
+static const int s_roots  = 1000;
+static const int s_fanout = 100;
+
+static std::atomic<uint64_t> s_done{0};
+
+static void leaf() {
+    ++s_done;
+}
+
+static void root() {
+    will::Scheduler *sc = will::Scheduler::GetThis();
+    for (int i = 0; i < s_fanout; ++i) {
+        sc->schedule(&leaf);
+    }
+    ++s_done;
+}
+
+static void bench(const char *name, size_t threads, will::Scheduler::Mode mode) {
+    s_done = 0;
+    uint64_t start = will::GetCurrentUS();
+    {
+        will::Scheduler sc(threads, false, name, mode);
+        sc.start();
+        for (int i = 0; i < s_roots; ++i) {
+            sc.schedule(&root);
+        }
+        sc.stop();
+    }
+    uint64_t used = will::GetCurrentUS() - start;
+    WILL_LOG_INFO(g_logger) << name << " threads=" << threads
+                            << " tasks=" << s_done
+                            << " used=" << used / 1000 << "ms"
+                            << " tasks/s=" << (used ? s_done * 1000000 / used : 0);
+}
+
+// 模拟一次epoll_wait返回256个就绪事件，比较逐个schedule和scheduleBatch的开销
+static void bench_batch(const char *name, size_t threads, bool batch) {
+    static const int s_rounds = 2000;
+    static const int s_events = 256;
+    s_done = 0;
+    std::vector<std::function<void()>> cbs(s_events, &leaf);
+    uint64_t start = will::GetCurrentUS();
+    {
+        will::Scheduler sc(threads, false, name);
+        sc.start();
+        for (int i = 0; i < s_rounds; ++i) {
+            if (batch) {
+                sc.scheduleBatch(cbs.begin(), cbs.end());
+            } else {
+                for (auto &cb : cbs) {
+                    sc.schedule(cb);
+                }
+            }
+        }
+        sc.stop();
+    }
+    uint64_t used = will::GetCurrentUS() - start;
+    WILL_LOG_INFO(g_logger) << name << " threads=" << threads
+                            << " tasks=" << s_done
+                            << " used=" << used / 1000 << "ms"
+                            << " tasks/s=" << (used ? s_done * 1000000 / used : 0);
+}
+
+// 模拟TcpServer::startAccept -> handleClient的派发，回调捕获的内容与std::bind(&TcpServer::handleClient, shared_from_this(), client)相同
+class Server : public std::enable_shared_from_this<Server> {
+public:
+    void handleClient(std::shared_ptr<int> client) {
+        ++s_done;
+    }
+};
+
+static void bench_dispatch(size_t threads) {
+    static const int s_warmup = 10000;
+    static const int s_tasks  = 100000;
+    s_done = 0;
+    std::shared_ptr<Server> server(new Server);
+    std::shared_ptr<int> client(new int(0));
+    uint64_t allocs = 0;
+    uint64_t start  = 0;
+    {
+        will::Scheduler sc(threads, false, "dispatch");
+        sc.start();
+        for (int i = 0; i < s_warmup; ++i) {
+            sc.schedule(std::bind(&Server::handleClient, server->shared_from_this(), client));
+        }
+        while (s_done < (uint64_t)s_warmup) {
+            usleep(1000);
+        }
+        allocs = s_allocs;
+        start  = will::GetCurrentUS();
+        for (int i = 0; i < s_tasks; ++i) {
+            sc.schedule(std::bind(&Server::handleClient, server->shared_from_this(), client));
+        }
+        while (s_done < (uint64_t)(s_warmup + s_tasks)) {
+            usleep(1000);
+        }
+        allocs = s_allocs - allocs;
+        sc.stop();
+    }
+    uint64_t used = will::GetCurrentUS() - start;
+    WILL_LOG_INFO(g_logger) << "dispatch threads=" << threads
+                            << " tasks=" << s_tasks
+                            << " used=" << used / 1000 << "ms"
+                            << " allocs/task=" << (double)allocs / s_tasks;
+}
+
+// 比较开启和关闭统计时调度空任务的耗时，衡量统计本身的开销，结束时输出一次统计快照
+static void bench_stats(size_t threads, bool enabled) {
+    static const int s_rounds = 1000;
+    static const int s_tasks  = 200;
+    s_done = 0;
+    uint64_t start = 0;
+    uint64_t used  = 0;
+    {
+        will::IOManager iom(threads, false, "stats");
+        iom.setStatsEnabled(enabled);
+        start = will::GetCurrentUS();
+        for (int i = 0; i < s_rounds; ++i) {
+            for (int j = 0; j < s_tasks; ++j) {
+                iom.schedule(&leaf);
+            }
+        }
+        while (s_done < (uint64_t)(s_rounds * s_tasks)) {
+            usleep(100);
+        }
+        used = will::GetCurrentUS() - start;
+        if (enabled) {
+            WILL_LOG_INFO(g_logger) << iom.getStats().toString();
+        }
+    }
+    WILL_LOG_INFO(g_logger) << "stats enabled=" << enabled
+                            << " threads=" << threads
+                            << " tasks=" << s_done
+                            << " used=" << used / 1000 << "ms"
+                            << " ns/task=" << (s_done ? used * 1000 / s_done : 0);
+}
+
+// 协程刚注册完事件或刚把自己加入调度、还没来得及yield就被其他线程唤醒的竞争
+// 一半协程两两通过管道互相唤醒，与do_io的addEvent->yield流程相同，另一半协程不断把自己重新加入调度再yield
+static void bench_yield_race(size_t threads) {
+    static const int s_pairs  = 16;
+    static const int s_yields = 16;
+    static const int s_rounds = 5000;
+    s_done = 0;
+    uint64_t start = will::GetCurrentUS();
+    will::Scheduler::Stats stats;
+    {
+        will::IOManager iom(threads, false, "race");
+        std::vector<int> fds;
+        for (int i = 0; i < s_pairs; ++i) {
+            int a[2], b[2];
+            if (pipe2(a, O_NONBLOCK) || pipe2(b, O_NONBLOCK)) {
+                WILL_LOG_ERROR(g_logger) << "pipe2 errno=" << errno;
+                return;
+            }
+            fds.insert(fds.end(), {a[0], a[1], b[0], b[1]});
+            // 先注册读事件再唤醒对端，然后yield等待对端唤醒自己
+            auto ping = [&iom](int rfd, int wfd) {
+                char c = 0;
+                for (int j = 0; j < s_rounds; ++j) {
+                    iom.addEvent(rfd, will::IOManager::READ);
+                    write(wfd, &c, 1);
+                    will::Fiber::GetThis()->yield();
+                    read(rfd, &c, 1);
+                }
+                ++s_done;
+            };
+            iom.schedule(std::bind(ping, a[0], b[1]));
+            iom.schedule(std::bind(ping, b[0], a[1]));
+        }
+        for (int i = 0; i < s_yields; ++i) {
+            iom.schedule([&iom]() {
+                for (int j = 0; j < s_rounds; ++j) {
+                    iom.schedule(will::Fiber::GetThis());
+                    will::Fiber::GetThis()->yield();
+                }
+                ++s_done;
+            });
+        }
+        while (s_done < (uint64_t)(s_pairs * 2 + s_yields)) {
+            usleep(1000);
+        }
+        stats = iom.getStats();
+        iom.stop();
+        for (int fd : fds) {
+            close(fd);
+        }
+    }
+    uint64_t used = will::GetCurrentUS() - start;
+    uint64_t wasted = 0, deferred = 0;
+    for (auto &i : stats.threads) {
+        wasted += i.wastedScans;
+        deferred += i.deferredWakes;
+    }
+    uint64_t wakes = (uint64_t)(s_pairs * 2 + s_yields) * s_rounds;
+    WILL_LOG_INFO(g_logger) << "yield_race threads=" << threads
+                            << " wakes=" << wakes
+                            << " used=" << used / 1000 << "ms"
+                            << " wasted_scans=" << wasted
+                            << " deferred_wakes=" << deferred
+                            << " tickles_received=" << [&stats]() {
+                                   uint64_t n = 0;
+                                   for (auto &i : stats.threads) {
+                                       n += i.ticklesReceived;
+                                   }
+                                   return n;
+                               }();
+}
+
+// 两个线程同时唤醒同一个还在RUNNING的协程，一次登记为延迟唤醒，另一次合并丢弃
+// 每轮协程发布轮次后等两个线程都调用完schedule再yield，必须恰好被resume一次，唤醒丢失会卡住，重复resume会断言失败
+static void bench_double_wake(size_t threads) {
+    static const int s_rounds = 20000;
+    std::atomic<int> round{-1};
+    std::atomic<int> scheduled{0};
+    // 轮次发布之前写好，两个线程用acquire读到轮次之后再读
+    will::Fiber::ptr fiber;
+    std::atomic<bool> finished{false};
+    uint64_t resumes = 0;
+    uint64_t start   = will::GetCurrentUS();
+    will::Scheduler::Stats stats;
+    {
+        will::IOManager iom(threads, false, "double_wake");
+        auto waker = [&iom, &round, &scheduled, &fiber]() {
+            for (int r = 0; r < s_rounds; ++r) {
+                while (round.load(std::memory_order_acquire) < r) {
+                    sched_yield();
+                }
+                iom.schedule(fiber);
+                ++scheduled;
+            }
+        };
+        std::thread t1(waker), t2(waker);
+        iom.schedule([&round, &scheduled, &fiber, &resumes, &finished]() {
+            fiber = will::Fiber::GetThis();
+            for (int r = 0; r < s_rounds; ++r) {
+                round.store(r, std::memory_order_release);
+                while (scheduled.load(std::memory_order_acquire) < 2 * (r + 1)) {
+                    sched_yield();
+                }
+                will::Fiber::GetThis()->yield();
+                ++resumes;
+            }
+            finished = true;
+        });
+        t1.join();
+        t2.join();
+        while (!finished) {
+            usleep(1000);
+        }
+        stats = iom.getStats();
+    }
+    uint64_t used = will::GetCurrentUS() - start;
+    uint64_t deferred = 0;
+    for (auto &i : stats.threads) {
+        deferred += i.deferredWakes;
+    }
+    WILL_LOG_INFO(g_logger) << "double_wake threads=" << threads
+                            << " rounds=" << s_rounds
+                            << " resumes=" << resumes
+                            << " used=" << used / 1000 << "ms"
+                            << " deferred_wakes=" << deferred;
+}
+
+// 模拟每个连接一个回调协程、处理过程中会yield的场景，比较关闭和开启协程池时的耗时和命中率
+static void bench_fiber_pool(size_t threads, bool pool) {
+    static const int s_rounds = 2000;
+    static const int s_tasks  = 50;
+    s_done = 0;
+    uint64_t start = will::GetCurrentUS();
+    will::Scheduler::Stats stats;
+    {
+        will::IOManager iom(threads, false, "fiber_pool");
+        if (!pool) {
+            iom.setFiberPoolWatermarks(0, 0);
+        }
+        for (int i = 0; i < s_rounds; ++i) {
+            for (int j = 0; j < s_tasks; ++j) {
+                iom.schedule([&iom]() {
+                    iom.schedule(will::Fiber::GetThis());
+                    will::Fiber::GetThis()->yield();
+                    ++s_done;
+                });
+            }
+            while (s_done < (uint64_t)((i + 1) * s_tasks)) {
+                usleep(100);
+            }
+        }
+        stats = iom.getStats();
+    }
+    uint64_t used = will::GetCurrentUS() - start;
+    uint64_t hits = 0, misses = 0;
+    for (auto &i : stats.threads) {
+        hits += i.fiberPoolHits;
+        misses += i.fiberPoolMisses;
+    }
+    WILL_LOG_INFO(g_logger) << "fiber_pool enabled=" << pool
+                            << " threads=" << threads
+                            << " tasks=" << s_done
+                            << " used=" << used / 1000 << "ms"
+                            << " hits=" << hits
+                            << " misses=" << misses
+                            << " hit_rate=" << (hits + misses ? (double)hits / (hits + misses) : 0);
+}
+
+int main(int argc, char **argv) {
+    size_t threads = argc > 1 ? atoi(argv[1]) : 4;
+    bench("list", threads, will::Scheduler::LIST);
+    bench("work_stealing", threads, will::Scheduler::WORK_STEALING);
+    bench_batch("schedule", threads, false);
+    bench_batch("schedule_batch", threads, true);
+    bench_dispatch(threads);
+    bench_stats(threads, false);
+    bench_stats(threads, true);
+    bench_yield_race(threads);
+    bench_double_wake(threads);
+    bench_fiber_pool(threads, false);
+    bench_fiber_pool(threads, true);
+    return 0;
+}
@@ -0,0 +1,336 @@
+#include "../will/will.h"
+#include <atomic>
+
+static will::Logger::ptr g_logger = WILL_LOG_ROOT();
+
+static const size_t s_threads = 4;
+static const size_t s_fibers  = 200;
+static const size_t s_iters   = 1000;
+
+// 持锁期间让出执行权，模拟临界区里有IO等待
+static void yield_in_fiber() {
+    will::Fiber::ptr fiber = will::Fiber::GetThis();
+    will::Scheduler::GetThis()->schedule(fiber);
+    fiber->yield();
+}
+
+// s_fibers个协程在s_threads个线程上竞争同一把锁，每次加锁对计数器加一
+// 线程锁在协程里竞争时直接阻塞工作线程，持锁期间让出会让等锁的线程全部卡住，所以线程锁只测不让出的情况
+template <class MutexType>
+static void bench_mutex(const char *name, bool yield) {
+    MutexType mutex;
+    uint64_t counter = 0;
+    std::atomic<size_t> done{0};
+    std::atomic<uint64_t> end{0};
+    uint64_t start = will::GetCurrentUS();
+    {
+        will::IOManager iom(s_threads, false, name);
+        for (size_t i = 0; i < s_fibers; ++i) {
+            iom.schedule([&mutex, &counter, &done, &end, yield]() {
+                for (size_t j = 0; j < s_iters; ++j) {
+                    typename MutexType::Lock lock(mutex);
+                    ++counter;
+                    if (yield && j % 100 == 0) {
+                        yield_in_fiber();
+                    }
+                }
+                if (++done == s_fibers) {
+                    end = will::GetCurrentUS();
+                }
+            });
+        }
+    }
+    // 只统计到最后一个协程结束，不包含调度器停止的时间
+    uint64_t used = end - start;
+    WILL_ASSERT(counter == s_fibers * s_iters);
+    WILL_LOG_INFO(g_logger) << "mutex " << name << " yield_in_lock=" << yield
+                            << " threads=" << s_threads << " fibers=" << s_fibers
+                            << " locks=" << counter << " used=" << used / 1000 << "ms"
+                            << " ns/lock=" << used * 1000 / counter;
+}
+
+// 两组协程通过一对信号量交替运行，测一次挂起加唤醒的往返开销
+static void bench_semaphore() {
+    static const size_t s_rounds = 100000;
+    will::FiberSemaphore ping, pong;
+    uint64_t end   = 0;
+    uint64_t start = will::GetCurrentUS();
+    {
+        will::IOManager iom(2, false, "semaphore");
+        iom.schedule([&ping, &pong]() {
+            for (size_t i = 0; i < s_rounds; ++i) {
+                ping.notify();
+                pong.wait();
+            }
+        });
+        iom.schedule([&ping, &pong, &end]() {
+            for (size_t i = 0; i < s_rounds; ++i) {
+                ping.wait();
+                pong.notify();
+            }
+            end = will::GetCurrentUS();
+        });
+    }
+    uint64_t used = end - start;
+    WILL_LOG_INFO(g_logger) << "semaphore rounds=" << s_rounds
+                            << " used=" << used / 1000 << "ms"
+                            << " ns/round=" << used * 1000 / s_rounds;
+}
+
+// 生产者消费者，消费者带超时等待，最后一次等待一定超时
+static void bench_condition() {
+    static const size_t s_items = 100000;
+    will::FiberMutex mutex;
+    will::FiberCondition cond;
+    size_t queued = 0, consumed = 0, timeouts = 0;
+    uint64_t start = will::GetCurrentUS();
+    uint64_t timeout_used = 0;
+    {
+        will::IOManager iom(2, false, "condition");
+        for (int c = 0; c < 2; ++c) {
+            iom.schedule([&]() {
+                will::FiberMutex::Lock lock(mutex);
+                while (true) {
+                    while (queued == 0) {
+                        uint64_t wait_start = will::GetCurrentMS();
+                        if (!cond.wait(mutex, 50)) {
+                            ++timeouts;
+                            timeout_used = will::GetCurrentMS() - wait_start;
+                            return;
+                        }
+                    }
+                    --queued;
+                    ++consumed;
+                }
+            });
+        }
+        iom.schedule([&]() {
+            for (size_t i = 0; i < s_items; ++i) {
+                will::FiberMutex::Lock lock(mutex);
+                ++queued;
+                cond.notifyOne();
+            }
+        });
+    }
+    uint64_t used = will::GetCurrentUS() - start;
+    WILL_ASSERT(consumed == s_items && timeouts == 2);
+    WILL_LOG_INFO(g_logger) << "condition items=" << s_items
+                            << " used=" << used / 1000 << "ms"
+                            << " timeouts=" << timeouts
+                            << " last_timeout=" << timeout_used << "ms";
+}
+
+// 两个协程通过一对容量为1的通道来回传递消息
+static void bench_channel_pingpong() {
+    static const size_t s_messages = 100000;
+    will::Channel<uint64_t> ping(1), pong(1);
+    uint64_t end   = 0;
+    uint64_t start = will::GetCurrentUS();
+    {
+        will::IOManager iom(2, false, "channel");
+        iom.schedule([&ping, &pong]() {
+            uint64_t v = 0;
+            for (size_t i = 0; i < s_messages; ++i) {
+                ping.send(i);
+                pong.recv(v);
+            }
+            ping.close();
+        });
+        iom.schedule([&ping, &pong, &end]() {
+            uint64_t v = 0;
+            while (ping.recv(v)) {
+                pong.send(v + 1);
+            }
+            end = will::GetCurrentUS();
+        });
+    }
+    uint64_t used = end - start;
+    WILL_LOG_INFO(g_logger) << "channel pingpong messages=" << s_messages * 2
+                            << " used=" << used / 1000 << "ms"
+                            << " msgs/s=" << (used ? s_messages * 2 * 1000000 / used : 0);
+}
+
+// 一个消费者用select同时接收多个生产者的通道，所有通道关闭后结束
+static void bench_channel_select() {
+    static const size_t s_producers = 4;
+    static const size_t s_messages  = 50000;
+    std::vector<std::shared_ptr<will::Channel<uint64_t> > > chans;
+    for (size_t i = 0; i < s_producers; ++i) {
+        chans.emplace_back(new will::Channel<uint64_t>(64));
+    }
+    uint64_t received = 0, timeouts = 0;
+    uint64_t end   = 0;
+    uint64_t start = will::GetCurrentUS();
+    {
+        will::IOManager iom(2, false, "select");
+        for (auto &ch : chans) {
+            iom.schedule([ch]() {
+                for (size_t i = 0; i < s_messages; ++i) {
+                    ch->send(i);
+                }
+                ch->close();
+            });
+        }
+        iom.schedule([&chans, &received, &timeouts, &end]() {
+            std::vector<uint64_t> values(chans.size());
+            std::vector<char> oks(chans.size());
+            will::ChannelSelect sel;
+            for (size_t i = 0; i < chans.size(); ++i) {
+                sel.recv(*chans[i], values[i], (bool *)&oks[i]);
+            }
+            size_t closed = 0;
+            while (closed < chans.size()) {
+                int idx = sel.wait(1000);
+                if (idx < 0) {
+                    ++timeouts;
+                } else if (oks[idx]) {
+                    ++received;
+                } else {
+                    // 关闭的通道一直就绪，停用它的分支
+                    sel.disable(idx);
+                    ++closed;
+                }
+            }
+            // 所有分支都停用后，wait只能等到超时
+            if (sel.wait(20) < 0) {
+                ++timeouts;
+            }
+            end = will::GetCurrentUS();
+        });
+    }
+    uint64_t used = end - start;
+    WILL_ASSERT(received == s_producers * s_messages && timeouts == 1);
+    WILL_LOG_INFO(g_logger) << "channel select producers=" << s_producers
+                            << " messages=" << received
+                            << " used=" << used / 1000 << "ms"
+                            << " msgs/s=" << (used ? received * 1000000 / used : 0);
+}
+
+// 等待一组协程结束：WaitGroup计数和逐个Fiber::join两种方式
+static void bench_waitgroup() {
+    static const size_t s_rounds = 1000;
+    static const size_t s_tasks  = 100;
+    uint64_t wg_used = 0, join_used = 0;
+    std::atomic<uint64_t> ran{0};
+    {
+        will::IOManager iom(2, false, "waitgroup");
+        iom.schedule([&]() {
+            uint64_t start = will::GetCurrentUS();
+            for (size_t r = 0; r < s_rounds; ++r) {
+                will::WaitGroup wg;
+                wg.add(s_tasks);
+                for (size_t i = 0; i < s_tasks; ++i) {
+                    will::IOManager::GetThis()->schedule([&wg, &ran]() {
+                        ++ran;
+                        wg.done();
+                    });
+                }
+                wg.wait();
+            }
+            wg_used = will::GetCurrentUS() - start;
+
+            start = will::GetCurrentUS();
+            std::vector<will::Fiber::ptr> fibers(s_tasks);
+            for (size_t r = 0; r < s_rounds; ++r) {
+                for (size_t i = 0; i < s_tasks; ++i) {
+                    fibers[i].reset(new will::Fiber([&ran]() { ++ran; }));
+                    will::IOManager::GetThis()->schedule(fibers[i]);
+                }
+                for (auto &i : fibers) {
+                    i->join();
+                }
+            }
+            join_used = will::GetCurrentUS() - start;
+        });
+    }
+    WILL_ASSERT(ran == s_rounds * s_tasks * 2);
+    WILL_LOG_INFO(g_logger) << "waitgroup rounds=" << s_rounds << " tasks=" << s_tasks
+                            << " ns/task=" << wg_used * 1000 / (s_rounds * s_tasks)
+                            << " join ns/task=" << join_used * 1000 / (s_rounds * s_tasks);
+}
+
+// 模拟聚合接口：前端IOManager上的协程调用后端IOManager上的s_backends个服务，每个服务耗时10ms
+// 串行逐个等待总耗时是各调用之和，先全部Async出去再get总耗时接近最慢的一个
+// 结果在后端IOManager的线程上写入，等待的协程被放回前端IOManager
+static void bench_scatter_gather() {
+    static const size_t s_backends = 16;
+    static const int s_latency_ms  = 10;
+    uint64_t serial_used = 0, parallel_used = 0, thread_used = 0;
+    uint64_t serial_sum = 0, parallel_sum = 0, thread_sum = 0;
+    bool caught = false;
+    {
+        will::IOManager backend(2, false, "backend");
+        auto call = [&backend](uint64_t i) {
+            return will::Async(&backend, [i]() {
+                usleep(s_latency_ms * 1000);
+                return i * i;
+            });
+        };
+        {
+            will::IOManager frontend(1, false, "frontend");
+            // 挂起等待Future的协程不算调度器的任务，停止前要先等它结束
+            std::shared_ptr<will::Promise<void> > finished(new will::Promise<void>);
+            will::Future<void> finished_future = finished->getFuture();
+            frontend.schedule([&, finished]() {
+                uint64_t start = will::GetCurrentUS();
+                for (size_t i = 0; i < s_backends; ++i) {
+                    serial_sum += call(i).get();
+                }
+                serial_used = will::GetCurrentUS() - start;
+
+                start = will::GetCurrentUS();
+                std::vector<will::Future<uint64_t> > futures;
+                for (size_t i = 0; i < s_backends; ++i) {
+                    futures.push_back(call(i));
+                }
+                for (auto &i : futures) {
+                    parallel_sum += i.get();
+                }
+                parallel_used = will::GetCurrentUS() - start;
+
+                // 后端抛出的异常在get时重新抛出
+                will::Future<void> failed = will::Async(&backend, []() {
+                    throw std::runtime_error("backend failed");
+                });
+                try {
+                    failed.get();
+                } catch (const std::runtime_error &) {
+                    caught = true;
+                }
+                finished->setValue();
+            });
+            finished_future.get();
+        }
+
+        // 不在调度器里的线程也可以等待Future，这时阻塞线程
+        uint64_t start = will::GetCurrentUS();
+        std::vector<will::Future<uint64_t> > futures;
+        for (size_t i = 0; i < s_backends; ++i) {
+            futures.push_back(call(i));
+        }
+        for (auto &i : futures) {
+            thread_sum += i.get();
+        }
+        thread_used = will::GetCurrentUS() - start;
+    }
+    WILL_ASSERT(serial_sum == parallel_sum && parallel_sum == thread_sum && caught);
+    WILL_LOG_INFO(g_logger) << "scatter_gather backends=" << s_backends
+                            << " latency=" << s_latency_ms << "ms"
+                            << " serial=" << serial_used / 1000 << "ms"
+                            << " parallel=" << parallel_used / 1000 << "ms"
+                            << " thread_wait=" << thread_used / 1000 << "ms";
+}
+
+int main(int argc, char **argv) {
+    bench_mutex<will::Spinlock>("spinlock", false);
+    bench_mutex<will::Mutex>("mutex", false);
+    bench_mutex<will::FiberMutex>("fiber_mutex", false);
+    bench_mutex<will::FiberMutex>("fiber_mutex", true);
+    bench_semaphore();
+    bench_condition();
+    bench_channel_pingpong();
+    bench_channel_select();
+    bench_waitgroup();
+    bench_scatter_gather();
+    return 0;
+}
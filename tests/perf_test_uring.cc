@@ -0,0 +1,133 @@
+#include "../will/will.h"
+#include <algorithm>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+static will::Logger::ptr g_logger = WILL_LOG_ROOT();
+
+static const size_t s_msg_size = 64;
+
+static int listen_local() {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    int on = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family      = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    WILL_ASSERT(bind(fd, (sockaddr *)&addr, sizeof(addr)) == 0);
+    WILL_ASSERT(listen(fd, 4096) == 0);
+    return fd;
+}
+
+static uint16_t get_port(int fd) {
+    sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    getsockname(fd, (sockaddr *)&addr, &len);
+    return ntohs(addr.sin_port);
+}
+
+// 每个连接一个协程，通过hook的read/write挂起，服务端用哪种后端对业务代码透明
+static void echo_server(int lfd) {
+    while (true) {
+        int fd = accept(lfd, nullptr, nullptr);
+        if (fd < 0) {
+            break;
+        }
+        will::IOManager::GetThis()->schedule([fd]() {
+            char buf[256];
+            while (true) {
+                ssize_t n = read(fd, buf, sizeof(buf));
+                if (n <= 0 || write(fd, buf, n) != n) {
+                    break;
+                }
+            }
+            close(fd);
+        });
+    }
+}
+
+// 客户端始终使用epoll，每个连接来回发送rounds次消息，记录每次往返的延迟
+static uint64_t run_clients(uint16_t port, size_t conns, size_t rounds, std::vector<uint64_t> &lats) {
+    std::vector<std::vector<uint64_t>> per_conn(conns);
+    uint64_t start = will::GetCurrentUS();
+    will::WaitGroup wg;
+    wg.add(conns);
+    will::IOManager client(1, false, "client");
+    for (size_t i = 0; i < conns; ++i) {
+        std::vector<uint64_t> &lat = per_conn[i];
+        client.schedule([&wg, &lat, port, rounds]() {
+            int fd = socket(AF_INET, SOCK_STREAM, 0);
+            int on = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+            sockaddr_in addr;
+            memset(&addr, 0, sizeof(addr));
+            addr.sin_family      = AF_INET;
+            addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+            addr.sin_port        = htons(port);
+            WILL_ASSERT(connect(fd, (sockaddr *)&addr, sizeof(addr)) == 0);
+            char msg[s_msg_size] = {0};
+            char buf[s_msg_size];
+            lat.reserve(rounds);
+            for (size_t r = 0; r < rounds; ++r) {
+                uint64_t begin = will::GetCurrentUS();
+                WILL_ASSERT(write(fd, msg, sizeof(msg)) == (ssize_t)sizeof(msg));
+                size_t got = 0;
+                while (got < sizeof(buf)) {
+                    ssize_t n = read(fd, buf + got, sizeof(buf) - got);
+                    WILL_ASSERT(n > 0);
+                    got += n;
+                }
+                lat.push_back(will::GetCurrentUS() - begin);
+            }
+            close(fd);
+            wg.done();
+        });
+    }
+    wg.wait();
+    uint64_t used = will::GetCurrentUS() - start;
+    for (auto &i : per_conn) {
+        lats.insert(lats.end(), i.begin(), i.end());
+    }
+    return used;
+}
+
+static void bench_echo(will::Poller::Type type, size_t conns, size_t rounds) {
+    will::IOManager server(1, false, "server", will::Scheduler::LIST, will::Scheduler::ElasticConfig(),
+                           will::Scheduler::AffinityConfig(), type);
+    server.setStatsEnabled(true);
+    int lfd = will::Async(&server, listen_local).get();
+    uint16_t port = get_port(lfd);
+    server.schedule(std::bind(echo_server, lfd));
+
+    will::IOManager::IoStats before = server.getIoStats();
+    std::vector<uint64_t> lats;
+    uint64_t used = run_clients(port, conns, rounds, lats);
+    will::IOManager::IoStats after = server.getIoStats();
+    server.schedule([lfd]() { close(lfd); });
+
+    std::sort(lats.begin(), lats.end());
+    size_t requests = conns * rounds;
+    uint64_t syscalls = after.syscalls() - before.syscalls();
+    WILL_LOG_INFO(g_logger) << "echo " << (server.getPollerType() == will::Poller::URING ? "io_uring" : "epoll")
+                            << " conns=" << conns << " rounds=" << rounds
+                            << " used=" << used / 1000 << "ms"
+                            << " rps=" << (used ? requests * 1000000 / used : 0)
+                            << " p50=" << lats[lats.size() / 2] << "us"
+                            << " p99=" << lats[lats.size() * 99 / 100] << "us"
+                            << " syscalls/req=" << (double)syscalls / requests
+                            << " (waits=" << after.waits - before.waits
+                            << " ctls=" << after.ctls - before.ctls
+                            << " ios=" << after.ios - before.ios
+                            << " tickles=" << after.tickles - before.tickles
+                            << " submits=" << after.submits - before.submits << ")";
+}
+
+int main(int argc, char **argv) {
+    size_t conns  = argc > 1 ? atoi(argv[1]) : 100;
+    size_t rounds = argc > 2 ? atoi(argv[2]) : 1000;
+    bench_echo(will::Poller::EPOLL, conns, rounds);
+    bench_echo(will::Poller::URING, conns, rounds);
+    return 0;
+}